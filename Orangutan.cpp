@@ -26,6 +26,12 @@
 
 #include "Orangutan.h"
 
+#if ORANGUTAN_SIMD >= 2
+# include <immintrin.h>
+#elif ORANGUTAN_SIMD >= 1
+# include <emmintrin.h>
+#endif
+
 const Ogre::String Orangutan::Librarian::MOVABLE_OBJECT_NAME = "OrangutanGeometry";
 const Ogre::String Orangutan::Geometry::DEFAULT_MATERIAL_NAME = "BaseWhiteNoLighting";
 const Ogre::Vector3 Orangutan::Quad::QUAD_VERTICES[4] = 
@@ -51,10 +57,392 @@ template<> Orangutan::Librarian* Ogre::Singleton<Orangutan::Librarian>::ms_Singl
 
 #define PUSH_VERTEX(VERTEX, NEW_VERTEX) VERTEX.position = NEW_VERTEX; vertices.push_back(VERTEX);
 
+#if ORANGUTAN_TRACING
+# define ORANGUTAN_TRACE(MESSAGE) std::cout << "[Orangutan] " << MESSAGE << "\n";
+#else
+# define ORANGUTAN_TRACE(MESSAGE)
+#endif
+
+#if ORANGUTAN_STATISTICS
+# define ORANGUTAN_STAT(STATEMENT) STATEMENT;
+#else
+# define ORANGUTAN_STAT(STATEMENT)
+#endif
+
 namespace Orangutan
 {
  
  
+#if ORANGUTAN_STATISTICS
+// Made before main rather than on first use, as C++03 doesn't make the construction of a
+// function-local static thread safe, and redraws are timed on worker threads.
+static Ogre::Timer STATISTICS_TIMER;
+
+static unsigned long getMicroseconds()
+{
+ return STATISTICS_TIMER.getMicroseconds();
+}
+#endif
+
+// Distance, or fraction of a face, that still counts as touching for hidden face removal and quad merging.
+static const Ogre::Real HIDDEN_FACE_EPSILON = 0.001f;
+
+static bool sameFaceCell(const GeometryCell::Key& a, const GeometryCell::Key& b)
+{
+ return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+/* function. isQuadCovered
+   desc.
+       If the quad (as laid out in Quad::mVertices) lies inside of cover, on the same plane and facing the other way.
+*/
+static bool isQuadCovered(const Vertex* quad, const Vertex* cover)
+{
+ 
+ Ogre::Vector3 normal = (quad[0].position - quad[2].position).crossProduct(quad[1].position - quad[2].position);
+ Ogre::Vector3 coverNormal = (cover[0].position - cover[2].position).crossProduct(cover[1].position - cover[2].position);
+ normal.normalise();
+ coverNormal.normalise();
+ 
+ if (normal.dotProduct(coverNormal) > HIDDEN_FACE_EPSILON - 1)
+  return false;
+ 
+ // Corners of quad in terms of the edges C-A and C-D of cover.
+ Ogre::Vector3 origin = cover[2].position, u = cover[0].position - origin, v = cover[3].position - origin;
+ Ogre::Real uu = u.squaredLength(), vv = v.squaredLength();
+ if (uu == 0 || vv == 0)
+  return false;
+ 
+ for (size_t i=0;i < 4;i++)
+ {
+  Ogre::Vector3 d = quad[i].position - origin;
+  if (Ogre::Math::Abs(d.dotProduct(coverNormal)) > HIDDEN_FACE_EPSILON)
+   return false;
+  Ogre::Real s = d.dotProduct(u) / uu, t = d.dotProduct(v) / vv;
+  if (s < -HIDDEN_FACE_EPSILON || s > 1 + HIDDEN_FACE_EPSILON || t < -HIDDEN_FACE_EPSILON || t > 1 + HIDDEN_FACE_EPSILON)
+   return false;
+ }
+ 
+ return true;
+}
+
+static bool lessVertexBits(const std::pair<const Vertex*, size_t>& a, const std::pair<const Vertex*, size_t>& b)
+{
+ return memcmp(a.first, b.first, sizeof(Vertex)) < 0;
+}
+
+/* function. optimiseTriangles
+   desc.
+       Weld bit-identical vertices, reorder the triangles for the post-transform vertex
+       cache with Tipsify (Sander, Nehab and Barczak 2007), then reorder the vertices in the
+       order they are first used. Unused vertices are removed from vertices.
+*/
+static void optimiseTriangles(std::vector<Vertex>& vertices, std::vector<Index32>& indexes)
+{
+ 
+ const size_t CACHE_SIZE = 16;
+ size_t vertexCount = vertices.size(), triangleCount = indexes.size() / 3;
+ if (vertexCount == 0 || triangleCount == 0)
+  return;
+ 
+ // Weld, by sorting the vertices by their bits.
+ std::vector< std::pair<const Vertex*, size_t> > sorted(vertexCount);
+ for (size_t i=0;i < vertexCount;i++)
+  sorted[i] = std::make_pair(&vertices[i], i);
+ std::sort(sorted.begin(), sorted.end(), lessVertexBits);
+ 
+ std::vector<Index32> weld(vertexCount);
+ for (size_t i=0;i < vertexCount;i++)
+  if (i != 0 && memcmp(sorted[i].first, sorted[i - 1].first, sizeof(Vertex)) == 0)
+   weld[sorted[i].second] = weld[sorted[i - 1].second];
+  else
+   weld[sorted[i].second] = Index32(sorted[i].second);
+ 
+ for (size_t i=0;i < triangleCount * 3;i++)
+  indexes[i] = weld[indexes[i]];
+ 
+ // Triangles using each vertex.
+ std::vector<size_t> live(vertexCount, 0), offsets(vertexCount + 1, 0), triangles(triangleCount * 3);
+ for (size_t i=0;i < triangleCount * 3;i++)
+  live[indexes[i]]++;
+ for (size_t i=0;i < vertexCount;i++)
+  offsets[i + 1] = offsets[i] + live[i];
+ std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+ for (size_t i=0;i < triangleCount * 3;i++)
+  triangles[fill[indexes[i]]++] = i / 3;
+ 
+ // Tipsify; fan around a vertex, then move onto the vertex most likely to still be cached.
+ std::vector<size_t> cacheTime(vertexCount, 0), deadEnd, candidates;
+ std::vector<bool> emitted(triangleCount, false);
+ std::vector<Index32> output;
+ output.reserve(triangleCount * 3);
+ size_t time = CACHE_SIZE + 1, cursor = 0;
+ long fanning = 0;
+ 
+ while (fanning >= 0)
+ {
+  
+  candidates.clear();
+  for (size_t i=offsets[fanning];i < offsets[fanning + 1];i++)
+  {
+   size_t triangle = triangles[i];
+   if (emitted[triangle])
+    continue;
+   for (size_t j=0;j < 3;j++)
+   {
+    Index32 vertex = indexes[triangle * 3 + j];
+    output.push_back(vertex);
+    deadEnd.push_back(vertex);
+    candidates.push_back(vertex);
+    live[vertex]--;
+    if (time - cacheTime[vertex] > CACHE_SIZE)
+     cacheTime[vertex] = time++;
+   }
+   emitted[triangle] = true;
+  }
+  
+  // Prefer the oldest candidate that will still be in the cache after its fan.
+  fanning = -1;
+  long best = -1;
+  for (std::vector<size_t>::iterator it = candidates.begin(); it != candidates.end();it++)
+  {
+   if (live[*it] == 0)
+    continue;
+   long priority = 0;
+   if (time - cacheTime[*it] + 2 * live[*it] <= CACHE_SIZE)
+    priority = long(time - cacheTime[*it]);
+   if (priority > best)
+   {
+    best = priority;
+    fanning = long(*it);
+   }
+  }
+  
+  if (fanning >= 0)
+   continue;
+  
+  while (deadEnd.empty() == false && fanning < 0)
+  {
+   if (live[deadEnd.back()] > 0)
+    fanning = long(deadEnd.back());
+   deadEnd.pop_back();
+  }
+  
+  while (fanning < 0 && cursor < vertexCount)
+  {
+   if (live[cursor] > 0)
+    fanning = long(cursor);
+   cursor++;
+  }
+ }
+ 
+ // Vertices in the order they are first used.
+ std::vector<Index32> order(vertexCount, Index32(-1));
+ std::vector<Vertex> reordered;
+ reordered.reserve(vertexCount);
+ for (size_t i=0;i < output.size();i++)
+ {
+  Index32 vertex = output[i];
+  if (order[vertex] == Index32(-1))
+  {
+   order[vertex] = Index32(reordered.size());
+   reordered.push_back(vertices[vertex]);
+  }
+  indexes[i] = order[vertex];
+ }
+ 
+ vertices.swap(reordered);
+}
+
+/*! struct. IndexPatternKey
+    desc.
+        What a Displacement patch's indexes depend on; pitch is the vertices in a row of the
+        Displacement, edges are the detail of each side after stitching (-x, +x, -z, +z).
+*/
+struct IndexPatternKey
+{
+ size_t lengthX, lengthZ, pitch, lod, edges[4];
+ 
+ bool operator<(const IndexPatternKey& other) const
+ {
+  return memcmp(this, &other, sizeof(IndexPatternKey)) < 0;
+ }
+};
+
+/*! function. snapToStep
+    desc.
+        Move a vertex on an edge to the nearest corner of a patch with less detail before it.
+*/
+static size_t snapToStep(size_t p, size_t step, size_t end)
+{
+ return p == end ? end : p - (p % step);
+}
+
+/*! struct. IndexPattern
+    desc.
+        Indexes of a patch relative to its first vertex, and how many patches use them.
+*/
+struct IndexPattern
+{
+ IndexPatternKey key;
+ size_t users;
+ std::vector<Index32> indexes;
+};
+
+// Every pattern in use, only touched while updating Brushes on the main thread.
+static std::map<IndexPatternKey, IndexPattern> INDEX_PATTERNS;
+
+/*! function. acquireIndexPattern
+    desc.
+        Indexes of a patch, made once and then shared by every patch of every Displacement
+        with the same size, detail and stitching; a Displacement without LOD is a single
+        patch. Each vertex on an edge with less detail is moved along the edge onto the
+        neighbour's vertices; the triangles left with no area are not drawn. Each pattern
+        acquired is given back with releaseIndexPattern.
+*/
+static IndexPattern* acquireIndexPattern(const IndexPatternKey& key)
+{
+ 
+ std::map<IndexPatternKey, IndexPattern>::iterator it = INDEX_PATTERNS.find(key);
+ if (it != INDEX_PATTERNS.end())
+ {
+  (*it).second.users++;
+  return &(*it).second;
+ }
+ 
+ IndexPattern& pattern = INDEX_PATTERNS[key];
+ pattern.key = key;
+ pattern.users = 1;
+ std::vector<Index32>& indexes = pattern.indexes;
+ 
+ size_t step = size_t(1) << key.lod;
+ size_t edgeStep[4];
+ for (size_t i=0;i < 4;i++)
+  edgeStep[i] = size_t(1) << key.edges[i];
+ 
+ // Vertices along each side; the last row or column may be narrower.
+ std::vector<size_t> xs, zs;
+ for (size_t x=0;x < key.lengthX;x += step)
+  xs.push_back(x);
+ xs.push_back(key.lengthX);
+ for (size_t z=0;z < key.lengthZ;z += step)
+  zs.push_back(z);
+ zs.push_back(key.lengthZ);
+ 
+ for (size_t j=0;j < zs.size() - 1;j++)
+ {
+  for (size_t i=0;i < xs.size() - 1;i++)
+  {
+   
+   Index32 corners[4];
+   for (size_t k=0;k < 4;k++)
+   {
+    size_t x = xs[i + (k & 1)], z = zs[j + (k >> 1)];
+    if (x == 0)
+     z = snapToStep(z, edgeStep[0], key.lengthZ);
+    else if (x == key.lengthX)
+     z = snapToStep(z, edgeStep[1], key.lengthZ);
+    if (z == 0)
+     x = snapToStep(x, edgeStep[2], key.lengthX);
+    else if (z == key.lengthZ)
+     x = snapToStep(x, edgeStep[3], key.lengthX);
+    corners[k] = x + z * key.pitch;
+   }
+   
+   // Same winding and alternating diagonals as the full grid.
+   Index32 a = corners[0], b = corners[1], c = corners[2], d = corners[3];
+   Index32 triangles[6];
+   if (((i + j) & 1) == 0)
+   {
+    triangles[0] = c; triangles[1] = b; triangles[2] = a;
+    triangles[3] = c; triangles[4] = d; triangles[5] = b;
+   }
+   else
+   {
+    triangles[0] = c; triangles[1] = d; triangles[2] = a;
+    triangles[3] = a; triangles[4] = d; triangles[5] = b;
+   }
+   
+   for (size_t k=0;k < 6;k += 3)
+   {
+    if (triangles[k] == triangles[k+1] || triangles[k+1] == triangles[k+2] || triangles[k] == triangles[k+2])
+     continue;
+    indexes.insert(indexes.end(), triangles + k, triangles + k + 3);
+   }
+  }
+ }
+ 
+ return &pattern;
+}
+
+/*! function. releaseIndexPattern
+    desc.
+        Give back a pattern from acquireIndexPattern, freeing it when nothing else uses it;
+        a whole grid pattern is several megabytes.
+*/
+static void releaseIndexPattern(IndexPattern* pattern)
+{
+ if (--pattern->users == 0)
+  INDEX_PATTERNS.erase(pattern->key);
+}
+
+static Ogre::HardwareBuffer::LockOptions getWriteLock(Ogre::HardwareBuffer* buffer, size_t offset, size_t length)
+{
+ // A write of the whole buffer can start on a fresh one. A range is rewritten in place
+ // while the GPU may still be drawing last frame from it, so it has to wait (never
+ // HBL_NO_OVERWRITE, which would let the two race).
+ if (offset == 0 && length == buffer->getSizeInBytes())
+  return Ogre::HardwareBuffer::HBL_DISCARD;
+ return Ogre::HardwareBuffer::HBL_NORMAL;
+}
+
+static unsigned long getFrameNumber()
+{
+ Ogre::Root* root = Ogre::Root::getSingletonPtr();
+ return root ? root->getNextFrameNumber() : 0;
+}
+
+void TaskScheduler::run(Task** tasks, size_t count)
+{
+#ifdef _OPENMP
+ int taskCount = int(count);
+# pragma omp parallel for schedule(dynamic)
+ for (int i=0;i < taskCount;i++)
+  tasks[i]->execute();
+#else
+ for (size_t i=0;i < count;i++)
+  tasks[i]->execute();
+#endif
+}
+
+void TaskScheduler::runInBackground(Task* task)
+{
+ task->execute();
+}
+
+WorkQueueTaskScheduler::WorkQueueTaskScheduler()
+{
+ Ogre::WorkQueue* queue = Ogre::Root::getSingleton().getWorkQueue();
+ mChannel = queue->getChannel("Orangutan");
+ queue->addRequestHandler(mChannel, this);
+}
+
+WorkQueueTaskScheduler::~WorkQueueTaskScheduler()
+{
+ Ogre::Root::getSingleton().getWorkQueue()->removeRequestHandler(mChannel, this);
+}
+
+void WorkQueueTaskScheduler::runInBackground(Task* task)
+{
+ Ogre::Root::getSingleton().getWorkQueue()->addRequest(mChannel, 0, Ogre::Any(task));
+}
+
+Ogre::WorkQueue::Response* WorkQueueTaskScheduler::handleRequest(const Ogre::WorkQueue::Request* request, const Ogre::WorkQueue* queue)
+{
+ Ogre::any_cast<Task*>(request->getData())->execute();
+ return OGRE_NEW Ogre::WorkQueue::Response(request, true, Ogre::Any());
+}
+
 void writeOok(std::ofstream& stream, const Ogre::Vector3& vec, const Ogre::String& prefix = Ogre::StringUtil::BLANK)
 {
  stream << prefix << vec.x << " " << vec.y << " " << vec.z << "\n";
@@ -93,7 +481,7 @@ void writeOok(std::ofstream& stream, bool val, const Ogre::String& prefix = Ogre
 }
 
 
-void writeOok(std::ofstream& stream, buffer<float> heights, const Ogre::String& prefix = Ogre::StringUtil::BLANK)
+void writeOok(std::ofstream& stream, const buffer<float>& heights, const Ogre::String& prefix = Ogre::StringUtil::BLANK)
 {
  stream << prefix << heights.size() << " [\n";
  size_t i=0;
@@ -112,7 +500,7 @@ void writeOok(std::ofstream& stream, buffer<float> heights, const Ogre::String&
 }
 
 
-void writeOok(std::ofstream& stream, buffer<Ogre::ColourValue> colours, const Ogre::String& prefix = Ogre::StringUtil::BLANK)
+void writeOok(std::ofstream& stream, const buffer<Ogre::ColourValue>& colours, const Ogre::String& prefix = Ogre::StringUtil::BLANK)
 {
  stream << prefix << colours.size() << " [\n";
  size_t i=0;
@@ -166,420 +554,2378 @@ void Librarian::destroyInstance(Ogre::MovableObject* obj)
 
  
 Geometry::Geometry(const Ogre::String& name)
-: MovableObject(name), mRedrawNeeded(false)
+: MovableObject(name), mCellSize(0), mCamera(0), mLodCamera(0), mLodFrame(0xFFFFFFFF), mTaskScheduler(0), mAsync(false), mAsyncRunning(false), mAsyncFinished(false), mEditVersion(0), mAsyncVersion(0), mVisibleVersion(0), mListener(0), mBlockInstancing(BlockInstancing_None), mVertexCacheOptimisation(false), mQuadMerging(false), mHiddenFaceRemoval(false), mFaceGridSize(1), mUpdateDepth(0), mRedrawNeeded(false), mVertexFormat(VertexFormat_Colour), mUsageHint(UsageHint_Adaptive)
 {
+ mBackgroundRedraw.mGeometry = this;
  mAABB.setExtents(Ogre::Vector3(-1,-1,-1), Ogre::Vector3(1,1,1));
- // Push back the default geometry.
- mGeometries[0] = OGRE_NEW GeometryRenderable("BaseWhiteNoLighting", Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME, this, 0);
+ // The default material.
+ mMaterials[0] = MaterialName("BaseWhiteNoLighting", Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME);
 }
 
 Geometry::~Geometry()
 {
- // TODO: Delete Geometries.
- for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
-  OGRE_DELETE (*it).second;
- mGeometries.clear();
+ // Brushes are owned by the Geometry; Displacements also give back their shared index patterns.
+ destroyAll();
+ _destroyCells();
 }
 
 void Geometry::setMaterialName(size_t index, const Ogre::String& materialName, const Ogre::String& group)
 {
  
- GeometryRenderables::iterator it = mGeometries.find(index);
- if (it != mGeometries.end())
- {
-  (*it).second->setMaterialName(materialName, group);
-  mRedrawNeeded = true;
+ mMaterials[index] = MaterialName(materialName, group);
+ 
+ for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+  if ((*it)->mIndex == index)
+   (*it)->setMaterialName(materialName, group);
+ 
+ for (std::vector<BlockInstances*>::iterator it = mBlockInstances.begin(); it != mBlockInstances.end();it++)
+  if ((*it)->getIndex() == index && (*it)->isHardware() == false)
+   (*it)->setMaterialName(materialName, group);
+ 
+ mRedrawNeeded = true;
+}
+
+void Geometry::setVertexFormat(VertexFormat format)
+{
+#if ORANGUTAN_HALF_UV == 0
+ format = VertexFormat_Colour;
+#endif
+ 
+ if (format == mVertexFormat)
   return;
+ 
+ waitForRedraw();
+ mVertexFormat = format;
+ for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+ {
+  (*it)->setVertexFormat(format);
+  redrawNeeded((*it), true);
  }
-
- GeometryRenderable* renderable = OGRE_NEW GeometryRenderable(materialName, group, this, index);
- mGeometries[index] = renderable;
 }
 
-GeometryRenderable* Geometry::getOrCreateRenderable(size_t index, const Ogre::String& materialName, const Ogre::String& groupName)
+void Geometry::setUsageHint(UsageHint hint)
 {
- GeometryRenderables::iterator it = mGeometries.find(index);
- if (it != mGeometries.end())
-  return (*it).second;
- GeometryRenderable* renderable = OGRE_NEW GeometryRenderable(materialName, groupName, this, index);
- mGeometries[index] = renderable;
- return renderable;
+ waitForRedraw();
+ mUsageHint = hint;
+ for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+  (*it)->setUsageHint(hint);
 }
 
-Plane*  Geometry::createPlane(const Ogre::Vector3& position, const Ogre::Vector2& size, const Ogre::Quaternion& orientation, size_t materialIndex )
+void Geometry::setCellSize(Ogre::Real size)
 {
  
- Plane* plane = OGRE_NEW Orangutan::Plane(position, size, orientation, materialIndex, this);
- mPlanes.push_back(plane);
- GeometryRenderable* renderable = getOrCreateRenderable(materialIndex);
- renderable->pushBrush(plane);
- return plane;
+ if (size < 0)
+  size = 0;
+ 
+ if (size == mCellSize)
+  return;
+ 
+ waitForRedraw();
+ mCellSize = size;
+ 
+ // Throw away the old cells, and put everything into new ones.
+ _destroyCells();
+ 
+ for (std::vector<Plane*>::iterator it = mPlanes.begin(); it != mPlanes.end();it++)
+ {
+  (*it)->mRenderable = 0;
+  _brushChanged(*it);
+ }
+ 
+ for (std::vector<Displacement*>::iterator it = mDisplacements.begin(); it != mDisplacements.end();it++)
+ {
+  (*it)->mRenderable = 0;
+  _brushChanged(*it);
+ }
+ 
+ for (std::vector<Block*>::iterator it = mBlocks.begin(); it != mBlocks.end();it++)
+  _addBlock(*it);
+ 
 }
 
-void  Geometry::destroyPlane(Plane* Plane)
+void Geometry::trimMemory()
 {
- GeometryRenderable* renderable = getOrCreateRenderable(Plane->getIndex());
- renderable->popBrush(Plane);
- mPlanes.erase(std::find(mPlanes.begin(), mPlanes.end(), Plane));
- OGRE_DELETE Plane;
+ waitForRedraw();
+ for (std::vector<Displacement*>::iterator it = mDisplacements.begin(); it != mDisplacements.end();it++)
+  (*it)->_trimMemory();
+ 
+ for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+  (*it)->trimMemory();
 }
 
-
-Displacement*  Geometry::createDisplacement(const Ogre::Vector3& position, const Ogre::Vector3& scale, const Ogre::Quaternion& orientation, size_t materialIndex)
+GeometryCell* Geometry::getOrCreateCell(const Ogre::AxisAlignedBox& aabb)
 {
- Displacement* displacement = OGRE_NEW Orangutan::Displacement(position, scale, orientation, materialIndex, this);
- mDisplacements.push_back(displacement);
- GeometryRenderable* renderable = getOrCreateRenderable(materialIndex);
- renderable->pushBrush(displacement);
- return displacement;
+ 
+ GeometryCell::Key key;
+ key.x = key.y = key.z = 0;
+ 
+ if (mCellSize > 0 && aabb.isFinite())
+ {
+  Ogre::Vector3 centre = aabb.getCenter() / mCellSize;
+  key.x = int(Ogre::Math::Floor(centre.x));
+  key.y = int(Ogre::Math::Floor(centre.y));
+  key.z = int(Ogre::Math::Floor(centre.z));
+ }
+ 
+ GeometryCells::iterator it = mCells.find(key);
+ if (it != mCells.end())
+  return (*it).second;
+ 
+ GeometryCell* cell = OGRE_NEW GeometryCell(key);
+ mCells[key] = cell;
+ return cell;
 }
 
-void  Geometry::destroyDisplacement(Displacement* displacement)
+GeometryRenderable* Geometry::getOrCreateRenderable(GeometryCell* cell, size_t index)
 {
- GeometryRenderable* renderable = getOrCreateRenderable(displacement->getIndex());
- renderable->popBrush(displacement);
- mDisplacements.erase(std::find(mDisplacements.begin(), mDisplacements.end(), displacement));
- OGRE_DELETE displacement;
+ if (index >= cell->mRenderables.size())
+  cell->mRenderables.resize(index + 1, 0);
+ 
+ if (cell->mRenderables[index])
+  return cell->mRenderables[index];
+ 
+ const MaterialName& material = _getMaterialName(index);
+ GeometryRenderable* renderable = OGRE_NEW GeometryRenderable(material.first, material.second, this, cell, index);
+ cell->mRenderables[index] = renderable;
+ mGeometries.push_back(renderable);
+ return renderable;
 }
 
-Block*  Geometry::createBlock(const Ogre::Vector3& position, const Ogre::Vector3& size, const Ogre::Quaternion& orientation, size_t materialIndex)
+const Geometry::MaterialName& Geometry::_getMaterialName(size_t index)
 {
- Block* block = OGRE_NEW Orangutan::Block(position, size, orientation, materialIndex, this);
- mBlocks.push_back(block);
- GeometryRenderable* renderable = getOrCreateRenderable(materialIndex);
- redrawNeeded(materialIndex);
- return block;
+ MaterialNames::iterator it = mMaterials.find(index);
+ if (it == mMaterials.end())
+  it = mMaterials.insert(std::make_pair(index, MaterialName(DEFAULT_MATERIAL_NAME, Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME))).first;
+ return (*it).second;
 }
 
-void   Geometry::destroyBlock(Block* block)
+void Geometry::_destroyCells()
 {
- mBlocks.erase(std::find(mBlocks.begin(), mBlocks.end(), block));
- 
  for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
-  redrawNeeded((*it).first);
+  OGRE_DELETE (*it);
+ mGeometries.clear();
+ mDrawnGeometries.clear();
  
- OGRE_DELETE block;
+ for (std::vector<BlockInstances*>::iterator it = mBlockInstances.begin(); it != mBlockInstances.end();it++)
+  OGRE_DELETE (*it);
+ mBlockInstances.clear();
+ 
+ for (GeometryCells::iterator it = mCells.begin(); it != mCells.end();it++)
+  OGRE_DELETE (*it).second;
+ mCells.clear();
+ 
+ for (std::vector<Block*>::iterator it = mBlocks.begin(); it != mBlocks.end();it++)
+ {
+  (*it)->mCell = 0;
+  (*it)->mInstances = 0;
+  (*it)->mAdded = false;
+ }
 }
 
-void  Geometry::_renderVertices()
+void Geometry::_brushChanged(Brush* brush)
 {
- mAABB.setNull();
- // Each GeometryRenderable, redraw (if needed) and then copy to mVertexBuffer.
- for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+ 
+ GeometryRenderable* renderable = getOrCreateRenderable(getOrCreateCell(brush->getAABB()), brush->getIndex());
+ 
+ if (renderable == brush->mRenderable)
  {
-  (*it).second->_renderVertices(false);
-  mAABB.merge((*it).second->mAABB);
+  redrawNeeded(renderable);
+  return;
  }
- if (mParentNode)
-  mParentNode->needUpdate();
+ 
+ // It has moved into another cell, or is using another material.
+ if (brush->mRenderable)
+  brush->mRenderable->popBrush(brush);
+ 
+ renderable->pushBrush(brush);
+ brush->mRenderable = renderable;
 }
 
-void  Geometry::_updateRenderQueue(Ogre::RenderQueue* queue)
+void Geometry::_addBlock(Block* block)
 {
  
- if (mRedrawNeeded)
- {
-  mRedrawNeeded = false;
-  _renderVertices();
- }
+ if (block->mAdded)
+  return;
  
- for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+ block->mCell = getOrCreateCell(block->getAABB());
+ block->mAdded = true;
+ 
+ if (mBlockInstancing != BlockInstancing_None && block->_isInstanceable())
  {
-  if ((*it).second->isEmpty())
-   continue; // Avoid empty Geometries
-  
-  if (mRenderQueuePrioritySet)
-  {
-   assert(mRenderQueueIDSet == true);
-   queue->addRenderable((*it).second, mRenderQueueID, mRenderQueuePriority);
-  }
-  else if (mRenderQueueIDSet)
-   queue->addRenderable((*it).second, mRenderQueueID);
-  else
-   queue->addRenderable((*it).second);
+  size_t faces = block->_getDrawnFaces();
+  size_t index = 0;
+  while ((faces & (1 << index)) == 0)
+   index++;
+  _getOrCreateInstances(block->mCell, block->_getPartIndex(index), faces)->addInstance(block);
+  return;
  }
  
+ for (size_t i=0;i < block->_getPartCount();i++)
+  if (block->_hasPart(i))
+   _addPart(block, i);
 }
 
-void  Geometry::visitRenderables(Ogre::Renderable::Visitor* visitor, bool debugRenderables)
+void Geometry::_removeBlock(Block* block)
 {
- for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
-  visitor->visit((*it).second, 0, false);
+ 
+ if (block->mAdded == false)
+  return;
+ 
+ block->mAdded = false;
+ 
+ if (block->mInstances)
+ {
+  block->mInstances->removeInstance(block);
+  return;
+ }
+ 
+ for (size_t i=0;i < block->_getPartCount();i++)
+  if (block->_hasPart(i))
+   _removePart(block, i);
 }
 
-
-void Geometry::loadFromOokFile(const Ogre::String& filename, const Ogre::String& resourceGroup)
+void Geometry::_refreshBlock(Block* block)
 {
-
+ 
+ // Faces being added or taken away is done by the caller.
+ if (block->mAdded == false)
+  return;
+ 
+ if (block->mInstances || (mBlockInstancing != BlockInstancing_None && block->_isInstanceable()))
+ {
+  _removeBlock(block);
+  _addBlock(block);
+ }
+ else
+  block->redrawNeeded();
 }
 
-
-void Geometry::saveAsOokFile(const Ogre::String& filename)
+void Geometry::_blockMoved(Block* block)
 {
  
- std::ofstream stream;
- stream.open(filename.c_str(), std::ios::out | std::ios::binary);
- stream << "OOK! 0.1\n";
- 
- for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
-  stream << "uses \"" << (*it).second->getMaterial()->getName() << "\" as " << (*it).first << "\n";
+ if (block->mAdded == false)
+  return;
  
- stream << "\n";
- size_t id = 0;
+ if (getOrCreateCell(block->getAABB()) != block->mCell)
+ {
+  _removeBlock(block);
+  _addBlock(block);
+ }
+ else if (block->mInstances)
+  block->mInstances->updateInstance(block);
+ else
+  block->redrawNeeded();
+}
 
- // Planes
- // ----------------------------------------
- for (std::vector<Plane*>::iterator it = mPlanes.begin(); it != mPlanes.end();it++)
-  (*it)->saveToOok(stream);
- 
- // Displacements
- // ----------------------------------------
- for (std::vector<Displacement*>::iterator it = mDisplacements.begin(); it != mDisplacements.end();it++)
-  (*it)->saveToOok(stream);
+void Geometry::_instancesChanged()
+{
+ mEditVersion++;
+ if (mRedrawNeeded)
+  return;
+ mRedrawNeeded = true;
+ if (mParentNode)
+  mParentNode->needUpdate();
+}
 
- stream << "\n";
- stream.close();
+BlockInstances* Geometry::_getOrCreateInstances(GeometryCell* cell, size_t index, size_t faces)
+{
+ 
+ for (std::vector<BlockInstances*>::iterator it = cell->mInstances.begin(); it != cell->mInstances.end();it++)
+  if ((*it)->getIndex() == index && (*it)->getFaces() == faces)
+   return (*it);
+ 
+ // Hardware instancing needs a material that reads the instances, and a render system that can.
+ bool hardware = false;
+ MaterialName material = _getMaterialName(index);
+#if ORANGUTAN_HARDWARE_INSTANCING
+ MaterialNames::iterator instanced = mInstancedMaterials.find(index);
+ if (mBlockInstancing == BlockInstancing_Hardware && instanced != mInstancedMaterials.end())
+ {
+  Ogre::RenderSystem* renderSystem = Ogre::Root::getSingleton().getRenderSystem();
+  if (renderSystem && renderSystem->getCapabilities()->hasCapability(Ogre::RSC_VERTEX_BUFFER_INSTANCE_DATA))
+  {
+   hardware = true;
+   material = (*instanced).second;
+  }
+ }
+#endif
+ 
+ BlockInstances* instances = OGRE_NEW BlockInstances(material.first, material.second, this, cell, index, faces, hardware);
+ cell->mInstances.push_back(instances);
+ mBlockInstances.push_back(instances);
+ return instances;
 }
 
-void Geometry::saveAsMesh(const Ogre::String& filename)
+void Geometry::_regroupBlocks()
 {
+ 
+ for (std::vector<Block*>::iterator it = mBlocks.begin(); it != mBlocks.end();it++)
+  _removeBlock(*it);
+ 
+ for (std::vector<BlockInstances*>::iterator it = mBlockInstances.begin(); it != mBlockInstances.end();it++)
+  OGRE_DELETE (*it);
+ mBlockInstances.clear();
+ 
+ for (GeometryCells::iterator it = mCells.begin(); it != mCells.end();it++)
+  (*it).second->mInstances.clear();
+ 
+ for (std::vector<Block*>::iterator it = mBlocks.begin(); it != mBlocks.end();it++)
+  _addBlock(*it);
+ 
+ _instancesChanged();
+}
 
+void Geometry::setBlockInstancing(BlockInstancing instancing)
+{
+ 
+ if (instancing == mBlockInstancing)
+  return;
+ 
+ waitForRedraw();
+ mBlockInstancing = instancing;
+ _regroupBlocks();
+ 
 }
 
-// ----------------------------------------------------------------------------------------
+void Geometry::setInstancedMaterialName(size_t index, const Ogre::String& materialName, const Ogre::String& group)
+{
+ 
+ waitForRedraw();
+ mInstancedMaterials[index] = MaterialName(materialName, group);
+ 
+ if (mBlockInstancing == BlockInstancing_Hardware)
+  _regroupBlocks();
+ 
+}
 
+void Geometry::_addPart(MultiBrush* brush, size_t part)
+{
+ if (brush->mCell)
+  getOrCreateRenderable(brush->mCell, brush->_getPartIndex(part))->pushPart(brush, part);
+}
 
+void Geometry::_removePart(MultiBrush* brush, size_t part)
+{
+ if (brush->mCell)
+  getOrCreateRenderable(brush->mCell, brush->_getPartIndex(part))->popPart(brush, part);
+}
 
+// Take the destroyed items out of a pending list in one pass; destroyed must be sorted.
+template<typename T> static void removeDestroyed(std::vector<T*>& pending, const std::vector<T*>& destroyed)
+{
+ size_t kept = 0;
+ for (size_t i=0;i < pending.size();i++)
+  if (std::binary_search(destroyed.begin(), destroyed.end(), pending[i]) == false)
+   pending[kept++] = pending[i];
+ pending.resize(kept);
+}
 
- 
-GeometryRenderable::GeometryRenderable(const Ogre::String& materialName, const Ogre::String& materialGroup, Geometry* parent, size_t index)
-: mMaterialName(materialName),
-  mMaterialGroup(materialGroup),
-  mParent(parent),
-  mVertexBufferSize(0),
-  mIndexBufferSize(0),
-  mIndex(index)
+Plane*  Geometry::createPlane(const Ogre::Vector3& position, const Ogre::Vector2& size, const Ogre::Quaternion& orientation, size_t materialIndex )
 {
- _create();
+ 
+ Plane* plane = OGRE_NEW Orangutan::Plane(position, size, orientation, materialIndex, this);
+ plane->mHandle = mPlanes.insert(plane);
+ _brushChanged(plane);
+ return plane;
 }
 
-GeometryRenderable::~GeometryRenderable()
+void  Geometry::destroyPlane(Plane* Plane)
 {
- _destroy();
+ waitForRedraw();
+ if (Plane->mUpdatePending)
+  mPendingBrushes.erase(std::find(mPendingBrushes.begin(), mPendingBrushes.end(), Plane));
+ if (Plane->mRenderable)
+  Plane->mRenderable->popBrush(Plane);
+ mPlanes.erase(Plane->mHandle);
+ OGRE_DELETE Plane;
 }
 
-void GeometryRenderable::_renderVertices(bool force)
+void  Geometry::createPlanes(size_t count, const Ogre::Vector3* positions, const Ogre::Vector2* sizes, const Ogre::Quaternion* orientations, size_t materialIndex, Plane** planes)
 {
-  
- if (mRedrawNeeded == false)
-  if (!force)
-   return;
- 
- // Draw vertices and calculate AABB.
- mAABB.setNull();
- mVertices.remove_all(); // Reset
- mIndexes.remove_all();
- for (std::vector<Brush*>::iterator it = mBrushes.begin(); it != mBrushes.end();it++)
+ for (size_t i=0;i < count;i++)
  {
-  (*it)->_render(mVertices, mIndexes);
-  mAABB.merge((*it)->getAABB());
+  Plane* plane = createPlane(positions[i], sizes[i], orientations ? orientations[i] : Ogre::Quaternion::IDENTITY, materialIndex);
+  if (planes)
+   planes[i] = plane;
  }
+}
 
- // Multibrushes
-  // --- Blocks
-  for (std::vector<Block*>::iterator it = mParent->mBlocks.begin(); it != mParent->mBlocks.end();it++)
-  {
-   (*it)->_render(mVertices, mIndexes, mIndex);
-   mAABB.merge((*it)->getAABB());
-  }
+void  Geometry::destroyPlanes(const Handle* handles, size_t count)
+{
  
+ waitForRedraw();
  
+ std::vector<Brush*> destroyed;
+ for (size_t i=0;i < count;i++)
+ {
+  Plane* plane = mPlanes.get(handles[i]);
+  if (plane == 0)
+   continue;
+  if (plane->mRenderable)
+   plane->mRenderable->popBrush(plane);
+  mPlanes.erase(plane->mHandle);
+  destroyed.push_back(plane);
+ }
  
+ std::sort(destroyed.begin(), destroyed.end());
+ removeDestroyed(mPendingBrushes, destroyed);
  
- // Copy to VertexBuffer
- _resizeVertexBuffer(mVertices.size());
- Vertex* writeIterator = (Vertex*) mVertexBuffer->lock(Ogre::HardwareBuffer::HBL_DISCARD);
-
- for (size_t i=0;i < mVertices.size();i++)
-  *writeIterator++ = mVertices[i];
- mVertexBuffer->unlock();
- mRenderOp.vertexData->vertexCount = mVertices.size();
- 
- // Copy Indexes
- _resizeIndexBuffer(mIndexes.size());
- Index* indexWriteIterator = (Index*) mIndexBuffer->lock(Ogre::HardwareBuffer::HBL_DISCARD);
- std::cout << "++ Locking Index Buffer" << mIndexes.size() << "\n";
- for (size_t i=0;i < mIndexes.size();i++)
-  *indexWriteIterator++ = mIndexes[i];
- mIndexBuffer->unlock();
- mRenderOp.indexData->indexCount = mIndexes.size();
+ for (std::vector<Brush*>::iterator it = destroyed.begin(); it != destroyed.end();it++)
+  OGRE_DELETE static_cast<Plane*>(*it);
  
 }
 
-void  GeometryRenderable::_create(size_t initialSize)
-{ 
+Displacement*  Geometry::createDisplacement(const Ogre::Vector3& position, const Ogre::Vector3& scale, const Ogre::Quaternion& orientation, size_t materialIndex)
+{
+ Displacement* displacement = OGRE_NEW Orangutan::Displacement(position, scale, orientation, materialIndex, this);
+ displacement->mHandle = mDisplacements.insert(displacement);
+ _brushChanged(displacement);
+ return displacement;
+}
 
- std::cout << __FUNCTION__ << "\n";
- mVertexBufferSize = initialSize * 3;
- mVertices.resize(mVertexBufferSize);
- mRenderOp.vertexData = OGRE_NEW Ogre::VertexData;
- mRenderOp.vertexData->vertexStart = 0;
- mRenderOp.vertexData->vertexCount = 0;
- 
- Ogre::VertexDeclaration* vertexDecl = mRenderOp.vertexData->vertexDeclaration;
- size_t offset = 0;
+void  Geometry::destroyDisplacement(Displacement* displacement)
+{
+ waitForRedraw();
+ if (displacement->mUpdatePending)
+  mPendingBrushes.erase(std::find(mPendingBrushes.begin(), mPendingBrushes.end(), displacement));
+ if (displacement->mRenderable)
+  displacement->mRenderable->popBrush(displacement);
+ mDisplacements.erase(displacement->mHandle);
+ OGRE_DELETE displacement;
+}
 
- // Position
- vertexDecl->addElement(0,0, Ogre::VET_FLOAT3, Ogre::VES_POSITION);
- offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT3);
- 
- // Colour
- vertexDecl->addElement(0, offset, Ogre::VET_FLOAT4, Ogre::VES_DIFFUSE);
- offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT4);
- 
- // Texture Coordinates
- vertexDecl->addElement(0, offset, Ogre::VET_FLOAT2, Ogre::VES_TEXTURE_COORDINATES);
+void  Geometry::createDisplacements(size_t count, const Ogre::Vector3* positions, const Ogre::Vector3* scales, const Ogre::Quaternion* orientations, size_t materialIndex, Displacement** displacements)
+{
+ for (size_t i=0;i < count;i++)
+ {
+  Displacement* displacement = createDisplacement(positions[i], scales[i], orientations ? orientations[i] : Ogre::Quaternion::IDENTITY, materialIndex);
+  if (displacements)
+   displacements[i] = displacement;
+ }
+}
+
+void  Geometry::destroyDisplacements(const Handle* handles, size_t count)
+{
  
- mVertexBuffer = Ogre::HardwareBufferManager::getSingletonPtr()
-     ->createVertexBuffer(
-         vertexDecl->getVertexSize(0),
-         mVertexBufferSize,
-         Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY_DISCARDABLE,
-         false
-     );
+ waitForRedraw();
  
- mRenderOp.vertexData->vertexBufferBinding->setBinding(0, mVertexBuffer);
+ std::vector<Brush*> destroyed;
+ for (size_t i=0;i < count;i++)
+ {
+  Displacement* displacement = mDisplacements.get(handles[i]);
+  if (displacement == 0)
+   continue;
+  if (displacement->mRenderable)
+   displacement->mRenderable->popBrush(displacement);
+  mDisplacements.erase(displacement->mHandle);
+  destroyed.push_back(displacement);
+ }
  
- mRenderOp.useIndexes = true;
- mRenderOp.indexData = OGRE_NEW Ogre::IndexData;
- mRenderOp.indexData->indexStart = 0;
- mRenderOp.indexData->indexCount = 0;
+ std::sort(destroyed.begin(), destroyed.end());
+ removeDestroyed(mPendingBrushes, destroyed);
  
- mIndexBufferSize = mVertexBufferSize * 3;
- mIndexes.resize(mIndexBufferSize);
- mIndexBuffer = Ogre::HardwareBufferManager::getSingletonPtr()->createIndexBuffer(
-   Ogre::HardwareIndexBuffer::IT_16BIT,
-   mIndexBufferSize,
-   Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY_DISCARDABLE
-  );
- mRenderOp.indexData->indexBuffer = mIndexBuffer;
- mRenderOp.operationType = Ogre::RenderOperation::OT_TRIANGLE_LIST;
+ for (std::vector<Brush*>::iterator it = destroyed.begin(); it != destroyed.end();it++)
+  OGRE_DELETE static_cast<Displacement*>(*it);
  
 }
 
-void  GeometryRenderable::_destroy()
+Block*  Geometry::createBlock(const Ogre::Vector3& position, const Ogre::Vector3& size, const Ogre::Quaternion& orientation, size_t materialIndex)
 {
- 
-  std::cout << __FUNCTION__ << "\n";
-  OGRE_DELETE mRenderOp.vertexData;
-  OGRE_DELETE mRenderOp.indexData;
-  mRenderOp.vertexData = 0;
-  mVertexBuffer.setNull();
-  mVertexBufferSize = 0;
-  mIndexBuffer.setNull();
-  mIndexBufferSize = 0;
-  mVertices.destroy();
-  mIndexes.destroy();
+ Block* block = OGRE_NEW Orangutan::Block(position, size, orientation, materialIndex, this);
+ block->mHandle = mBlocks.insert(block);
+ _addBlock(block);
+ _blockChanged(block);
+ return block;
 }
 
-void  GeometryRenderable::_resizeVertexBuffer(size_t requestedSize)
+void  Geometry::createBlocks(size_t count, const Ogre::Vector3* positions, const Ogre::Vector3* sizes, const Ogre::Quaternion* orientations, size_t materialIndex, Block** blocks)
 {
- std::cout << __FUNCTION__ << "\n";
- 
- if (mVertexBufferSize == 0)
+ for (size_t i=0;i < count;i++)
  {
-  std::cout << "\n\n\nVertex Buffer Size is zero, need to create it\n --> Pointer is " << this << "\n\n\n";
-  _create();
+  Block* block = createBlock(positions[i], sizes[i], orientations ? orientations[i] : Ogre::Quaternion::IDENTITY, materialIndex);
+  if (blocks)
+   blocks[i] = block;
  }
+}
+
+void   Geometry::destroyBlock(Block* block)
+{
+ waitForRedraw();
+ mBlocks.erase(block->mHandle);
  
- if (requestedSize > mVertexBufferSize)
- {
-  size_t newVertexBufferSize = 1;
-  
-  while(newVertexBufferSize < requestedSize)
-   newVertexBufferSize <<= 1;
-  
-  mVertexBuffer = Ogre::HardwareBufferManager::getSingletonPtr()->createVertexBuffer(
-    mRenderOp.vertexData->vertexDeclaration->getVertexSize(0),
-    newVertexBufferSize,
-    Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY_DISCARDABLE,
-    false
-  );
-  mVertexBufferSize = newVertexBufferSize;
-  mRenderOp.vertexData->vertexStart = 0;
-  mRenderOp.vertexData->vertexBufferBinding->setBinding(0, mVertexBuffer);
- }
-  
+ if (block->mUpdatePending)
+  mPendingMultiBrushes.erase(std::find(mPendingMultiBrushes.begin(), mPendingMultiBrushes.end(), block));
+ 
+ // Only the materials the Block uses are redrawn.
+ _removeBlock(block);
+ 
+ // Faces it was covering can be seen again.
+ std::vector<Block*> neighbours;
+ _unregisterFaces(block, neighbours);
+ for (std::vector<Block*>::iterator it = neighbours.begin(); it != neighbours.end();it++)
+  if (_findHiddenFaces(*it))
+   _refreshBlock(*it);
+ 
+ OGRE_DELETE block;
 }
 
-void  GeometryRenderable::_resizeIndexBuffer(size_t requestedSize)
+void   Geometry::destroyBlocks(const Handle* handles, size_t count)
 {
  
- std::cout << __FUNCTION__ << "\n";
+ waitForRedraw();
  
- if (requestedSize > mIndexBufferSize)
+ std::vector<MultiBrush*> destroyed;
+ std::vector<Block*> neighbours;
+ for (size_t i=0;i < count;i++)
  {
-  size_t newIndexBufferSize = 1;
-  
-  while(newIndexBufferSize < requestedSize)
-   newIndexBufferSize <<= 1;
-  
-  mIndexBuffer = Ogre::HardwareBufferManager::getSingletonPtr()->createIndexBuffer(
-   Ogre::HardwareIndexBuffer::IT_16BIT,
-   newIndexBufferSize,
-   Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY_DISCARDABLE
-  );
-  mRenderOp.indexData->indexBuffer = mIndexBuffer;
-  mIndexBufferSize = newIndexBufferSize;
+  Block* block = mBlocks.get(handles[i]);
+  if (block == 0)
+   continue;
+  mBlocks.erase(block->mHandle);
+  _removeBlock(block);
+  _unregisterFaces(block, neighbours);
+  destroyed.push_back(block);
  }
-  
+ 
+ std::sort(destroyed.begin(), destroyed.end());
+ removeDestroyed(mPendingMultiBrushes, destroyed);
+ 
+ // Neighbours are only looked at once every Block has gone, so a Block shared by several
+ // destroyed Blocks is refreshed once, and destroyed neighbours aren't refreshed at all.
+ std::sort(neighbours.begin(), neighbours.end());
+ neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+ for (std::vector<Block*>::iterator it = neighbours.begin(); it != neighbours.end();it++)
+  if (std::binary_search(destroyed.begin(), destroyed.end(), static_cast<MultiBrush*>(*it)) == false && _findHiddenFaces(*it))
+   _refreshBlock(*it);
+ 
+ for (std::vector<MultiBrush*>::iterator it = destroyed.begin(); it != destroyed.end();it++)
+  OGRE_DELETE static_cast<Block*>(*it);
+ 
 }
 
-void GeometryRenderable::getWorldTransforms(Ogre::Matrix4* transform) const
+void  Geometry::setVertexCacheOptimisation(bool optimise)
 {
- transform[0] = mParent->_getParentNodeFullTransform();
+ 
+ if (optimise == mVertexCacheOptimisation)
+  return;
+ 
+ waitForRedraw();
+ mVertexCacheOptimisation = optimise;
+ for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+  redrawNeeded((*it), true);
+ 
 }
 
-void GeometryRenderable::setMaterialName(const Ogre::String& materialName, const Ogre::String& materialGroup)
+void  Geometry::setQuadMerging(bool merge)
 {
- std::cout << __FUNCTION__ << "\n";
- mMaterialName = materialName;
- mMaterialGroup = materialGroup;
- mMaterial = Ogre::MaterialManager::getSingletonPtr()->load(mMaterialName, mMaterialGroup);
+ 
+ if (merge == mQuadMerging)
+  return;
+ 
+ waitForRedraw();
+ mQuadMerging = merge;
+ for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+  redrawNeeded((*it), true);
+ 
 }
 
-Ogre::Real GeometryRenderable::getSquaredViewDepth(const Ogre::Camera* cam) const
+void  Geometry::setHiddenFaceRemoval(bool remove, Ogre::Real faceGridSize)
 {
- Ogre::Node* node = mParent->getParentNode();
- assert(node);
- return node->getSquaredViewDepth(cam);
+ 
+ waitForRedraw();
+ 
+ mHiddenFaceRemoval = remove;
+ mFaceGridSize = std::max(faceGridSize, Ogre::Real(HIDDEN_FACE_EPSILON));
+ 
+ mFaceCells.clear();
+ for (std::vector<Block*>::iterator it = mBlocks.begin(); it != mBlocks.end();it++)
+ {
+  (*it)->mFaceKeys.clear();
+  if (remove)
+   _registerFaces(*it);
+ }
+ 
+ // With it off, every face is shown again.
+ for (std::vector<Block*>::iterator it = mBlocks.begin(); it != mBlocks.end();it++)
+  if (_findHiddenFaces(*it))
+   _refreshBlock(*it);
+ 
 }
 
-const Ogre::LightList& GeometryRenderable::getLights(void) const
+void  Geometry::_blockChanged(Block* block)
 {
- return mParent->queryLights();
+ 
+ if (mHiddenFaceRemoval == false)
+  return;
+ 
+ waitForRedraw();
+ 
+ // Blocks next to where the faces were, and to where they are now.
+ std::vector<Block*> neighbours;
+ _unregisterFaces(block, neighbours);
+ _registerFaces(block);
+ 
+ for (std::vector<GeometryCell::Key>::iterator key = block->mFaceKeys.begin(); key != block->mFaceKeys.end();key++)
+ {
+  std::vector<BlockFace>& faces = mFaceCells[*key];
+  for (std::vector<BlockFace>::iterator it = faces.begin(); it != faces.end();it++)
+   if ((*it).first != block)
+    neighbours.push_back((*it).first);
+ }
+ 
+ std::sort(neighbours.begin(), neighbours.end());
+ neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+ 
+ if (_findHiddenFaces(block))
+  _refreshBlock(block);
+ 
+ for (std::vector<Block*>::iterator it = neighbours.begin(); it != neighbours.end();it++)
+  if (_findHiddenFaces(*it))
+   _refreshBlock(*it);
+ 
 }
 
-void GeometryRenderable::pushBrush(Brush* brush)
-{
- mBrushes.push_back(brush);
- mParent->redrawNeeded(brush->getIndex());
-}
-   
-void GeometryRenderable::popBrush(Brush* brush)
+GeometryCell::Key  Geometry::_getFaceCell(const Ogre::Vector3& point) const
 {
- mBrushes.erase(std::find(mBrushes.begin(), mBrushes.end(), brush));
- mParent->redrawNeeded(brush->getIndex());
+ GeometryCell::Key key;
+ key.x = int(Ogre::Math::Floor(point.x / mFaceGridSize));
+ key.y = int(Ogre::Math::Floor(point.y / mFaceGridSize));
+ key.z = int(Ogre::Math::Floor(point.z / mFaceGridSize));
+ return key;
 }
 
+void  Geometry::_registerFaces(Block* block)
+{
+ 
+ for (size_t i=0;i < block->_getPartCount();i++)
+ {
+  
+  if (block->mHasQuads[i] == false)
+   continue;
+  
+  // Grown a little, so faces lying on the edge of a cell are in both.
+  const Vertex* vertices = block->mQuadVertexData[i].mVertices;
+  Ogre::AxisAlignedBox aabb;
+  for (size_t j=0;j < 4;j++)
+   aabb.merge(vertices[j].position);
+  
+  GeometryCell::Key minimum = _getFaceCell(aabb.getMinimum() - Ogre::Vector3(HIDDEN_FACE_EPSILON, HIDDEN_FACE_EPSILON, HIDDEN_FACE_EPSILON));
+  GeometryCell::Key maximum = _getFaceCell(aabb.getMaximum() + Ogre::Vector3(HIDDEN_FACE_EPSILON, HIDDEN_FACE_EPSILON, HIDDEN_FACE_EPSILON));
+  
+  GeometryCell::Key key;
+  for (key.x = minimum.x;key.x <= maximum.x;key.x++)
+   for (key.y = minimum.y;key.y <= maximum.y;key.y++)
+    for (key.z = minimum.z;key.z <= maximum.z;key.z++)
+    {
+     mFaceCells[key].push_back(BlockFace(block, i));
+     block->mFaceKeys.push_back(key);
+    }
+ }
+ 
+ std::sort(block->mFaceKeys.begin(), block->mFaceKeys.end());
+ block->mFaceKeys.erase(std::unique(block->mFaceKeys.begin(), block->mFaceKeys.end(), sameFaceCell), block->mFaceKeys.end());
+}
+
+void  Geometry::_unregisterFaces(Block* block, std::vector<Block*>& neighbours)
+{
+ 
+ for (std::vector<GeometryCell::Key>::iterator key = block->mFaceKeys.begin(); key != block->mFaceKeys.end();key++)
+ {
+  
+  FaceCells::iterator cell = mFaceCells.find(*key);
+  if (cell == mFaceCells.end())
+   continue;
+  
+  std::vector<BlockFace>& faces = (*cell).second;
+  for (size_t i=0;i < faces.size();)
+  {
+   if (faces[i].first == block)
+   {
+    faces[i] = faces.back();
+    faces.pop_back();
+   }
+   else
+   {
+    neighbours.push_back(faces[i].first);
+    i++;
+   }
+  }
+  
+  if (faces.empty())
+   mFaceCells.erase(cell);
+ }
+ 
+ block->mFaceKeys.clear();
+}
+
+bool  Geometry::_findHiddenFaces(Block* block)
+{
+ 
+ bool changed = false;
+ 
+ for (size_t i=0;i < block->_getPartCount();i++)
+ {
+  
+  bool hidden = false;
+  
+  if (mHiddenFaceRemoval && block->mHasQuads[i])
+  {
+   // A face covering this one has to contain its centre, so is in the same cell.
+   const Vertex* vertices = block->mQuadVertexData[i].mVertices;
+   Ogre::Vector3 centre = (vertices[0].position + vertices[1].position + vertices[2].position + vertices[3].position) * 0.25f;
+   
+   FaceCells::iterator cell = mFaceCells.find(_getFaceCell(centre));
+   if (cell != mFaceCells.end())
+   {
+    std::vector<BlockFace>& faces = (*cell).second;
+    for (std::vector<BlockFace>::iterator it = faces.begin(); it != faces.end();it++)
+    {
+     if ((*it).first != block && isQuadCovered(vertices, (*it).first->mQuadVertexData[(*it).second].mVertices))
+     {
+      hidden = true;
+      break;
+     }
+    }
+   }
+  }
+  
+  if (block->mQuadHidden[i] != hidden)
+  {
+   block->mQuadHidden[i] = hidden;
+   changed = true;
+  }
+ }
+ 
+ return changed;
+}
+
+void  Geometry::beginUpdate()
+{
+ mUpdateDepth++;
+}
+
+void  Geometry::endUpdate()
+{
+ 
+ if (mUpdateDepth == 0 || --mUpdateDepth != 0)
+  return;
+ 
+ // Each Brush is regenerated once, however many times it was changed.
+ for (std::vector<Brush*>::iterator it = mPendingBrushes.begin(); it != mPendingBrushes.end();it++)
+ {
+  (*it)->mUpdatePending = false;
+  (*it)->_updateRequired();
+ }
+ mPendingBrushes.clear();
+ 
+ // Block::_updateRequired redraws through _blockMoved, as an instanced Block has no renderables.
+ for (std::vector<MultiBrush*>::iterator it = mPendingMultiBrushes.begin(); it != mPendingMultiBrushes.end();it++)
+ {
+  (*it)->mUpdatePending = false;
+  (*it)->_updateRequired();
+ }
+ mPendingMultiBrushes.clear();
+ 
+}
+
+bool  Geometry::_deferUpdate(Brush* brush)
+{
+ // The Brush is about to change, so it can't still be being drawn in the background.
+ waitForRedraw();
+ 
+ // Brushes not yet in the Geometry are updated straight away.
+ if (mUpdateDepth == 0 || brush->mRenderable == 0)
+  return false;
+ 
+ if (brush->mUpdatePending == false)
+ {
+  brush->mUpdatePending = true;
+  mPendingBrushes.push_back(brush);
+ }
+ return true;
+}
+
+bool  Geometry::_deferUpdate(MultiBrush* brush)
+{
+ waitForRedraw();
+ 
+ // So are Blocks, as their AABB decides their cell.
+ if (mUpdateDepth == 0 || brush->mCell == 0)
+  return false;
+ 
+ if (brush->mUpdatePending == false)
+ {
+  brush->mUpdatePending = true;
+  mPendingMultiBrushes.push_back(brush);
+ }
+ return true;
+}
+
+void  Geometry::destroyAll()
+{
+ 
+ waitForRedraw();
+ 
+ // Empty every GeometryRenderable once, instead of popping each Brush.
+ for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+ {
+  (*it)->mBrushes.clear();
+  (*it)->mParts.clear();
+  redrawNeeded((*it), true);
+ }
+ 
+ for (std::vector<BlockInstances*>::iterator it = mBlockInstances.begin(); it != mBlockInstances.end();it++)
+  OGRE_DELETE (*it);
+ mBlockInstances.clear();
+ 
+ for (GeometryCells::iterator it = mCells.begin(); it != mCells.end();it++)
+  (*it).second->mInstances.clear();
+ 
+ for (std::vector<Plane*>::iterator it = mPlanes.begin(); it != mPlanes.end();it++)
+  OGRE_DELETE (*it);
+ mPlanes.clear();
+ 
+ for (std::vector<Displacement*>::iterator it = mDisplacements.begin(); it != mDisplacements.end();it++)
+  OGRE_DELETE (*it);
+ mDisplacements.clear();
+ 
+ for (std::vector<Block*>::iterator it = mBlocks.begin(); it != mBlocks.end();it++)
+  OGRE_DELETE (*it);
+ mBlocks.clear();
+ 
+ mPendingBrushes.clear();
+ mPendingMultiBrushes.clear();
+ mFaceCells.clear();
+ 
+}
+
+void  Geometry::_renderVertices()
+{
+ ORANGUTAN_STAT(unsigned long start = getMicroseconds())
+ 
+ if (mTaskScheduler)
+ {
+  // Lock here, draw every Brush in parallel, then unlock here again.
+  for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+   if ((*it)->_beginRenderVertices(false))
+    mTasks.push_back(*it);
+  
+  if (mTasks.empty() == false)
+   mTaskScheduler->run(&mTasks[0], mTasks.size());
+  
+  for (std::vector<TaskScheduler::Task*>::iterator it = mTasks.begin(); it != mTasks.end();it++)
+   static_cast<GeometryRenderable*>(*it)->_unlockAllSegments();
+  mTasks.clear();
+ }
+ else
+ {
+  // Each GeometryRenderable, redraw (if needed) and then copy to mVertexBuffer.
+  for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+   (*it)->_renderVertices(false);
+ }
+ 
+ _verticesUploaded();
+ _updateDrawnGeometries();
+ ORANGUTAN_STAT(mStats.redraws++)
+ ORANGUTAN_STAT(mStats.redrawMicroseconds += getMicroseconds() - start)
+ _redrawVisible(mEditVersion);
+}
+
+void  Geometry::_updateDrawnGeometries()
+{
+ mAABB.setNull();
+ mDrawnGeometries.clear();
+ for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+ {
+  mAABB.merge((*it)->mAABB);
+  if ((*it)->isEmpty() == false)
+   mDrawnGeometries.push_back(*it);
+ }
+ for (std::vector<BlockInstances*>::iterator it = mBlockInstances.begin(); it != mBlockInstances.end();it++)
+ {
+  (*it)->_update();
+  mAABB.merge((*it)->getAABB());
+ }
+ if (mParentNode)
+  mParentNode->needUpdate();
+}
+
+void  Geometry::_verticesUploaded()
+{
+ for (std::vector<Displacement*>::iterator it = mDisplacements.begin(); it != mDisplacements.end();it++)
+  (*it)->_verticesUploaded();
+}
+
+void  Geometry::_updateLod()
+{
+ 
+ if (mCamera == 0 || mAsyncRunning)
+  return;
+ 
+ // Each viewport in a frame would otherwise choose again from its own camera.
+ unsigned long frame = getFrameNumber();
+ if (frame == mLodFrame)
+  return;
+ mLodFrame = frame;
+ 
+ Ogre::Camera* lodCamera = mLodCamera ? mLodCamera : mCamera->getLodCamera();
+ Ogre::Vector3 camera = _getParentNodeFullTransform().inverseAffine() * lodCamera->getDerivedPosition();
+ for (std::vector<Displacement*>::iterator it = mDisplacements.begin(); it != mDisplacements.end();it++)
+  (*it)->_updateLod(camera);
+ 
+}
+
+void  Geometry::_redrawVisible(unsigned long version)
+{
+ mVisibleVersion = version;
+ if (mListener)
+  mListener->redrawVisible(this, version);
+}
+
+void  Geometry::setAsyncRedraw(bool async)
+{
+ if (async == false)
+  waitForRedraw();
+ mAsync = async;
+}
+
+void  Geometry::waitForRedraw()
+{
+ 
+ if (mAsyncRunning == false)
+  return;
+ 
+ while (_isAsyncFinished() == false)
+ {
+#if OGRE_THREAD_SUPPORT
+  OGRE_THREAD_SLEEP(1)
+#endif
+ }
+ 
+ _finishAsyncRedraw();
+}
+
+bool  Geometry::_isAsyncFinished() const
+{
+ OGRE_LOCK_MUTEX(mAsyncMutex)
+ return mAsyncFinished;
+}
+
+void  Geometry::_startAsyncRedraw()
+{
+ 
+ mRedrawNeeded = false;
+ mAsyncVersion = mEditVersion;
+ 
+ // Ranges are worked out here, as Brushes may be added or removed while drawing.
+ for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+  if ((*it)->_beginBackRender())
+   mAsyncGeometries.push_back(*it);
+ 
+ {
+  OGRE_LOCK_MUTEX(mAsyncMutex)
+  mAsyncFinished = false;
+ }
+ mAsyncRunning = true;
+ 
+ static TaskScheduler defaultScheduler;
+ if (mTaskScheduler)
+  mTaskScheduler->runInBackground(&mBackgroundRedraw);
+ else
+  defaultScheduler.runInBackground(&mBackgroundRedraw);
+ 
+}
+
+void  Geometry::_finishAsyncRedraw()
+{
+ 
+ ORANGUTAN_STAT(unsigned long start = getMicroseconds())
+ mAsyncRunning = false;
+ 
+ for (GeometryRenderables::iterator it = mAsyncGeometries.begin(); it != mAsyncGeometries.end();it++)
+  (*it)->_endBackRender();
+ mAsyncGeometries.clear();
+ 
+ _verticesUploaded();
+ _updateDrawnGeometries();
+ ORANGUTAN_STAT(mStats.redraws++)
+ ORANGUTAN_STAT(mStats.redrawMicroseconds += getMicroseconds() - start)
+ _redrawVisible(mAsyncVersion);
+ 
+}
+
+void  Geometry::BackgroundRedraw::execute()
+{
+ 
+ for (GeometryRenderables::iterator it = mGeometry->mAsyncGeometries.begin(); it != mGeometry->mAsyncGeometries.end();it++)
+  (*it)->_renderBack();
+ 
+ OGRE_LOCK_MUTEX(mGeometry->mAsyncMutex)
+ mGeometry->mAsyncFinished = true;
+ 
+}
+
+Statistics Geometry::getStats() const
+{
+ Statistics stats;
+ for (GeometryRenderables::const_iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+  stats += (*it)->getStats();
+ stats.redraws = mStats.redraws;
+ stats.redrawMicroseconds = mStats.redrawMicroseconds;
+ return stats;
+}
+
+void Geometry::resetStats()
+{
+ mStats.reset();
+ for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+  (*it)->resetStats();
+}
+
+void  Geometry::_notifyCurrentCamera(Ogre::Camera* camera)
+{
+ MovableObject::_notifyCurrentCamera(camera);
+ mCamera = camera;
+}
+
+void  Geometry::_updateRenderQueue(Ogre::RenderQueue* queue)
+{
+ 
+ // Upload a finished background redraw first, so the patch detail can change this frame.
+ if (mAsync && mAsyncRunning && _isAsyncFinished())
+  _finishAsyncRedraw();
+ 
+ // Moving buffers redraws them in full, so it waits for any background redraw to finish.
+ if (mAsyncRunning == false)
+  for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+   (*it)->_updateUsage();
+ 
+ _updateLod();
+ 
+ if (mAsync)
+ {
+  // Start on any edits made since.
+  if (mAsyncRunning == false && mRedrawNeeded)
+  {
+   _startAsyncRedraw();
+   if (_isAsyncFinished())
+    _finishAsyncRedraw();
+  }
+ }
+ else if (mRedrawNeeded)
+ {
+  mRedrawNeeded = false;
+  _renderVertices();
+ }
+ 
+ // Only cells are culled, an unchunked Geometry has already been culled as a whole.
+ bool cull = (mCellSize > 0 && mCamera);
+ 
+ for (GeometryRenderables::iterator it = mDrawnGeometries.begin(); it != mDrawnGeometries.end();it++)
+  _addToRenderQueue(queue, (*it), (*it)->mAABB, cull);
+ 
+ for (std::vector<BlockInstances*>::iterator it = mBlockInstances.begin(); it != mBlockInstances.end();it++)
+  if ((*it)->isEmpty() == false)
+   _addToRenderQueue(queue, (*it), (*it)->getAABB(), cull);
+ 
+}
+
+void  Geometry::_addToRenderQueue(Ogre::RenderQueue* queue, Ogre::Renderable* renderable, const Ogre::AxisAlignedBox& bounds, bool cull)
+{
+ 
+ if (cull)
+ {
+  Ogre::AxisAlignedBox aabb = bounds;
+  aabb.transformAffine(_getParentNodeFullTransform());
+  if (mCamera->isVisible(aabb) == false)
+   return;
+ }
+ 
+ if (mRenderQueuePrioritySet)
+ {
+  assert(mRenderQueueIDSet == true);
+  queue->addRenderable(renderable, mRenderQueueID, mRenderQueuePriority);
+ }
+ else if (mRenderQueueIDSet)
+  queue->addRenderable(renderable, mRenderQueueID);
+ else
+  queue->addRenderable(renderable);
+ 
+}
+
+void  Geometry::visitRenderables(Ogre::Renderable::Visitor* visitor, bool debugRenderables)
+{
+ for (GeometryRenderables::iterator it = mGeometries.begin(); it != mGeometries.end();it++)
+  visitor->visit((*it), 0, false);
+ for (std::vector<BlockInstances*>::iterator it = mBlockInstances.begin(); it != mBlockInstances.end();it++)
+  visitor->visit((*it), 0, false);
+}
+
+
+void Geometry::loadFromOokFile(const Ogre::String& filename, const Ogre::String& resourceGroup)
+{
+
+}
+
+
+void Geometry::saveAsOokFile(const Ogre::String& filename)
+{
+ 
+ std::ofstream stream;
+ stream.open(filename.c_str(), std::ios::out | std::ios::binary);
+ stream << "OOK! 0.1\n";
+ 
+ for (MaterialNames::iterator it = mMaterials.begin(); it != mMaterials.end();it++)
+  stream << "uses \"" << (*it).second.first << "\" as " << (*it).first << "\n";
+ 
+ stream << "\n";
+ size_t id = 0;
+
+ // Planes
+ // ----------------------------------------
+ for (std::vector<Plane*>::iterator it = mPlanes.begin(); it != mPlanes.end();it++)
+  (*it)->saveToOok(stream);
+ 
+ // Displacements
+ // ----------------------------------------
+ for (std::vector<Displacement*>::iterator it = mDisplacements.begin(); it != mDisplacements.end();it++)
+  (*it)->saveToOok(stream);
+
+ stream << "\n";
+ stream.close();
+}
+
+void Geometry::saveAsMesh(const Ogre::String& filename)
+{
+
+}
+
+// ----------------------------------------------------------------------------------------
+
+
+
+
+ 
+GeometryRenderable::GeometryRenderable(const Ogre::String& materialName, const Ogre::String& materialGroup, Geometry* parent, GeometryCell* cell, size_t index)
+: mRedrawNeeded(false),
+  mLayoutChanged(true),
+  mVertexBufferSize(0),
+  mIndexBufferSize(0),
+  mIndexType(Ogre::HardwareIndexBuffer::IT_16BIT),
+  mVertexFormat(parent->getVertexFormat()),
+  mUsageHint(parent->getUsageHint()),
+  mUsage(mUsageHint == UsageHint_Static ? Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY : Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY),
+  mLastRedrawFrame(getFrameNumber()),
+  mUnderusedRedraws(0),
+  mLockedVertices(0),
+  mLockedIndexes(0),
+  mMaterialName(materialName),
+  mMaterialGroup(materialGroup),
+  mParent(parent),
+  mCell(cell),
+  mIndex(index)
+{
+ _create();
+}
+
+GeometryRenderable::~GeometryRenderable()
+{
+ _destroy();
+}
+
+void GeometryRenderable::_renderVertices(bool force)
+{
+ ORANGUTAN_STAT(unsigned long start = getMicroseconds())
+ 
+ if (_beginRenderVertices(force))
+ {
+  execute();
+  _unlockAllSegments();
+ }
+ 
+ ORANGUTAN_STAT(mStats.redrawMicroseconds += getMicroseconds() - start)
+}
+
+bool GeometryRenderable::_beginRenderVertices(bool force)
+{
+
+ if (mRedrawNeeded == false)
+  if (!force)
+   return false;
+
+ mRedrawNeeded = false;
+ mLastRedrawFrame = getFrameNumber();
+ ORANGUTAN_STAT(mStats.redraws++)
+
+ // Being edited again, so move back into dynamic buffers.
+ if (mUsageHint == UsageHint_Adaptive && mUsage != Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY)
+ {
+  _setUsage(Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY);
+  force = true;
+ }
+
+ if (force || mLayoutChanged || _renderChangedSegments() == false)
+  return _layoutAllSegments(false);
+
+ return false;
+}
+
+void GeometryRenderable::_renderAllSegments(bool trim)
+{
+ if (_layoutAllSegments(trim))
+ {
+  execute();
+  _unlockAllSegments();
+ }
+}
+
+bool GeometryRenderable::_layoutAllSegments(bool trim)
+{
+
+ ORANGUTAN_STAT(unsigned long start = getMicroseconds())
+ ORANGUTAN_STAT(mStats.fullRedraws++)
+ mLayoutChanged = false;
+
+ size_t vertexCount, indexCount;
+ _layoutSegments(mSegments, mMergedQuads, mAABB, vertexCount, indexCount);
+
+ mRenderOp.vertexData->vertexCount = vertexCount;
+ mRenderOp.indexData->indexCount = indexCount;
+ ORANGUTAN_STAT(mStats.layoutMicroseconds += getMicroseconds() - start)
+
+ // Give back the memory of a one-off burst of geometry, but only once the buffers
+ // have stayed mostly unused so they don't keep growing and shrinking.
+ if (vertexCount < mVertexBufferSize / 4 || indexCount < mIndexBufferSize / 4)
+  mUnderusedRedraws++;
+ else
+  mUnderusedRedraws = 0;
+ 
+ if (mUnderusedRedraws >= SHRINK_AFTER_REDRAWS)
+  trim = true;
+ 
+ if (trim)
+  mUnderusedRedraws = 0;
+
+ if (vertexCount == 0 || indexCount == 0)
+ {
+  if (trim)
+  {
+   _resizeVertexBuffer(vertexCount, true);
+   _resizeIndexBuffer(indexCount, true);
+  }
+  return false;
+ }
+
+ ORANGUTAN_STAT(mLockedTime = getMicroseconds())
+
+ // Past 65535 vertices the indexes have to be 32-bit, otherwise they would wrap.
+ Ogre::HardwareIndexBuffer::IndexType indexType = _getIndexType(vertexCount);
+ if (indexType != mIndexType)
+ {
+  mIndexType = indexType;
+  mIndexBufferSize = 0; // Recreate it.
+ }
+
+ // Draw straight into the VertexBuffer and IndexBuffer.
+ _resizeVertexBuffer(vertexCount, trim);
+ _resizeIndexBuffer(indexCount, trim);
+
+ mLockedVertices = (Ogre::uint8*) mVertexBuffer->lock(Ogre::HardwareBuffer::HBL_DISCARD);
+ mLockedIndexes = mIndexBuffer->lock(Ogre::HardwareBuffer::HBL_DISCARD);
+ ORANGUTAN_TRACE("Locking index buffer of " << indexCount << " indexes")
+ return true;
+}
+
+void GeometryRenderable::_layoutSegments(std::vector<Segment>& segments, std::vector<Vertex>& mergedQuads, Ogre::AxisAlignedBox& aabb, size_t& vertexCount, size_t& indexCount)
+{
+
+ // Calculate the sizes and AABB.
+ aabb.setNull();
+ segments.clear();
+ mergedQuads.clear();
+
+ Segment segment;
+ segment.mMerged = false;
+ for (std::vector<Brush*>::iterator it = mBrushes.begin(); it != mBrushes.end();it++)
+ {
+  segment.mBrush = (*it);
+  segment.mMultiBrush = 0;
+  segment.mPart = 0;
+  segment.mRevision = (*it)->getRevision();
+  (*it)->mDrawnRevision = segment.mRevision;
+  segment.mVertexCount = (*it)->_getVertexCount();
+  segment.mIndexCount = (*it)->_getIndexCount();
+  segments.push_back(segment);
+  aabb.merge((*it)->getAABB());
+ }
+
+ // Parts of MultiBrushes in this material, i.e. the faces of Blocks.
+ for (std::vector<Part>::iterator it = mParts.begin(); it != mParts.end();it++)
+ {
+  segment.mBrush = 0;
+  segment.mMultiBrush = (*it).first;
+  segment.mPart = (*it).second;
+  segment.mRevision = segment.mMultiBrush->getRevision();
+  segment.mVertexCount = segment.mMultiBrush->_getVertexCount(segment.mPart);
+  segment.mIndexCount = segment.mMultiBrush->_getIndexCount(segment.mPart);
+  segments.push_back(segment);
+  aabb.merge(segment.mMultiBrush->getAABB());
+ }
+
+ if (mParent->mQuadMerging)
+  _mergeQuads(segments, mergedQuads);
+
+ // Then the ranges, one after another.
+ vertexCount = 0;
+ indexCount = 0;
+ for (std::vector<Segment>::iterator it = segments.begin(); it != segments.end();it++)
+ {
+  (*it).mVertexStart = vertexCount;
+  (*it).mIndexStart = indexCount;
+  vertexCount += (*it).mVertexCount;
+  indexCount += (*it).mIndexCount;
+ }
+
+ vertexCount += mergedQuads.size();
+ indexCount += (mergedQuads.size() / 4) * 6;
+
+}
+
+void GeometryRenderable::execute()
+{
+ // Only touches this GeometryRenderable and reads the Brushes, so it is safe on any thread.
+ if (mIndexType == Ogre::HardwareIndexBuffer::IT_32BIT)
+  _renderSegments(mSegments, mMergedQuads, mLockedVertices, (Index32*) mLockedIndexes);
+ else
+  _renderSegments(mSegments, mMergedQuads, mLockedVertices, (Index16*) mLockedIndexes);
+}
+
+void GeometryRenderable::_unlockAllSegments()
+{
+
+ mIndexBuffer->unlock();
+ mVertexBuffer->unlock();
+ mLockedVertices = 0;
+ mLockedIndexes = 0;
+
+ ORANGUTAN_STAT(size_t vertexCount = mRenderOp.vertexData->vertexCount)
+ ORANGUTAN_STAT(size_t indexCount = mRenderOp.indexData->indexCount)
+ ORANGUTAN_STAT(mStats.brushesRendered += mSegments.size())
+ ORANGUTAN_STAT(mStats.verticesWritten += vertexCount)
+ ORANGUTAN_STAT(mStats.indexesWritten += indexCount)
+ ORANGUTAN_STAT(mStats.bytesUploaded += vertexCount * getVertexSize(mVertexFormat) + indexCount * mIndexBuffer->getIndexSize())
+ ORANGUTAN_STAT(mStats.renderMicroseconds += getMicroseconds() - mLockedTime)
+}
+
+template<typename IndexType> void GeometryRenderable::_renderSegments(const std::vector<Segment>& segments, const std::vector<Vertex>& mergedQuads, Ogre::uint8* vertices, IndexType* indexes)
+{
+ size_t vertexSize = getVertexSize(mVertexFormat);
+ size_t vertexStart = 0, indexStart = 0;
+ std::vector<Vertex> vertexScratch;
+ std::vector<Index32> indexScratch;
+ for (std::vector<Segment>::const_iterator it = segments.begin(); it != segments.end();it++)
+ {
+  vertexStart = (*it).mVertexStart + (*it).mVertexCount;
+  indexStart = (*it).mIndexStart + (*it).mIndexCount;
+  if ((*it).mMerged)
+   continue;
+  VertexWriter writer(vertices + ((*it).mVertexStart * vertexSize), mVertexFormat);
+  if (mParent->mVertexCacheOptimisation && (*it).mIndexCount >= OPTIMISE_MIN_INDEXES)
+   _renderOptimised((*it), writer, indexes + (*it).mIndexStart, (*it).mVertexCount, (*it).mIndexCount, vertexScratch, indexScratch);
+  else if ((*it).mBrush)
+   (*it).mBrush->_render(writer, indexes + (*it).mIndexStart, (*it).mVertexStart);
+  else
+   (*it).mMultiBrush->_render(writer, indexes + (*it).mIndexStart, (*it).mVertexStart, (*it).mPart);
+ }
+
+ if (mergedQuads.empty())
+  return;
+
+ // Merged quads go after every Segment, with the same triangles as Quad::_render.
+ VertexWriter writer(vertices + (vertexStart * vertexSize), mVertexFormat);
+ writer.write(&mergedQuads[0], mergedQuads.size());
+ indexes += indexStart;
+ for (size_t base = vertexStart;base < vertexStart + mergedQuads.size();base += 4)
+ {
+  indexes[0] = base + 2;
+  indexes[1] = base;
+  indexes[2] = base + 1;
+  indexes[3] = base + 2;
+  indexes[4] = base + 1;
+  indexes[5] = base + 3;
+  indexes += 6;
+ }
+}
+
+template<typename IndexType> void GeometryRenderable::_renderOptimised(const Segment& segment, VertexWriter& vertices, IndexType* indexes, size_t vertexCount, size_t indexCount, std::vector<Vertex>& vertexScratch, std::vector<Index32>& indexScratch)
+{
+
+ vertexScratch.resize(vertexCount);
+ indexScratch.resize(indexCount);
+
+ // Drawn from vertex 0 in VertexFormat_Colour, then offset and converted when written out.
+ VertexWriter scratch(&vertexScratch[0], VertexFormat_Colour);
+ if (segment.mBrush)
+  segment.mBrush->_render(scratch, &indexScratch[0], 0);
+ else
+  segment.mMultiBrush->_render(scratch, &indexScratch[0], 0, segment.mPart);
+
+ optimiseTriangles(vertexScratch, indexScratch);
+
+ // Welded vertices leave the end of the range unused.
+ vertices.write(&vertexScratch[0], vertexScratch.size());
+ for (size_t i=0;i < indexCount;i++)
+  indexes[i] = segment.mVertexStart + indexScratch[i];
+
+}
+
+/* struct. QuadMergeKey
+   desc.
+       Plane, axes, colour and texture mapping of a quad, rounded. Quads with the same
+       key may be merged.
+*/
+struct QuadMergeKey
+{
+ int mValues[14];
+ 
+ bool operator<(const QuadMergeKey& other) const
+ {
+  return std::lexicographical_compare(mValues, mValues + 14, other.mValues, other.mValues + 14);
+ }
+};
+
+/* struct. QuadMergeGroup
+   desc.
+       Quads with the same QuadMergeKey, as rectangles from (s0, t0) to (s1, t1) along the
+       axes s and t. Texture coordinates are mUV + (s * mUVPerS) + (t * mUVPerT).
+*/
+struct QuadMergeGroup
+{
+ Ogre::Vector3        mS, mT, mNormal;
+ Ogre::Real           mDistance;
+ Ogre::RGBA           mColour;
+ Ogre::Vector2        mUV, mUVPerS, mUVPerT;
+ std::vector<size_t>  mSegments;
+ std::vector<Ogre::Real> mRects;
+};
+
+static int roundForMerge(Ogre::Real value)
+{
+ return int(Ogre::Math::Floor(value * 4096.0f + 0.5f));
+}
+
+static bool closeForMerge(Ogre::Real a, Ogre::Real b)
+{
+ return b - a < HIDDEN_FACE_EPSILON;
+}
+
+static size_t findForMerge(const std::vector<Ogre::Real>& values, Ogre::Real value)
+{
+ return std::lower_bound(values.begin(), values.end(), value - HIDDEN_FACE_EPSILON) - values.begin();
+}
+
+void GeometryRenderable::_mergeQuads(std::vector<Segment>& segments, std::vector<Vertex>& mergedQuads)
+{
+
+ std::map<QuadMergeKey, size_t> keys;
+ std::vector<QuadMergeGroup> groups;
+
+ for (size_t i=0;i < segments.size();i++)
+ {
+
+  const Vertex* quad = segments[i].mBrush ? segments[i].mBrush->_getQuad() : segments[i].mMultiBrush->_getQuad(segments[i].mPart);
+  if (quad == 0)
+   continue;
+
+  // Only rectangles of one colour, with an affine texture mapping.
+  Ogre::Vector3 origin = quad[2].position, alongS = quad[3].position - origin, alongT = quad[0].position - origin;
+  Ogre::Real lengthS = alongS.length(), lengthT = alongT.length();
+  if (lengthS < HIDDEN_FACE_EPSILON || lengthT < HIDDEN_FACE_EPSILON)
+   continue;
+
+  QuadMergeGroup group;
+  group.mS = alongS / lengthS;
+  group.mT = alongT / lengthT;
+  if (Ogre::Math::Abs(group.mS.dotProduct(group.mT)) > HIDDEN_FACE_EPSILON)
+   continue;
+  if (quad[1].position.positionEquals(quad[3].position + alongT, HIDDEN_FACE_EPSILON) == false)
+   continue;
+  if (quad[0].colour != quad[1].colour || quad[0].colour != quad[2].colour || quad[0].colour != quad[3].colour)
+   continue;
+  if ((quad[1].uv - quad[3].uv - quad[0].uv + quad[2].uv).squaredLength() > HIDDEN_FACE_EPSILON * HIDDEN_FACE_EPSILON)
+   continue;
+
+  group.mNormal = group.mS.crossProduct(group.mT);
+  group.mDistance = group.mNormal.dotProduct(origin);
+  group.mColour = quad[0].colour;
+  Ogre::Real s0 = group.mS.dotProduct(origin), t0 = group.mT.dotProduct(origin);
+  group.mUVPerS = (quad[3].uv - quad[2].uv) / lengthS;
+  group.mUVPerT = (quad[0].uv - quad[2].uv) / lengthT;
+  group.mUV = quad[2].uv - (group.mUVPerS * s0) - (group.mUVPerT * t0);
+
+  QuadMergeKey key;
+  key.mValues[0] = roundForMerge(group.mS.x);
+  key.mValues[1] = roundForMerge(group.mS.y);
+  key.mValues[2] = roundForMerge(group.mS.z);
+  key.mValues[3] = roundForMerge(group.mT.x);
+  key.mValues[4] = roundForMerge(group.mT.y);
+  key.mValues[5] = roundForMerge(group.mT.z);
+  key.mValues[6] = roundForMerge(group.mDistance);
+  key.mValues[7] = int(group.mColour);
+  key.mValues[8] = roundForMerge(group.mUV.x);
+  key.mValues[9] = roundForMerge(group.mUV.y);
+  key.mValues[10] = roundForMerge(group.mUVPerS.x);
+  key.mValues[11] = roundForMerge(group.mUVPerS.y);
+  key.mValues[12] = roundForMerge(group.mUVPerT.x);
+  key.mValues[13] = roundForMerge(group.mUVPerT.y);
+
+  std::map<QuadMergeKey, size_t>::iterator it = keys.find(key);
+  if (it == keys.end())
+  {
+   it = keys.insert(std::make_pair(key, groups.size())).first;
+   groups.push_back(group);
+  }
+
+  QuadMergeGroup& found = groups[(*it).second];
+  found.mSegments.push_back(i);
+  found.mRects.push_back(s0);
+  found.mRects.push_back(s0 + lengthS);
+  found.mRects.push_back(t0);
+  found.mRects.push_back(t0 + lengthT);
+ }
+
+ std::vector<Ogre::Real> s, t;
+ std::vector<Ogre::uint8> cells;
+ std::vector<size_t> rects;
+
+ for (std::vector<QuadMergeGroup>::iterator group = groups.begin(); group != groups.end();group++)
+ {
+
+  size_t quadCount = (*group).mSegments.size();
+  if (quadCount < 2)
+   continue;
+
+  // Split the plane into a grid along every edge of the quads.
+  s.clear();
+  t.clear();
+  for (size_t i=0;i < quadCount;i++)
+  {
+   s.push_back((*group).mRects[i * 4]);
+   s.push_back((*group).mRects[i * 4 + 1]);
+   t.push_back((*group).mRects[i * 4 + 2]);
+   t.push_back((*group).mRects[i * 4 + 3]);
+  }
+  std::sort(s.begin(), s.end());
+  s.erase(std::unique(s.begin(), s.end(), closeForMerge), s.end());
+  std::sort(t.begin(), t.end());
+  t.erase(std::unique(t.begin(), t.end(), closeForMerge), t.end());
+
+  // Scattered quads with nothing to merge would need a huge grid.
+  size_t width = s.size() - 1, height = t.size() - 1;
+  if (width * height > quadCount * 64)
+   continue;
+
+  // Cells covered by a quad are 1, and 2 once they are in a merged quad.
+  cells.assign(width * height, 0);
+  for (size_t i=0;i < quadCount;i++)
+  {
+   size_t s0 = findForMerge(s, (*group).mRects[i * 4]), s1 = findForMerge(s, (*group).mRects[i * 4 + 1]);
+   size_t t0 = findForMerge(t, (*group).mRects[i * 4 + 2]), t1 = findForMerge(t, (*group).mRects[i * 4 + 3]);
+   for (size_t y=t0;y < t1;y++)
+    for (size_t x=s0;x < s1;x++)
+     cells[y * width + x] = 1;
+  }
+
+  // Grow each merged quad along s as far as it goes, then along t.
+  rects.clear();
+  for (size_t y=0;y < height;y++)
+  {
+   for (size_t x=0;x < width;x++)
+   {
+
+    if (cells[y * width + x] != 1)
+     continue;
+
+    size_t x1 = x + 1;
+    while (x1 < width && cells[y * width + x1] == 1)
+     x1++;
+
+    size_t y1 = y + 1;
+    for (;y1 < height;y1++)
+    {
+     size_t i = x;
+     while (i < x1 && cells[y1 * width + i] == 1)
+      i++;
+     if (i != x1)
+      break;
+    }
+
+    for (size_t j=y;j < y1;j++)
+     for (size_t i=x;i < x1;i++)
+      cells[j * width + i] = 2;
+
+    rects.push_back(x);
+    rects.push_back(x1);
+    rects.push_back(y);
+    rects.push_back(y1);
+   }
+  }
+
+  // Not worth losing the partial redraws of these Segments for.
+  if (rects.size() / 4 >= quadCount)
+   continue;
+
+  for (std::vector<size_t>::iterator it = (*group).mSegments.begin(); it != (*group).mSegments.end();it++)
+  {
+   segments[*it].mMerged = true;
+   segments[*it].mVertexCount = 0;
+   segments[*it].mIndexCount = 0;
+  }
+
+  // Corners in the order of Quad::mVertices; A, B, C, D.
+  Vertex vertex;
+  vertex.colour = (*group).mColour;
+  for (size_t i=0;i < rects.size();i += 4)
+  {
+   Ogre::Real cornerS[4] = {s[rects[i]], s[rects[i + 1]], s[rects[i]], s[rects[i + 1]]};
+   Ogre::Real cornerT[4] = {t[rects[i + 3]], t[rects[i + 3]], t[rects[i + 2]], t[rects[i + 2]]};
+   for (size_t j=0;j < 4;j++)
+   {
+    vertex.position = ((*group).mS * cornerS[j]) + ((*group).mT * cornerT[j]) + ((*group).mNormal * (*group).mDistance);
+    vertex.uv = (*group).mUV + ((*group).mUVPerS * cornerS[j]) + ((*group).mUVPerT * cornerT[j]);
+    mergedQuads.push_back(vertex);
+   }
+  }
+ }
+
+}
+
+bool GeometryRenderable::_beginBackRender()
+{
+
+ if (mRedrawNeeded == false)
+  return false;
+
+ mRedrawNeeded = false;
+ mLayoutChanged = false;
+ _layoutSegments(mBack.mSegments, mBack.mMergedQuads, mBack.mAABB, mBack.mVertexCount, mBack.mIndexCount);
+
+ mBack.mIndexType = _getIndexType(mBack.mVertexCount);
+ size_t vertexBytes = mBack.mVertexCount * getVertexSize(mVertexFormat);
+ size_t indexBytes = mBack.mIndexCount * (mBack.mIndexType == Ogre::HardwareIndexBuffer::IT_32BIT ? sizeof(Index32) : sizeof(Index16));
+
+ if (mBack.mVertices.capacity() < vertexBytes)
+  mBack.mVertices.resize(vertexBytes);
+ if (mBack.mIndexes.capacity() < indexBytes)
+  mBack.mIndexes.resize(indexBytes);
+
+ return true;
+}
+
+void GeometryRenderable::_renderBack()
+{
+ if (mBack.mVertexCount == 0 || mBack.mIndexCount == 0)
+  return;
+
+ // Only touches the back buffer and reads the Brushes, so it is safe on any thread.
+ if (mBack.mIndexType == Ogre::HardwareIndexBuffer::IT_32BIT)
+  _renderSegments(mBack.mSegments, mBack.mMergedQuads, mBack.mVertices.first(), (Index32*) mBack.mIndexes.first());
+ else
+  _renderSegments(mBack.mSegments, mBack.mMergedQuads, mBack.mVertices.first(), (Index16*) mBack.mIndexes.first());
+}
+
+void GeometryRenderable::_endBackRender()
+{
+
+ ORANGUTAN_STAT(unsigned long start = getMicroseconds())
+ ORANGUTAN_STAT(mStats.redraws++)
+ ORANGUTAN_STAT(mStats.fullRedraws++)
+ mLastRedrawFrame = getFrameNumber();
+
+ if (mUsageHint == UsageHint_Adaptive && mUsage != Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY)
+  _setUsage(Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY);
+
+ // The ranges in mSegments are now those of the uploaded Brushes.
+ mLayoutChanged = false;
+ mSegments.swap(mBack.mSegments);
+ mMergedQuads.swap(mBack.mMergedQuads);
+ mAABB = mBack.mAABB;
+ mRenderOp.vertexData->vertexCount = mBack.mVertexCount;
+ mRenderOp.indexData->indexCount = mBack.mIndexCount;
+
+ if (mBack.mVertexCount == 0 || mBack.mIndexCount == 0)
+  return;
+
+ if (mBack.mIndexType != mIndexType)
+ {
+  mIndexType = mBack.mIndexType;
+  mIndexBufferSize = 0; // Recreate it.
+ }
+
+ _resizeVertexBuffer(mBack.mVertexCount);
+ _resizeIndexBuffer(mBack.mIndexCount);
+
+ size_t vertexBytes = mBack.mVertexCount * getVertexSize(mVertexFormat);
+ size_t indexBytes = mBack.mIndexCount * mIndexBuffer->getIndexSize();
+ mVertexBuffer->writeData(0, vertexBytes, mBack.mVertices.first(), true);
+ mIndexBuffer->writeData(0, indexBytes, mBack.mIndexes.first(), true);
+
+ ORANGUTAN_STAT(mStats.brushesRendered += mSegments.size())
+ ORANGUTAN_STAT(mStats.verticesWritten += mBack.mVertexCount)
+ ORANGUTAN_STAT(mStats.indexesWritten += mBack.mIndexCount)
+ ORANGUTAN_STAT(mStats.bytesUploaded += vertexBytes + indexBytes)
+ ORANGUTAN_STAT(mStats.redrawMicroseconds += getMicroseconds() - start)
+}
+
+bool GeometryRenderable::_renderChangedSegments()
+{
+
+ ORANGUTAN_STAT(unsigned long start = getMicroseconds())
+
+ // Check that every changed Brush still fits into its range first, otherwise
+ // the buffers need to be compacted.
+ for (std::vector<Segment>::iterator it = mSegments.begin(); it != mSegments.end();it++)
+ {
+  Segment& segment = (*it);
+  if (segment.mMerged)
+  {
+   // Merged quads have to be merged again.
+   if ((segment.mBrush ? segment.mBrush->getRevision() : segment.mMultiBrush->getRevision()) != segment.mRevision)
+    return false;
+  }
+  else if (segment.mBrush)
+  {
+   if (segment.mBrush->getRevision() != segment.mRevision)
+    if (segment.mBrush->_getVertexCount() > segment.mVertexCount || segment.mBrush->_getIndexCount() > segment.mIndexCount)
+     return false;
+  }
+  else if (segment.mMultiBrush->getRevision() != segment.mRevision)
+  {
+   if (segment.mMultiBrush->_getVertexCount(segment.mPart) > segment.mVertexCount || segment.mMultiBrush->_getIndexCount(segment.mPart) > segment.mIndexCount)
+    return false;
+  }
+ }
+
+ ORANGUTAN_STAT(mStats.layoutMicroseconds += getMicroseconds() - start)
+ ORANGUTAN_STAT(start = getMicroseconds())
+ mAABB.setNull();
+
+ for (std::vector<Segment>::iterator it = mSegments.begin(); it != mSegments.end();it++)
+ {
+
+  Segment& segment = (*it);
+  size_t revision = segment.mBrush ? segment.mBrush->getRevision() : segment.mMultiBrush->getRevision();
+
+  if (revision != segment.mRevision)
+  {
+
+   size_t vertexCount = segment.mBrush ? segment.mBrush->_getVertexCount() : segment.mMultiBrush->_getVertexCount(segment.mPart);
+   size_t indexCount = segment.mBrush ? segment.mBrush->_getIndexCount() : segment.mMultiBrush->_getIndexCount(segment.mPart);
+   bool optimised = mParent->mVertexCacheOptimisation && indexCount >= OPTIMISE_MIN_INDEXES;
+   size_t first, count;
+
+   // Optimised Segments have their vertices reordered, so are always drawn in full.
+   if (segment.mBrush && optimised == false && segment.mBrush->_getChangedVertices(segment.mRevision, first, count))
+    _renderSegmentVertices(segment, first, count);
+   else if (mIndexType == Ogre::HardwareIndexBuffer::IT_32BIT)
+    _renderSegment<Index32>(segment, vertexCount, indexCount);
+   else
+    _renderSegment<Index16>(segment, vertexCount, indexCount);
+
+   segment.mRevision = revision;
+   if (segment.mBrush)
+    segment.mBrush->mDrawnRevision = revision;
+  }
+
+  mAABB.merge(segment.mBrush ? segment.mBrush->getAABB() : segment.mMultiBrush->getAABB());
+ }
+
+ ORANGUTAN_STAT(mStats.renderMicroseconds += getMicroseconds() - start)
+ return true;
+}
+
+template<typename IndexType> void GeometryRenderable::_renderSegment(Segment& segment, size_t vertexCount, size_t indexCount)
+{
+
+ // Only lock what is written; the rest of the buffers stay as they are.
+ size_t vertexSize = getVertexSize(mVertexFormat);
+ void* vertices = 0;
+ if (vertexCount)
+  vertices = mVertexBuffer->lock(segment.mVertexStart * vertexSize, vertexCount * vertexSize, getWriteLock(mVertexBuffer.get(), segment.mVertexStart * vertexSize, vertexCount * vertexSize));
+
+ IndexType* indexes = 0;
+ if (segment.mIndexCount)
+  indexes = (IndexType*) mIndexBuffer->lock(segment.mIndexStart * sizeof(IndexType), segment.mIndexCount * sizeof(IndexType), getWriteLock(mIndexBuffer.get(), segment.mIndexStart * sizeof(IndexType), segment.mIndexCount * sizeof(IndexType)));
+
+ VertexWriter writer(vertices, mVertexFormat);
+ if (mParent->mVertexCacheOptimisation && indexCount >= OPTIMISE_MIN_INDEXES)
+ {
+  std::vector<Vertex> vertexScratch;
+  std::vector<Index32> indexScratch;
+  _renderOptimised(segment, writer, indexes, vertexCount, indexCount, vertexScratch, indexScratch);
+ }
+ else if (segment.mBrush)
+  segment.mBrush->_render(writer, indexes, segment.mVertexStart);
+ else
+  segment.mMultiBrush->_render(writer, indexes, segment.mVertexStart, segment.mPart);
+
+ // Any unused indexes become degenerate triangles.
+ for (size_t i=indexCount;i < segment.mIndexCount;i++)
+  indexes[i] = segment.mVertexStart;
+
+ if (indexes)
+  mIndexBuffer->unlock();
+
+ if (vertices)
+  mVertexBuffer->unlock();
+
+ ORANGUTAN_STAT(mStats.brushesRendered++)
+ ORANGUTAN_STAT(mStats.verticesWritten += vertexCount)
+ ORANGUTAN_STAT(mStats.indexesWritten += segment.mIndexCount)
+ ORANGUTAN_STAT(mStats.bytesUploaded += vertexCount * vertexSize + segment.mIndexCount * sizeof(IndexType))
+}
+
+void GeometryRenderable::_renderSegmentVertices(Segment& segment, size_t first, size_t count)
+{
+
+ size_t vertexSize = getVertexSize(mVertexFormat);
+ size_t offset = (segment.mVertexStart + first) * vertexSize;
+ VertexWriter writer(mVertexBuffer->lock(offset, count * vertexSize, getWriteLock(mVertexBuffer.get(), offset, count * vertexSize)), mVertexFormat);
+ segment.mBrush->_renderVertices(writer, first, count);
+ mVertexBuffer->unlock();
+
+ ORANGUTAN_STAT(mStats.brushesRendered++)
+ ORANGUTAN_STAT(mStats.verticesWritten += count)
+ ORANGUTAN_STAT(mStats.bytesUploaded += count * vertexSize)
+}
+
+void GeometryRenderable::setUsageHint(UsageHint hint)
+{
+ mUsageHint = hint;
+ _updateUsage();
+}
+
+bool GeometryRenderable::_updateUsage()
+{
+ 
+ Ogre::HardwareBuffer::Usage usage = mUsage;
+ 
+ if (mUsageHint == UsageHint_Static)
+  usage = Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY;
+ else if (mUsageHint == UsageHint_Dynamic)
+  usage = Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY;
+ else if (mRedrawNeeded == false && getFrameNumber() - mLastRedrawFrame >= STATIC_AFTER_FRAMES)
+  usage = Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY;
+ 
+ if (usage == mUsage)
+  return false;
+ 
+ ORANGUTAN_TRACE(__FUNCTION__ << " " << mMaterialName << (usage == Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY ? " static" : " dynamic"))
+ _setUsage(usage);
+ _renderAllSegments();
+ return true;
+}
+
+void GeometryRenderable::trimMemory()
+{
+ mRedrawNeeded = false;
+ _renderAllSegments(true);
+}
+
+void GeometryRenderable::_setUsage(Ogre::HardwareBuffer::Usage usage)
+{
+ _destroy();
+ mUsage = usage;
+ _create();
+ mLayoutChanged = true;
+}
+
+void  GeometryRenderable::_create(size_t initialSize)
+{ 
+
+ ORANGUTAN_TRACE(__FUNCTION__)
+ mVertexBufferSize = initialSize * 3;
+ mRenderOp.vertexData = OGRE_NEW Ogre::VertexData;
+ mRenderOp.vertexData->vertexStart = 0;
+ mRenderOp.vertexData->vertexCount = 0;
+ 
+ Ogre::VertexDeclaration* vertexDecl = mRenderOp.vertexData->vertexDeclaration;
+ size_t offset = 0;
+
+ // Position
+ vertexDecl->addElement(0,0, Ogre::VET_FLOAT3, Ogre::VES_POSITION);
+ offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT3);
+ 
+ // Colour
+ vertexDecl->addElement(0, offset, getColourType(), Ogre::VES_DIFFUSE);
+ offset += Ogre::VertexElement::getTypeSize(getColourType());
+ 
+ // Texture Coordinates
+#if ORANGUTAN_HALF_UV
+ if (mVertexFormat == VertexFormat_ColourHalfUV)
+  vertexDecl->addElement(0, offset, Ogre::VET_HALF2, Ogre::VES_TEXTURE_COORDINATES);
+ else
+#endif
+  vertexDecl->addElement(0, offset, Ogre::VET_FLOAT2, Ogre::VES_TEXTURE_COORDINATES);
+ 
+ mVertexBuffer = Ogre::HardwareBufferManager::getSingletonPtr()
+     ->createVertexBuffer(
+         vertexDecl->getVertexSize(0),
+         mVertexBufferSize,
+         mUsage,
+         false
+     );
+ 
+ mRenderOp.vertexData->vertexBufferBinding->setBinding(0, mVertexBuffer);
+ 
+ mRenderOp.useIndexes = true;
+ mRenderOp.indexData = OGRE_NEW Ogre::IndexData;
+ mRenderOp.indexData->indexStart = 0;
+ mRenderOp.indexData->indexCount = 0;
+ 
+ mIndexBufferSize = mVertexBufferSize * 3;
+ mIndexBuffer = Ogre::HardwareBufferManager::getSingletonPtr()->createIndexBuffer(
+   mIndexType,
+   mIndexBufferSize,
+   mUsage
+  );
+ mRenderOp.indexData->indexBuffer = mIndexBuffer;
+ mRenderOp.operationType = Ogre::RenderOperation::OT_TRIANGLE_LIST;
+ ORANGUTAN_STAT(mStats.bufferReallocations += 2)
+ 
+}
+
+void  GeometryRenderable::_destroy()
+{
+ 
+  ORANGUTAN_TRACE(__FUNCTION__)
+  OGRE_DELETE mRenderOp.vertexData;
+  OGRE_DELETE mRenderOp.indexData;
+  mRenderOp.vertexData = 0;
+  mVertexBuffer.setNull();
+  mVertexBufferSize = 0;
+  mIndexBuffer.setNull();
+  mIndexBufferSize = 0;
+}
+
+void  GeometryRenderable::_resizeVertexBuffer(size_t requestedSize, bool shrink)
+{
+ ORANGUTAN_TRACE(__FUNCTION__ << " " << requestedSize)
+ 
+ if (mVertexBufferSize == 0)
+ {
+  ORANGUTAN_TRACE("Vertex buffer size is zero, need to create it. Pointer is " << this)
+  _create();
+ }
+ 
+ size_t newVertexBufferSize = 1;
+ 
+ while(newVertexBufferSize < requestedSize)
+  newVertexBufferSize <<= 1;
+ 
+ if (requestedSize > mVertexBufferSize || (shrink && newVertexBufferSize < mVertexBufferSize))
+ {
+  mVertexBuffer = Ogre::HardwareBufferManager::getSingletonPtr()->createVertexBuffer(
+    mRenderOp.vertexData->vertexDeclaration->getVertexSize(0),
+    newVertexBufferSize,
+    mUsage,
+    false
+  );
+  mVertexBufferSize = newVertexBufferSize;
+  ORANGUTAN_STAT(mStats.bufferReallocations++)
+  mRenderOp.vertexData->vertexStart = 0;
+  mRenderOp.vertexData->vertexBufferBinding->setBinding(0, mVertexBuffer);
+ }
+  
+}
+
+void  GeometryRenderable::_resizeIndexBuffer(size_t requestedSize, bool shrink)
+{
+ 
+ ORANGUTAN_TRACE(__FUNCTION__ << " " << requestedSize)
+ 
+ size_t newIndexBufferSize = 1;
+ 
+ while(newIndexBufferSize < requestedSize)
+  newIndexBufferSize <<= 1;
+ 
+ if (requestedSize > mIndexBufferSize || (shrink && newIndexBufferSize < mIndexBufferSize))
+ {
+  mIndexBuffer = Ogre::HardwareBufferManager::getSingletonPtr()->createIndexBuffer(
+   mIndexType,
+   newIndexBufferSize,
+   mUsage
+  );
+  mRenderOp.indexData->indexBuffer = mIndexBuffer;
+  mIndexBufferSize = newIndexBufferSize;
+  ORANGUTAN_STAT(mStats.bufferReallocations++)
+ }
+  
+}
+
+void GeometryRenderable::getWorldTransforms(Ogre::Matrix4* transform) const
+{
+ transform[0] = mParent->_getParentNodeFullTransform();
+}
+
+void GeometryRenderable::setVertexFormat(VertexFormat format)
+{
+ _destroy();
+ mVertexFormat = format;
+ _create();
+ mLayoutChanged = true;
+ mRedrawNeeded = true;
+}
+
+void GeometryRenderable::setMaterialName(const Ogre::String& materialName, const Ogre::String& materialGroup)
+{
+ ORANGUTAN_TRACE(__FUNCTION__ << " " << materialName)
+ mMaterialName = materialName;
+ mMaterialGroup = materialGroup;
+ mMaterial = Ogre::MaterialManager::getSingletonPtr()->load(mMaterialName, mMaterialGroup);
+}
+
+Ogre::Real GeometryRenderable::getSquaredViewDepth(const Ogre::Camera* cam) const
+{
+ Ogre::Node* node = mParent->getParentNode();
+ assert(node);
+ return node->getSquaredViewDepth(cam);
+}
+
+const Ogre::LightList& GeometryRenderable::getLights(void) const
+{
+ return mParent->queryLights();
+}
+
+void GeometryRenderable::pushBrush(Brush* brush)
+{
+ brush->mRenderableSlot = mBrushes.size();
+ mBrushes.push_back(brush);
+ mParent->redrawNeeded(this, true);
+}
+   
+void GeometryRenderable::popBrush(Brush* brush)
+{
+ // Move the last Brush into its place; everything is relaid out anyway.
+ size_t slot = brush->mRenderableSlot;
+ mBrushes[slot] = mBrushes.back();
+ mBrushes[slot]->mRenderableSlot = slot;
+ mBrushes.pop_back();
+ mParent->redrawNeeded(this, true);
+}
+
+void GeometryRenderable::pushPart(MultiBrush* brush, size_t part)
+{
+ if (brush->mPartSlots.size() <= part)
+  brush->mPartSlots.resize(brush->_getPartCount());
+ brush->mPartSlots[part] = mParts.size();
+ mParts.push_back(Part(brush, part));
+ mParent->redrawNeeded(this, true);
+}
+
+void GeometryRenderable::popPart(MultiBrush* brush, size_t part)
+{
+ size_t slot = brush->mPartSlots[part];
+ mParts[slot] = mParts.back();
+ mParts[slot].first->mPartSlots[mParts[slot].second] = slot;
+ mParts.pop_back();
+ mParent->redrawNeeded(this, true);
+}
+
+
+
+
+// ----------------------------------------------------------------------------------------
+
+
+
+
+BlockInstances::BlockInstances(const Ogre::String& materialName, const Ogre::String& materialGroup, Geometry* parent, GeometryCell* cell, size_t index, size_t faces, bool hardware)
+: mParent(parent),
+  mCell(cell),
+  mIndex(index),
+  mFaces(faces),
+  mHardware(hardware),
+  mChangedStart(0),
+  mChangedEnd(0),
+  mCapacity(0),
+  mMaterialName(materialName),
+  mMaterialGroup(materialGroup),
+  mAABBChanged(false)
+{
+ 
+ // The unit cube, with only the faces drawn.
+ Vertex quad[4];
+ for (size_t i=0;i < 6;i++)
+ {
+  if ((faces & (1 << i)) == 0)
+   continue;
+  Block::_getUnitQuad(i, quad);
+  Index32 base = mUnitVertices.size();
+  mUnitVertices.insert(mUnitVertices.end(), quad, quad + 4);
+  mUnitIndexes.push_back(base + 2);
+  mUnitIndexes.push_back(base + 0);
+  mUnitIndexes.push_back(base + 1);
+  mUnitIndexes.push_back(base + 2);
+  mUnitIndexes.push_back(base + 1);
+  mUnitIndexes.push_back(base + 3);
+ }
+ 
+ mRenderOp.vertexData = OGRE_NEW Ogre::VertexData;
+ mRenderOp.vertexData->vertexStart = 0;
+ mRenderOp.vertexData->vertexCount = 0;
+ 
+ // Always full floats, as Vertex.
+ Ogre::VertexDeclaration* vertexDecl = mRenderOp.vertexData->vertexDeclaration;
+ size_t offset = 0;
+ vertexDecl->addElement(0, offset, Ogre::VET_FLOAT3, Ogre::VES_POSITION);
+ offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT3);
+ vertexDecl->addElement(0, offset, getColourType(), Ogre::VES_DIFFUSE);
+ offset += Ogre::VertexElement::getTypeSize(getColourType());
+ vertexDecl->addElement(0, offset, Ogre::VET_FLOAT2, Ogre::VES_TEXTURE_COORDINATES, 0);
+ 
+ if (mHardware)
+ {
+  offset = 0;
+  vertexDecl->addElement(1, offset, Ogre::VET_FLOAT3, Ogre::VES_TEXTURE_COORDINATES, 1);
+  offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT3);
+  vertexDecl->addElement(1, offset, Ogre::VET_FLOAT4, Ogre::VES_TEXTURE_COORDINATES, 2);
+  offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT4);
+  vertexDecl->addElement(1, offset, Ogre::VET_FLOAT3, Ogre::VES_TEXTURE_COORDINATES, 3);
+  
+  // Only the instances change, so the unit cube is written once.
+  mVertexBuffer = Ogre::HardwareBufferManager::getSingletonPtr()->createVertexBuffer(sizeof(Vertex), mUnitVertices.size(), Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY, false);
+  mVertexBuffer->writeData(0, mUnitVertices.size() * sizeof(Vertex), &mUnitVertices[0], true);
+  mRenderOp.vertexData->vertexBufferBinding->setBinding(0, mVertexBuffer);
+  
+  mIndexBuffer = Ogre::HardwareBufferManager::getSingletonPtr()->createIndexBuffer(Ogre::HardwareIndexBuffer::IT_16BIT, mUnitIndexes.size(), Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY);
+  Index16* indexes = (Index16*) mIndexBuffer->lock(Ogre::HardwareBuffer::HBL_DISCARD);
+  for (size_t i=0;i < mUnitIndexes.size();i++)
+   indexes[i] = mUnitIndexes[i];
+  mIndexBuffer->unlock();
+ }
+ 
+ mRenderOp.useIndexes = true;
+ mRenderOp.indexData = OGRE_NEW Ogre::IndexData;
+ mRenderOp.indexData->indexStart = 0;
+ mRenderOp.indexData->indexCount = 0;
+ mRenderOp.indexData->indexBuffer = mIndexBuffer;
+ mRenderOp.operationType = Ogre::RenderOperation::OT_TRIANGLE_LIST;
+ 
+}
+
+BlockInstances::~BlockInstances()
+{
+ 
+ for (std::vector<Block*>::iterator it = mBlocks.begin(); it != mBlocks.end();it++)
+  (*it)->mInstances = 0;
+ 
+ OGRE_DELETE mRenderOp.vertexData;
+ OGRE_DELETE mRenderOp.indexData;
+ mVertexBuffer.setNull();
+ mIndexBuffer.setNull();
+ mInstanceBuffer.setNull();
+ 
+}
+
+void BlockInstances::addInstance(Block* block)
+{
+ block->mInstances = this;
+ block->mInstanceSlot = mBlocks.size();
+ mBlocks.push_back(block);
+ mInstances.push_back(Instance());
+ updateInstance(block);
+}
+
+void BlockInstances::removeInstance(Block* block)
+{
+ 
+ // Move the last Instance into its place, so only that one is rewritten.
+ size_t slot = block->mInstanceSlot;
+ mBlocks[slot] = mBlocks.back();
+ mBlocks[slot]->mInstanceSlot = slot;
+ mInstances[slot] = mInstances.back();
+ mBlocks.pop_back();
+ mInstances.pop_back();
+ block->mInstances = 0;
+ 
+ _changed(slot);
+ mChangedEnd = std::min(mChangedEnd, mInstances.size());
+ 
+}
+
+void BlockInstances::updateInstance(Block* block)
+{
+ Instance& instance = mInstances[block->mInstanceSlot];
+ instance.position = block->mPosition;
+ instance.orientation = block->mOrientation;
+ instance.size = block->mSize;
+ _changed(block->mInstanceSlot);
+}
+
+void BlockInstances::_changed(size_t slot)
+{
+ 
+ if (mChangedStart < mChangedEnd)
+ {
+  mChangedStart = std::min(mChangedStart, slot);
+  mChangedEnd = std::max(mChangedEnd, slot + 1);
+ }
+ else
+ {
+  mChangedStart = slot;
+  mChangedEnd = slot + 1;
+ }
+ 
+ mAABBChanged = true;
+ mParent->_instancesChanged();
+}
+
+void BlockInstances::_resize(size_t count)
+{
+ 
+ ORANGUTAN_TRACE(__FUNCTION__ << " " << count)
+ 
+ size_t capacity = std::max(mCapacity, size_t(16));
+ while (capacity < count)
+  capacity *= 2;
+ mCapacity = capacity;
+ 
+ if (mHardware)
+ {
+  mInstanceBuffer = Ogre::HardwareBufferManager::getSingletonPtr()->createVertexBuffer(sizeof(Instance), mCapacity, Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY, false);
+#if ORANGUTAN_HARDWARE_INSTANCING
+  mInstanceBuffer->setIsInstanceData(true);
+  mInstanceBuffer->setInstanceDataStepRate(1);
+#endif
+  mRenderOp.vertexData->vertexBufferBinding->setBinding(1, mInstanceBuffer);
+ }
+ else
+ {
+  // Each copy of the unit cube is indexed the same way, so the indexes are only written here.
+  size_t vertexCount = mCapacity * mUnitVertices.size();
+  size_t indexCount = mCapacity * mUnitIndexes.size();
+  Ogre::HardwareIndexBuffer::IndexType indexType = vertexCount > 0xFFFF ? Ogre::HardwareIndexBuffer::IT_32BIT : Ogre::HardwareIndexBuffer::IT_16BIT;
+  
+  mVertexBuffer = Ogre::HardwareBufferManager::getSingletonPtr()->createVertexBuffer(sizeof(Vertex), vertexCount, Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY, false);
+  mRenderOp.vertexData->vertexBufferBinding->setBinding(0, mVertexBuffer);
+  
+  mIndexBuffer = Ogre::HardwareBufferManager::getSingletonPtr()->createIndexBuffer(indexType, indexCount, Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY);
+  void* indexes = mIndexBuffer->lock(Ogre::HardwareBuffer::HBL_DISCARD);
+  for (size_t i=0;i < mCapacity;i++)
+  {
+   size_t base = i * mUnitVertices.size();
+   for (size_t j=0;j < mUnitIndexes.size();j++)
+   {
+    if (indexType == Ogre::HardwareIndexBuffer::IT_32BIT)
+     ((Index32*) indexes)[i * mUnitIndexes.size() + j] = base + mUnitIndexes[j];
+    else
+     ((Index16*) indexes)[i * mUnitIndexes.size() + j] = base + mUnitIndexes[j];
+   }
+  }
+  mIndexBuffer->unlock();
+  mRenderOp.indexData->indexBuffer = mIndexBuffer;
+ }
+ 
+ // Everything has to be written into the new buffers.
+ mChangedStart = 0;
+ mChangedEnd = mInstances.size();
+ 
+}
+
+void BlockInstances::_update()
+{
+ 
+ if (mInstances.size() > mCapacity)
+  _resize(mInstances.size());
+ 
+ if (mChangedStart < mChangedEnd)
+ {
+  size_t count = mChangedEnd - mChangedStart;
+  if (mHardware)
+  {
+   // Last frame may still be drawing from the changed records, so writeData waits for
+   // it unless every Instance is rewritten.
+   mInstanceBuffer->writeData(mChangedStart * sizeof(Instance), count * sizeof(Instance), &mInstances[mChangedStart], count == mCapacity);
+  }
+  else
+  {
+   // Copy the unit cube for each Instance; a range is locked so it waits for the GPU.
+   size_t unitCount = mUnitVertices.size();
+   size_t offset = mChangedStart * unitCount * sizeof(Vertex), length = count * unitCount * sizeof(Vertex);
+   Vertex* vertices = (Vertex*) mVertexBuffer->lock(offset, length, getWriteLock(mVertexBuffer.get(), offset, length));
+   Ogre::Matrix4 transform;
+   for (size_t i=mChangedStart;i < mChangedEnd;i++)
+   {
+    transform.makeTransform(mInstances[i].position, mInstances[i].size, mInstances[i].orientation);
+    for (size_t j=0;j < unitCount;j++)
+    {
+     *vertices = mUnitVertices[j];
+     vertices->position = transform * mUnitVertices[j].position;
+     vertices++;
+    }
+   }
+   mVertexBuffer->unlock();
+  }
+  mChangedStart = mChangedEnd = 0;
+ }
+ 
+ if (mHardware)
+ {
+  mRenderOp.vertexData->vertexCount = mUnitVertices.size();
+  mRenderOp.indexData->indexCount = mInstances.empty() ? 0 : mUnitIndexes.size();
+#if ORANGUTAN_HARDWARE_INSTANCING
+  mRenderOp.numberOfInstances = mInstances.size();
+#endif
+ }
+ else
+ {
+  mRenderOp.vertexData->vertexCount = mInstances.size() * mUnitVertices.size();
+  mRenderOp.indexData->indexCount = mInstances.size() * mUnitIndexes.size();
+ }
+ 
+ if (mAABBChanged)
+ {
+  mAABB.setNull();
+  for (std::vector<Block*>::iterator it = mBlocks.begin(); it != mBlocks.end();it++)
+   mAABB.merge((*it)->getAABB());
+  mAABBChanged = false;
+ }
+ 
+}
+
+void BlockInstances::setMaterialName(const Ogre::String& materialName, const Ogre::String& materialGroup)
+{
+ mMaterialName = materialName;
+ mMaterialGroup = materialGroup;
+ mMaterial = Ogre::MaterialManager::getSingletonPtr()->load(mMaterialName, mMaterialGroup);
+}
+
+void BlockInstances::getWorldTransforms(Ogre::Matrix4* transform) const
+{
+ transform[0] = mParent->_getParentNodeFullTransform();
+}
+
+Ogre::Real BlockInstances::getSquaredViewDepth(const Ogre::Camera* cam) const
+{
+ Ogre::Node* node = mParent->getParentNode();
+ assert(node);
+ return node->getSquaredViewDepth(cam);
+}
+
+const Ogre::LightList& BlockInstances::getLights(void) const
+{
+ return mParent->queryLights();
+}
+
+
+
+
+// ----------------------------------------------------------------------------------------
+
+
 
 
-
-// ----------------------------------------------------------------------------------------
-
-
-
-
  
 Quad::Quad(const Ogre::Vector3& position, const Ogre::Vector2& size, const Ogre::Quaternion& orientation, Ogre::AxisAlignedBox* aabb)
  : mPosition(position),
@@ -589,287 +2935,1441 @@ Quad::Quad(const Ogre::Vector3& position, const Ogre::Vector2& size, const Ogre:
    mTextureOffset(0,0),
    mTextureFlipX(false),
    mTextureFlipY(false),
-   mTextureAngle(Ogre::Degree(45)),
-   mAABB(aabb)
+   mTextureAngle(Ogre::Degree(45)),
+   mAABB(aabb)
+{
+ mColours[0] = Ogre::ColourValue::White;
+ mColours[1] = Ogre::ColourValue::White;
+ mColours[2] = Ogre::ColourValue::White;
+ mColours[3] = Ogre::ColourValue::White;
+
+ _update();
+}
+
+void Quad::_update()
+{
+  
+ mTransform.makeTransform(mPosition, mSize, mOrientation);
+ Ogre::VertexElementType colourType = getColourType();
+ 
+ mVertices[0].position = mTransform * QUAD_VERTICES[0]; // A
+ mVertices[0].uv = Ogre::Vector2(0,0);
+ mVertices[0].colour = packColour(mColours[0], colourType);
+ 
+ mVertices[1].position = mTransform * QUAD_VERTICES[1]; // B
+ mVertices[1].uv = Ogre::Vector2(1,0);
+ mVertices[1].colour = packColour(mColours[1], colourType);
+
+ mVertices[2].position = mTransform * QUAD_VERTICES[2]; // C
+ mVertices[2].uv = Ogre::Vector2(0,1);
+ mVertices[2].colour = packColour(mColours[2], colourType);
+
+ mVertices[3].position = mTransform * QUAD_VERTICES[3]; // D
+ mVertices[3].uv = Ogre::Vector2(1,1);
+ mVertices[3].colour = packColour(mColours[3], colourType);
+ 
+ // Texture Rotation
+ // ----------------
+ if (mTextureAngle.valueAngleUnits() != 0.0f)
+ {
+  Ogre::Vector3 t(0,0,0);
+  Ogre::Quaternion q;
+  q.FromAngleAxis(mTextureAngle, Ogre::Vector3::UNIT_Y);
+  for (size_t i=0;i < 4;i++)
+  {
+   t.x = mVertices[i].uv.x;
+   t.z = mVertices[i].uv.y;
+   t = q * t;
+   mVertices[i].uv.x = t.x;
+   mVertices[i].uv.y = t.z;
+  }
+ }
+ 
+ // Flip X
+ for (size_t i=0;i < 4;i++)
+ {
+  mVertices[i].uv.x = (mVertices[i].uv.x *  mTextureZoom.x) + mTextureOffset.x;
+  mVertices[i].uv.y = (mVertices[i].uv.y *  mTextureZoom.y) + mTextureOffset.y;
+ }
+ 
+ if (!mTextureFlipX) // X has to be flipped for some reason.
+  for (size_t i=0;i < 4;i++)
+   mVertices[i].uv.x *= -1;
+   
+ if (mTextureFlipY)
+  for (size_t i=0;i < 4;i++)
+   mVertices[i].uv.y *= -1;
+  
+  
+  // AABB
+  // ----
+  mAABB->merge(mVertices[0].position);
+  mAABB->merge(mVertices[1].position);
+  mAABB->merge(mVertices[2].position);
+  mAABB->merge(mVertices[3].position);
+
+
+}
+
+template<typename IndexType> void Quad::_render(VertexWriter& vertices, IndexType* indexes, size_t base)
+{
+ 
+ vertices.write(mVertices, 4);
+ 
+ // TODO: GeometryOp_Draw/GeometryOp_DrawInverse switch/if in here?
+ indexes[0] = base + 2; // C
+ indexes[1] = base;     // A
+ indexes[2] = base + 1; // B
+ indexes[3] = base + 2; // C
+ indexes[4] = base + 1; // B
+ indexes[5] = base + 3; // D
+ 
+}
+
+
+
+
+
+Plane::Plane(const Ogre::Vector3& position, const Ogre::Vector2& size, const Ogre::Quaternion& orientation, size_t materialIndex, Geometry* geometry)
+ : Brush(geometry, materialIndex)
+{
+ mQuad = new Quad(position, size, orientation, &mAABB);
+}
+
+void Plane::_render(VertexWriter& vertices, Index16* indexes, size_t base)
+{
+ mQuad->_render(vertices, indexes, base);
+}
+
+void Plane::_render(VertexWriter& vertices, Index32* indexes, size_t base)
+{
+ mQuad->_render(vertices, indexes, base);
+}
+
+void Plane::saveToOok(std::ofstream& stream)
+{
+ stream << "brush \"plane\" \n";
+ writeOok(stream, mQuad->mPosition, "\tposition ");
+ writeOok(stream, mQuad->mOrientation, "\torientation ");
+ writeOok(stream, mQuad->mSize, "\tsize ");
+ writeOok(stream, mQuad->mColours, 4, "\tcolours ");
+ writeOok(stream, mQuad->mTextureAngle, "\ttexture_angle ");
+ writeOok(stream, mQuad->mTextureFlipX, "\ttexture_flip_x ");
+ writeOok(stream, mQuad->mTextureFlipY, "\ttexture_flip_y ");
+ writeOok(stream, mQuad->mTextureOffset, "\ttexture_offset ");
+ writeOok(stream, mQuad->mTextureZoom, "\ttexture_offset ");
+ stream << ";\n\n";
+}
+
+
+GridKernel::GridKernel(const Ogre::Matrix4& transform, size_t lengthX, size_t lengthZ, const Ogre::Vector2& uvPerSample, const Ogre::Radian& uvAngle, Ogre::VertexElementType type)
+: halfX(float(lengthX) * 0.5f),
+  halfZ(float(lengthZ) * 0.5f),
+  uvPerX(float(uvPerSample.x)),
+  uvPerZ(float(uvPerSample.y)),
+  pitch(lengthX),
+  colourType(type)
+{
+ 
+ for (size_t i=0;i < 3;i++)
+  for (size_t j=0;j < 4;j++)
+   m[i][j] = float(transform[i][j]);
+ 
+ // As rotating (u, 0, v) around the y axis.
+ float c = float(Ogre::Math::Cos(uvAngle)), s = float(Ogre::Math::Sin(uvAngle));
+ uvRotation[0][0] = c;
+ uvRotation[0][1] = s;
+ uvRotation[1][0] = -s;
+ uvRotation[1][1] = c;
+ 
+}
+
+/*! struct. GridRow
+    desc.
+        What is the same along a row of GridKernel; a vertex at x is
+        position = m[.][0] * (x - halfX) + m[.][1] * height + origin[.], uv = uvPerX * x + uvOrigin.
+*/
+struct GridRow
+{
+ float origin[3];
+ float uvPerX[2];
+ float uvOrigin[2];
+};
+
+#if ORANGUTAN_SIMD >= 1
+/*! function. runGridSSE2
+    desc.
+        Four vertices of a row at a time, returns where it stopped.
+*/
+static size_t runGridSSE2(const GridKernel& k, const GridRow& row, const float* heights, Vertex* vertices, size_t x, size_t x1, float* lower, float* upper)
+{
+ 
+ if (x + 4 > x1)
+  return x;
+ 
+ const __m128 m00 = _mm_set1_ps(k.m[0][0]), m01 = _mm_set1_ps(k.m[0][1]), originX = _mm_set1_ps(row.origin[0]),
+              m10 = _mm_set1_ps(k.m[1][0]), m11 = _mm_set1_ps(k.m[1][1]), originY = _mm_set1_ps(row.origin[1]),
+              m20 = _mm_set1_ps(k.m[2][0]), m21 = _mm_set1_ps(k.m[2][1]), originZ = _mm_set1_ps(row.origin[2]),
+              uPerX = _mm_set1_ps(row.uvPerX[0]), uOrigin = _mm_set1_ps(row.uvOrigin[0]),
+              vPerX = _mm_set1_ps(row.uvPerX[1]), vOrigin = _mm_set1_ps(row.uvOrigin[1]),
+              halfX = _mm_set1_ps(k.halfX), four = _mm_set1_ps(4.0f);
+ 
+ __m128 xs = _mm_setr_ps(float(x), float(x + 1), float(x + 2), float(x + 3));
+ __m128 lowerX = _mm_set1_ps(lower[0]), lowerY = _mm_set1_ps(lower[1]), lowerZ = _mm_set1_ps(lower[2]);
+ __m128 upperX = _mm_set1_ps(upper[0]), upperY = _mm_set1_ps(upper[1]), upperZ = _mm_set1_ps(upper[2]);
+ float out[5][4];
+ 
+ for (;x + 4 <= x1;x += 4)
+ {
+  __m128 h = _mm_loadu_ps(heights + x);
+  __m128 dx = _mm_sub_ps(xs, halfX);
+  __m128 px = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, dx), _mm_mul_ps(m01, h)), originX);
+  __m128 py = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m10, dx), _mm_mul_ps(m11, h)), originY);
+  __m128 pz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m20, dx), _mm_mul_ps(m21, h)), originZ);
+  __m128 u = _mm_add_ps(_mm_mul_ps(uPerX, xs), uOrigin);
+  __m128 v = _mm_add_ps(_mm_mul_ps(vPerX, xs), vOrigin);
+  
+  lowerX = _mm_min_ps(lowerX, px); upperX = _mm_max_ps(upperX, px);
+  lowerY = _mm_min_ps(lowerY, py); upperY = _mm_max_ps(upperY, py);
+  lowerZ = _mm_min_ps(lowerZ, pz); upperZ = _mm_max_ps(upperZ, pz);
+  
+  // Vertex is interleaved, so each lane is written out on its own.
+  _mm_storeu_ps(out[0], px);
+  _mm_storeu_ps(out[1], py);
+  _mm_storeu_ps(out[2], pz);
+  _mm_storeu_ps(out[3], u);
+  _mm_storeu_ps(out[4], v);
+  for (size_t i=0;i < 4;i++)
+  {
+   Vertex& vertex = vertices[x + i];
+   vertex.position.x = out[0][i];
+   vertex.position.y = out[1][i];
+   vertex.position.z = out[2][i];
+   vertex.uv.x = out[3][i];
+   vertex.uv.y = out[4][i];
+  }
+  
+  xs = _mm_add_ps(xs, four);
+ }
+ 
+ float lanes[4];
+ __m128* bounds[6] = {&lowerX, &lowerY, &lowerZ, &upperX, &upperY, &upperZ};
+ for (size_t i=0;i < 6;i++)
+ {
+  _mm_storeu_ps(lanes, *bounds[i]);
+  if (i < 3)
+   lower[i] = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+  else
+   upper[i - 3] = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+ }
+ 
+ return x;
+}
+#endif
+
+#if ORANGUTAN_SIMD >= 2
+/*! function. runGridAVX2
+    desc.
+        Eight vertices of a row at a time, returns where it stopped.
+*/
+static size_t runGridAVX2(const GridKernel& k, const GridRow& row, const float* heights, Vertex* vertices, size_t x, size_t x1, float* lower, float* upper)
+{
+ 
+ if (x + 8 > x1)
+  return x;
+ 
+ const __m256 m00 = _mm256_set1_ps(k.m[0][0]), m01 = _mm256_set1_ps(k.m[0][1]), originX = _mm256_set1_ps(row.origin[0]),
+              m10 = _mm256_set1_ps(k.m[1][0]), m11 = _mm256_set1_ps(k.m[1][1]), originY = _mm256_set1_ps(row.origin[1]),
+              m20 = _mm256_set1_ps(k.m[2][0]), m21 = _mm256_set1_ps(k.m[2][1]), originZ = _mm256_set1_ps(row.origin[2]),
+              uPerX = _mm256_set1_ps(row.uvPerX[0]), uOrigin = _mm256_set1_ps(row.uvOrigin[0]),
+              vPerX = _mm256_set1_ps(row.uvPerX[1]), vOrigin = _mm256_set1_ps(row.uvOrigin[1]),
+              halfX = _mm256_set1_ps(k.halfX), eight = _mm256_set1_ps(8.0f);
+ 
+ __m256 xs = _mm256_setr_ps(float(x), float(x + 1), float(x + 2), float(x + 3), float(x + 4), float(x + 5), float(x + 6), float(x + 7));
+ __m256 lowerX = _mm256_set1_ps(lower[0]), lowerY = _mm256_set1_ps(lower[1]), lowerZ = _mm256_set1_ps(lower[2]);
+ __m256 upperX = _mm256_set1_ps(upper[0]), upperY = _mm256_set1_ps(upper[1]), upperZ = _mm256_set1_ps(upper[2]);
+ float out[5][8];
+ 
+ for (;x + 8 <= x1;x += 8)
+ {
+  __m256 h = _mm256_loadu_ps(heights + x);
+  __m256 dx = _mm256_sub_ps(xs, halfX);
+  __m256 px = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m00, dx), _mm256_mul_ps(m01, h)), originX);
+  __m256 py = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m10, dx), _mm256_mul_ps(m11, h)), originY);
+  __m256 pz = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m20, dx), _mm256_mul_ps(m21, h)), originZ);
+  __m256 u = _mm256_add_ps(_mm256_mul_ps(uPerX, xs), uOrigin);
+  __m256 v = _mm256_add_ps(_mm256_mul_ps(vPerX, xs), vOrigin);
+  
+  lowerX = _mm256_min_ps(lowerX, px); upperX = _mm256_max_ps(upperX, px);
+  lowerY = _mm256_min_ps(lowerY, py); upperY = _mm256_max_ps(upperY, py);
+  lowerZ = _mm256_min_ps(lowerZ, pz); upperZ = _mm256_max_ps(upperZ, pz);
+  
+  _mm256_storeu_ps(out[0], px);
+  _mm256_storeu_ps(out[1], py);
+  _mm256_storeu_ps(out[2], pz);
+  _mm256_storeu_ps(out[3], u);
+  _mm256_storeu_ps(out[4], v);
+  for (size_t i=0;i < 8;i++)
+  {
+   Vertex& vertex = vertices[x + i];
+   vertex.position.x = out[0][i];
+   vertex.position.y = out[1][i];
+   vertex.position.z = out[2][i];
+   vertex.uv.x = out[3][i];
+   vertex.uv.y = out[4][i];
+  }
+  
+  xs = _mm256_add_ps(xs, eight);
+ }
+ 
+ float lanes[8];
+ __m256* bounds[6] = {&lowerX, &lowerY, &lowerZ, &upperX, &upperY, &upperZ};
+ for (size_t i=0;i < 6;i++)
+ {
+  _mm256_storeu_ps(lanes, *bounds[i]);
+  for (size_t j=0;j < 8;j++)
+  {
+   if (i < 3)
+    lower[i] = std::min(lower[i], lanes[j]);
+   else
+    upper[i - 3] = std::max(upper[i - 3], lanes[j]);
+  }
+ }
+ 
+ return x;
+}
+#endif
+
+void GridKernel::run(const GridSamples& samples, Vertex* vertices, size_t x0, size_t z0, size_t x1, size_t z1, Ogre::AxisAlignedBox& aabb, SimdLevel level) const
+{
+ 
+ if (x0 >= x1 || z0 >= z1)
+  return;
+ 
+ // Short heights are expanded a row at a time, then run through the same code.
+ std::vector<float> expanded;
+ if (samples.shortHeights)
+  expanded.resize(pitch);
+ 
+ Ogre::RGBA white = packColour(Ogre::ColourValue::White, colourType);
+ 
+ float lower[3], upper[3];
+ for (size_t i=0;i < 3;i++)
+ {
+  lower[i] = std::numeric_limits<float>::max();
+  upper[i] = -std::numeric_limits<float>::max();
+ }
+ 
+ GridRow row;
+ for (size_t z=z0;z < z1;z++)
+ {
+  
+  float dz = float(z) - halfZ, v = float(z) * uvPerZ;
+  for (size_t i=0;i < 3;i++)
+   row.origin[i] = m[i][2] * dz + m[i][3];
+  for (size_t i=0;i < 2;i++)
+  {
+   row.uvPerX[i] = uvRotation[i][0] * uvPerX;
+   row.uvOrigin[i] = uvRotation[i][1] * v;
+  }
+  
+  const float* rowHeights = samples.heights + z * pitch;
+  if (samples.shortHeights)
+  {
+   const Ogre::uint16* rowShortHeights = samples.shortHeights + z * pitch;
+   for (size_t x=x0;x < x1;x++)
+    expanded[x] = float(rowShortHeights[x]) * samples.heightScale + samples.heightOffset;
+   rowHeights = &expanded[0];
+  }
+  
+  Vertex* rowVertices = vertices + (z - z0) * pitch;
+  size_t x = x0;
+  
+#if ORANGUTAN_SIMD >= 2
+  if (level >= SimdLevel_AVX2)
+   x = runGridAVX2(*this, row, rowHeights, rowVertices, x, x1, lower, upper);
+#endif
+#if ORANGUTAN_SIMD >= 1
+  if (level >= SimdLevel_SSE2)
+   x = runGridSSE2(*this, row, rowHeights, rowVertices, x, x1, lower, upper);
+#endif
+  
+  // What is left over, or everything without SIMD.
+  for (;x < x1;x++)
+  {
+   float fx = float(x), dx = fx - halfX, h = rowHeights[x];
+   float p[3];
+   for (size_t i=0;i < 3;i++)
+   {
+    p[i] = m[i][0] * dx + m[i][1] * h + row.origin[i];
+    lower[i] = std::min(lower[i], p[i]);
+    upper[i] = std::max(upper[i], p[i]);
+   }
+   Vertex& vertex = rowVertices[x];
+   vertex.position.x = p[0];
+   vertex.position.y = p[1];
+   vertex.position.z = p[2];
+   vertex.uv.x = row.uvPerX[0] * fx + row.uvOrigin[0];
+   vertex.uv.y = row.uvPerX[1] * fx + row.uvOrigin[1];
+  }
+  
+  // Colours are converted while the row is still in the cache; packed colours are already
+  // ABGR, so for ARGB only red and blue are swapped.
+  if (samples.colours)
+  {
+   const Ogre::ColourValue* rowColours = samples.colours + z * pitch;
+   for (x=x0;x < x1;x++)
+    rowVertices[x].colour = packColour(rowColours[x], colourType);
+  }
+  else if (samples.packedColours && colourType == Ogre::VET_COLOUR_ARGB)
+  {
+   const Ogre::RGBA* rowColours = samples.packedColours + z * pitch;
+   for (x=x0;x < x1;x++)
+   {
+    Ogre::RGBA c = rowColours[x];
+    rowVertices[x].colour = (c & 0xFF00FF00) | ((c & 0xFF) << 16) | ((c >> 16) & 0xFF);
+   }
+  }
+  else if (samples.packedColours)
+  {
+   const Ogre::RGBA* rowColours = samples.packedColours + z * pitch;
+   for (x=x0;x < x1;x++)
+    rowVertices[x].colour = rowColours[x];
+  }
+  else
+  {
+   for (x=x0;x < x1;x++)
+    rowVertices[x].colour = white;
+  }
+ }
+ 
+ aabb.merge(Ogre::Vector3(lower[0], lower[1], lower[2]));
+ aabb.merge(Ogre::Vector3(upper[0], upper[1], upper[2]));
+ 
+}
+
+Displacement::Displacement(const Ogre::Vector3& position, const Ogre::Vector3& scale, const Ogre::Quaternion& orientation, size_t materialIndex, Geometry* geometry)
+ : Brush(geometry, materialIndex),
+   mHeightScale(1),
+   mHeightOffset(0),
+   mHeightFormat(HeightFormat_Float),
+   mColourFormat(ColourFormat_Float),
+   mKeepVertices(true),
+   mVertexCount(0),
+   mLengthX(0),
+   mLengthY(0),
+   mPosition(position),
+   mScale(scale),
+   mOrientation(orientation),
+   mTextureZoom(2,2),
+   mTextureOffset(0,0),
+   mTextureAngle(Ogre::Degree(45)),
+   mTextureFlipX(false),
+   mTextureFlipY(false),
+   mChangedRowsZ0(0),
+   mDescribing(false),
+   mDirtyX0(0),
+   mDirtyZ0(0),
+   mDirtyX1(0),
+   mDirtyZ1(0),
+   mFullUpdate(true),
+   mPatchesX(0),
+   mPatchesZ(0),
+   mPatchSize(0),
+   mPatchIndexCount(0),
+   mLodDistance(0),
+   mTreeBuilt(false)
 {
- mColours[0] = Ogre::ColourValue::White;
- mColours[1] = Ogre::ColourValue::White;
- mColours[2] = Ogre::ColourValue::White;
- mColours[3] = Ogre::ColourValue::White;
+ mAABB.setNull();
+}
 
- _update();
+Displacement::~Displacement()
+{
+ _releasePatterns();
 }
 
-void Quad::_update()
+void Displacement::saveToOok(std::ofstream& stream)
+{
+ stream << "brush \"displacement\" \n";
+ writeOok(stream, mPosition, "\tposition ");
+ writeOok(stream, mOrientation, "\torientation ");
+ writeOok(stream, mScale, "\tscale ");
+ writeOok(stream, mTextureAngle, "\ttexture_angle ");
+ writeOok(stream, mTextureFlipX, "\ttexture_flip_x ");
+ writeOok(stream, mTextureFlipY, "\ttexture_flip_y ");
+ writeOok(stream, mTextureOffset, "\ttexture_offset ");
+ writeOok(stream, mTextureZoom, "\ttexture_offset ");
+ buffer<float> heights;
+ getHeights(heights);
+ writeOok(stream, heights, "\theights ");
+ buffer<Ogre::ColourValue> colours;
+ getColours(colours);
+ writeOok(stream, colours, "\tcolours ");
+ stream << ";\n\n";
+}
+
+void Displacement::_render(VertexWriter& vertices, Index16* indexes, size_t base)
+{
+ _renderTo(vertices, indexes, base);
+}
+
+void Displacement::_render(VertexWriter& vertices, Index32* indexes, size_t base)
+{
+ _renderTo(vertices, indexes, base);
+}
+
+template<typename IndexType> void Displacement::_renderTo(VertexWriter& vertices, IndexType* indexes, size_t base)
 {
-  
- mTransform.makeTransform(mPosition, mSize, mOrientation);
  
- mVertices[0].position = mTransform * QUAD_VERTICES[0]; // A
- mVertices[0].uv = Ogre::Vector2(0,0);
- mVertices[0].colour = mColours[0];
+ buffer<Vertex> scratch;
+ vertices.write(_getVertices(scratch), mVertexCount);
  
- mVertices[1].position = mTransform * QUAD_VERTICES[1]; // B
- mVertices[1].uv = Ogre::Vector2(1,0);
- mVertices[1].colour = mColours[1];
+ for (std::vector<Patch>::iterator it = mPatches.begin(); it != mPatches.end();it++)
+ {
+  const std::vector<Index32>& pattern = (*it).pattern->indexes;
+  size_t first = base + (*it).x + (*it).z * mLengthX;
+  for (size_t i=0;i < pattern.size();i++)
+   *indexes++ = first + pattern[i];
+ }
+ 
+}
 
- mVertices[2].position = mTransform * QUAD_VERTICES[2]; // C
- mVertices[2].uv = Ogre::Vector2(0,1);
- mVertices[2].colour = mColours[2];
+void Displacement::_renderVertices(VertexWriter& vertices, size_t first, size_t count)
+{
+ if (mVertices.size() == mVertexCount)
+  vertices.write(mVertices.first() + first, count);
+ else
+  vertices.write(mChangedRows.first() + (first - mChangedRowsZ0 * mLengthX), count);
+}
 
- mVertices[3].position = mTransform * QUAD_VERTICES[3]; // D
- mVertices[3].uv = Ogre::Vector2(1,1);
- mVertices[3].colour = mColours[3];
+void Displacement::_verticesUploaded()
+{
+ // They can be worked out again when needed; changes only work out the rows they touch.
+ if (mKeepVertices == false && mDrawnRevision == getRevision())
+ {
+  mVertices.destroy();
+  mChangedRows.destroy();
+ }
+}
+
+const Vertex* Displacement::_getVertices(buffer<Vertex>& scratch)
+{
  
- // Texture Rotation
- // ----------------
- if (mTextureAngle.valueAngleUnits() != 0.0f)
+ if (mVertices.size() == mVertexCount)
+  return mVertices.first();
+ 
+ // The AABB is left alone; it was already worked out when the vertices were last updated.
+ scratch.resize(mVertexCount);
+ for (size_t i=0;i < mVertexCount;i++)
+  scratch.push_back(Vertex());
+ Ogre::AxisAlignedBox aabb;
+ _updateVertices(scratch.first(), 0, 0, mLengthX, mLengthY, aabb);
+ return scratch.first();
+}
+
+void Displacement::_samplesChanged(size_t x0, size_t z0, size_t x1, size_t z1)
+{
+ 
+ if (mDirtyX0 < mDirtyX1)
  {
-  Ogre::Vector3 t(0,0,0);
-  Ogre::Quaternion q;
-  q.FromAngleAxis(mTextureAngle, Ogre::Vector3::UNIT_Y);
-  for (size_t i=0;i < 4;i++)
+  mDirtyX0 = std::min(mDirtyX0, x0);
+  mDirtyZ0 = std::min(mDirtyZ0, z0);
+  mDirtyX1 = std::max(mDirtyX1, x1);
+  mDirtyZ1 = std::max(mDirtyZ1, z1);
+ }
+ else
+ {
+  mDirtyX0 = x0;
+  mDirtyZ0 = z0;
+  mDirtyX1 = x1;
+  mDirtyZ1 = z1;
+ }
+ 
+ if (mTreeBuilt)
+  _updateTree(x0, z0, x1, z1);
+ 
+ _updateRequired();
+}
+
+template<typename T> static void copySamples(buffer<T>& samples, size_t lengthX, const T* from, size_t stride, size_t x0, size_t z0, size_t x1, size_t z1)
+{
+ 
+ // The whole rows are one block, so it can be copied in one go.
+ if (x0 == 0 && x1 == lengthX && stride == lengthX)
+ {
+  std::copy(from, from + (z1 - z0) * lengthX, samples.first() + z0 * lengthX);
+  return;
+ }
+ 
+ for (size_t z=z0;z < z1;z++, from += stride)
+  std::copy(from, from + (x1 - x0), samples.first() + x0 + z * lengthX);
+ 
+}
+
+void Displacement::setHeights(const float* heights, size_t stride, size_t x0, size_t z0, size_t x1, size_t z1)
+{
+ 
+ x1 = std::min(x1, size_t(mLengthX));
+ z1 = std::min(z1, size_t(mLengthY));
+ 
+ if (mDescribing || heights == 0 || x0 >= x1 || z0 >= z1 || _hasSamples() == false)
+  return;
+ 
+ mGeometry->waitForRedraw();
+ _storeHeights(heights, stride, x0, z0, x1, z1);
+ 
+ // Replacing everything can shrink the AABB as well.
+ if (x0 == 0 && z0 == 0 && x1 == mLengthX && z1 == mLengthY)
+  mFullUpdate = true;
+ 
+ _samplesChanged(x0, z0, x1, z1);
+}
+
+void Displacement::setHeight(size_t x, size_t z, float height, const Ogre::ColourValue& colour)
+{
+ 
+ if (mDescribing || x >= mLengthX || z >= mLengthY || _hasSamples() == false)
+  return;
+ 
+ mGeometry->waitForRedraw();
+ _storeHeights(&height, 1, x, z, x + 1, z + 1);
+ _storeColours(&colour, 1, x, z, x + 1, z + 1);
+ _samplesChanged(x, z, x + 1, z + 1);
+}
+
+void Displacement::setColours(const Ogre::ColourValue* colours, size_t stride, size_t x0, size_t z0, size_t x1, size_t z1)
+{
+ 
+ x1 = std::min(x1, size_t(mLengthX));
+ z1 = std::min(z1, size_t(mLengthY));
+ 
+ if (mDescribing || colours == 0 || x0 >= x1 || z0 >= z1 || _hasSamples() == false)
+  return;
+ 
+ mGeometry->waitForRedraw();
+ _storeColours(colours, stride, x0, z0, x1, z1);
+ 
+ // Only checked when replacing everything; it isn't worth going through every colour on each edit.
+ if (x0 == 0 && z0 == 0 && x1 == mLengthX && z1 == mLengthY)
+  _convertStorage();
+ 
+ _samplesChanged(x0, z0, x1, z1);
+}
+
+void Displacement::swapHeights(buffer<float>& heights)
+{
+ 
+ if (mDescribing || heights.size() != mLengthX * mLengthY || _hasSamples() == false)
+  return;
+ 
+ mGeometry->waitForRedraw();
+ 
+ if (mHeightFormat == HeightFormat_Float)
+ {
+  mHeights.swap(heights);
+ }
+ else
+ {
+  buffer<float> previous;
+  getHeights(previous);
+  _storeHeights(heights.first(), mLengthX, 0, 0, mLengthX, mLengthY);
+  heights.swap(previous);
+ }
+ 
+ mFullUpdate = true;
+ _samplesChanged(0, 0, mLengthX, mLengthY);
+}
+
+void Displacement::swapColours(buffer<Ogre::ColourValue>& colours)
+{
+ 
+ if (mDescribing || colours.size() != mLengthX * mLengthY || _hasSamples() == false)
+  return;
+ 
+ mGeometry->waitForRedraw();
+ 
+ if (mColourFormat == ColourFormat_Float && mColours.size())
+ {
+  mColours.swap(colours);
+ }
+ else
+ {
+  buffer<Ogre::ColourValue> previous;
+  getColours(previous);
+  if (mColourFormat == ColourFormat_Float)
+   mColours.swap(colours);
+  else
+   _storeColours(colours.first(), mLengthX, 0, 0, mLengthX, mLengthY);
+  colours.swap(previous);
+ }
+ 
+ _convertStorage();
+ _samplesChanged(0, 0, mLengthX, mLengthY);
+}
+
+void Displacement::getHeights(buffer<float>& copy_to) const
+{
+ 
+ if (mHeightFormat == HeightFormat_Float)
+ {
+  copy_to.assign(mHeights.first(), mHeights.size());
+  return;
+ }
+ 
+ copy_to.remove_all();
+ if (copy_to.capacity() < mShortHeights.size())
+  copy_to.resize(mShortHeights.size());
+ for (size_t i=0;i < mShortHeights.size();i++)
+  copy_to.push_back(_getHeight(i));
+}
+
+void Displacement::getColours(buffer<Ogre::ColourValue>& copy_to) const
+{
+ 
+ if (mColours.size())
+ {
+  copy_to.assign(mColours.first(), mColours.size());
+  return;
+ }
+ 
+ size_t count = mLengthX * mLengthY;
+ copy_to.remove_all();
+ if (copy_to.capacity() < count)
+  copy_to.resize(count);
+ for (size_t i=0;i < count;i++)
+  copy_to.push_back(_getColour(i));
+}
+
+Ogre::ColourValue Displacement::_getColour(size_t i) const
+{
+ 
+ if (mColours.size())
+  return mColours[i];
+ 
+ Ogre::ColourValue colour = Ogre::ColourValue::White;
+ if (mPackedColours.size())
+  colour.setAsABGR(mPackedColours[i]);
+ return colour;
+}
+
+void Displacement::_storeHeights(const float* heights, size_t stride, size_t x0, size_t z0, size_t x1, size_t z1)
+{
+ 
+ if (mHeightFormat == HeightFormat_Float)
+ {
+  copySamples(mHeights, mLengthX, heights, stride, x0, z0, x1, z1);
+  return;
+ }
+ 
+ float lowest = std::numeric_limits<float>::max(), highest = -std::numeric_limits<float>::max();
+ const float* row = heights;
+ for (size_t z=z0;z < z1;z++, row += stride)
+ {
+  for (size_t x=0;x < x1 - x0;x++)
   {
-   t.x = mVertices[i].uv.x;
-   t.z = mVertices[i].uv.y;
-   t = q * t;
-   mVertices[i].uv.x = t.x;
-   mVertices[i].uv.y = t.z;
+   lowest = std::min(lowest, row[x]);
+   highest = std::max(highest, row[x]);
   }
  }
  
- // Flip X
- for (size_t i=0;i < 4;i++)
+ if (x0 == 0 && z0 == 0 && x1 == mLengthX && z1 == mLengthY)
  {
-  mVertices[i].uv.x = (mVertices[i].uv.x *  mTextureZoom.x) + mTextureOffset.x;
-  mVertices[i].uv.y = (mVertices[i].uv.y *  mTextureZoom.y) + mTextureOffset.y;
+  // Everything is replaced, so the old range doesn't matter.
+  mShortHeights.destroy();
+  _quantise(lowest, highest);
+ }
+ else if (lowest < mHeightOffset || highest > mHeightOffset + mHeightScale * 65535.0f)
+ {
+  // The range is grown to twice what is needed, so a run of edits each going a little
+  // further doesn't requantise every height each time.
+  float top = mHeightOffset + mHeightScale * 65535.0f;
+  float newLowest = std::min(lowest, mHeightOffset), newHighest = std::max(highest, top);
+  float headroom = (newHighest - newLowest) * 0.5f;
+  if (lowest < mHeightOffset)
+   newLowest -= headroom;
+  if (highest > top)
+   newHighest += headroom;
+  _quantise(newLowest, newHighest);
  }
  
- if (!mTextureFlipX) // X has to be flipped for some reason.
-  for (size_t i=0;i < 4;i++)
-   mVertices[i].uv.x *= -1;
-   
- if (mTextureFlipY)
-  for (size_t i=0;i < 4;i++)
-   mVertices[i].uv.y *= -1;
+ float perStep = mHeightScale > 0 ? 1.0f / mHeightScale : 0;
+ row = heights;
+ for (size_t z=z0;z < z1;z++, row += stride)
+ {
+  Ogre::uint16* to = mShortHeights.first() + z * mLengthX;
+  for (size_t x=x0;x < x1;x++)
+  {
+   float step = (row[x - x0] - mHeightOffset) * perStep + 0.5f;
+   to[x] = Ogre::uint16(std::min(std::max(step, 0.0f), 65535.0f));
+  }
+ }
+ 
+}
+
+void Displacement::_storeColours(const Ogre::ColourValue* colours, size_t stride, size_t x0, size_t z0, size_t x1, size_t z1)
+{
+ 
+ if (hasColours() == false)
+ {
+  bool white = true;
+  const Ogre::ColourValue* row = colours;
+  for (size_t z=z0;z < z1 && white;z++, row += stride)
+   for (size_t x=0;x < x1 - x0;x++)
+    if (row[x] != Ogre::ColourValue::White)
+    {
+     white = false;
+     break;
+    }
   
+  if (white)
+   return;
   
-  // AABB
-  // ----
-  mAABB->merge(mVertices[0].position);
-  mAABB->merge(mVertices[1].position);
-  mAABB->merge(mVertices[2].position);
-  mAABB->merge(mVertices[3].position);
+  size_t count = mLengthX * mLengthY;
+  if (mColourFormat == ColourFormat_Float)
+  {
+   mColours.resize(count);
+   for (size_t i=0;i < count;i++)
+    mColours.push_back(Ogre::ColourValue::White);
+  }
+  else
+  {
+   Ogre::RGBA white = Ogre::ColourValue::White.getAsABGR();
+   mPackedColours.resize(count);
+   for (size_t i=0;i < count;i++)
+    mPackedColours.push_back(white);
+  }
+ }
+ 
+ if (mColourFormat == ColourFormat_Float)
+ {
+  copySamples(mColours, mLengthX, colours, stride, x0, z0, x1, z1);
+  return;
+ }
+ 
+ const Ogre::ColourValue* row = colours;
+ for (size_t z=z0;z < z1;z++, row += stride)
+ {
+  Ogre::RGBA* to = mPackedColours.first() + z * mLengthX;
+  for (size_t x=x0;x < x1;x++)
+   to[x] = row[x - x0].getAsABGR();
+ }
+ 
+}
+
+void Displacement::_quantise(float lowest, float highest)
+{
+ 
+ float scale = (highest - lowest) / 65535.0f;
+ float perStep = scale > 0 ? 1.0f / scale : 0;
+ 
+ if (mShortHeights.size() == 0)
+ {
+  size_t count = mLengthX * mLengthY;
+  mShortHeights.resize(count);
+  for (size_t i=0;i < count;i++)
+   mShortHeights.push_back(0);
+ }
+ else
+ {
+  for (size_t i=0;i < mShortHeights.size();i++)
+  {
+   float step = (_getHeight(i) - lowest) * perStep + 0.5f;
+   mShortHeights[i] = Ogre::uint16(std::min(std::max(step, 0.0f), 65535.0f));
+  }
+  
+  // Heights outside of the edit have moved too, so all of the vertices have to follow.
+  mFullUpdate = true;
+ }
+ 
+ mHeightOffset = lowest;
+ mHeightScale = scale;
+ 
+ // Every height may have moved a little.
+ mTreeBuilt = false;
+}
+
+void Displacement::_convertStorage()
+{
+ 
+ if (mHeightFormat == HeightFormat_Short && mHeights.size())
+ {
+  mShortHeights.destroy();
+  _storeHeights(mHeights.first(), mLengthX, 0, 0, mLengthX, mLengthY);
+  mHeights.destroy();
+ }
+ else if (mHeightFormat == HeightFormat_Float && mShortHeights.size())
+ {
+  mHeights.remove_all();
+  mHeights.resize(mShortHeights.size());
+  for (size_t i=0;i < mShortHeights.size();i++)
+   mHeights.push_back(float(mShortHeights[i]) * mHeightScale + mHeightOffset);
+  mShortHeights.destroy();
+ }
+ 
+ if (mColourFormat == ColourFormat_RGBA8 && mColours.size())
+ {
+  mPackedColours.remove_all();
+  mPackedColours.resize(mColours.size());
+  for (size_t i=0;i < mColours.size();i++)
+   mPackedColours.push_back(mColours[i].getAsABGR());
+  mColours.destroy();
+ }
+ else if (mColourFormat == ColourFormat_Float && mPackedColours.size())
+ {
+  mColours.remove_all();
+  mColours.resize(mPackedColours.size());
+  for (size_t i=0;i < mPackedColours.size();i++)
+   mColours.push_back(_getColour(i));
+  mPackedColours.destroy();
+ }
+ 
+ // White is the default, so if that is all there is nothing needs to be kept.
+ bool white = true;
+ Ogre::RGBA packedWhite = Ogre::ColourValue::White.getAsABGR();
+ for (size_t i=0;i < mColours.size() && white;i++)
+  white = mColours[i] == Ogre::ColourValue::White;
+ for (size_t i=0;i < mPackedColours.size() && white;i++)
+  white = mPackedColours[i] == packedWhite;
+ 
+ if (white)
+ {
+  mColours.destroy();
+  mPackedColours.destroy();
+ }
+ 
+}
 
+void Displacement::setStorage(HeightFormat heightFormat, ColourFormat colourFormat, bool keepVertices)
+{
+ 
+ mGeometry->waitForRedraw();
+ 
+ bool heightsChanged = heightFormat != mHeightFormat;
+ mHeightFormat = heightFormat;
+ mColourFormat = colourFormat;
+ mKeepVertices = keepVertices;
+ 
+ if (mDescribing)
+  return;
+ 
+ _convertStorage();
+ 
+ // Quantising moves the heights a little, so the vertices have to follow.
+ if (heightsChanged)
+ {
+  mFullUpdate = true;
+  _updateRequired();
+ }
+ else
+ {
+  _verticesUploaded();
+ }
+ 
+}
 
+size_t Displacement::getMemoryUsage() const
+{
+ return mHeights.capacity() * sizeof(float) +
+        mShortHeights.capacity() * sizeof(Ogre::uint16) +
+        mColours.capacity() * sizeof(Ogre::ColourValue) +
+        mPackedColours.capacity() * sizeof(Ogre::RGBA) +
+        mVertices.capacity() * sizeof(Vertex) +
+        mChangedRows.capacity() * sizeof(Vertex);
 }
 
-void Quad::_render(buffer<Vertex>& vertices, buffer<Index>& indexes)
+void Displacement::_buildTree()
 {
  
- size_t i = vertices.size();
- vertices.push_back(mVertices[0]);
- vertices.push_back(mVertices[1]);
- vertices.push_back(mVertices[2]);
- vertices.push_back(mVertices[3]);
+ mTreeLevels.clear();
+ mTree.remove_all();
+ mTreeBuilt = false;
  
- // TODO: GeometryOp_Draw/GeometryOp_DrawInverse switch/if in here?
- indexes.push_back(i+2); // C
- indexes.push_back(i);   // A
- indexes.push_back(i+1); // B
- indexes.push_back(i+2); // C
- indexes.push_back(i+1); // B
- indexes.push_back(i+3); // D
+ if (mLengthX < 2 || mLengthY < 2 || _hasSamples() == false)
+  return;
+ 
+ TreeLevel level;
+ level.first = 0;
+ level.nodesX = (mLengthX - 1 + TREE_LEAF - 1) / TREE_LEAF;
+ level.nodesZ = (mLengthY - 1 + TREE_LEAF - 1) / TREE_LEAF;
+ mTreeLevels.push_back(level);
+ 
+ while (level.nodesX > 1 || level.nodesZ > 1)
+ {
+  level.first += level.nodesX * level.nodesZ;
+  level.nodesX = (level.nodesX + 1) / 2;
+  level.nodesZ = (level.nodesZ + 1) / 2;
+  mTreeLevels.push_back(level);
+ }
+ 
+ size_t count = (level.first + 1) * 2;
+ mTree.resize(count);
+ for (size_t i=0;i < count;i++)
+  mTree.push_back(0);
  
+ mTreeBuilt = true;
+ _updateTree(0, 0, mLengthX, mLengthY);
 }
 
-
-
-
-
-Plane::Plane(const Ogre::Vector3& position, const Ogre::Vector2& size, const Ogre::Quaternion& orientation, size_t materialIndex, Geometry* geometry)
- : Brush(geometry, materialIndex)
+void Displacement::_updateTree(size_t x0, size_t z0, size_t x1, size_t z1)
 {
- mQuad = new Quad(position, size, orientation, &mAABB);
+ 
+ // Quads that have one of the samples as a corner, then the leaves they are in.
+ size_t quadsX = mLengthX - 1, quadsZ = mLengthY - 1;
+ size_t nodeX0 = (x0 ? x0 - 1 : 0) / TREE_LEAF, nodeX1 = (std::min(x1, quadsX) - 1) / TREE_LEAF;
+ size_t nodeZ0 = (z0 ? z0 - 1 : 0) / TREE_LEAF, nodeZ1 = (std::min(z1, quadsZ) - 1) / TREE_LEAF;
+ 
+ const TreeLevel& leaves = mTreeLevels[0];
+ for (size_t nz=nodeZ0;nz <= nodeZ1;nz++)
+ {
+  for (size_t nx=nodeX0;nx <= nodeX1;nx++)
+  {
+   float lowest = std::numeric_limits<float>::max(), highest = -std::numeric_limits<float>::max();
+   size_t lastX = std::min((nx + 1) * TREE_LEAF, quadsX), lastZ = std::min((nz + 1) * TREE_LEAF, quadsZ);
+   for (size_t z=nz * TREE_LEAF;z <= lastZ;z++)
+   {
+    for (size_t x=nx * TREE_LEAF;x <= lastX;x++)
+    {
+     float height = _getHeight(x + z * mLengthX);
+     lowest = std::min(lowest, height);
+     highest = std::max(highest, height);
+    }
+   }
+   float* node = mTree.first() + (leaves.first + nx + nz * leaves.nodesX) * 2;
+   node[0] = lowest;
+   node[1] = highest;
+  }
+ }
+ 
+ for (size_t i=1;i < mTreeLevels.size();i++)
+ {
+  
+  const TreeLevel& children = mTreeLevels[i - 1];
+  const TreeLevel& level = mTreeLevels[i];
+  nodeX0 /= 2;
+  nodeX1 /= 2;
+  nodeZ0 /= 2;
+  nodeZ1 /= 2;
+  
+  for (size_t nz=nodeZ0;nz <= nodeZ1;nz++)
+  {
+   for (size_t nx=nodeX0;nx <= nodeX1;nx++)
+   {
+    float lowest = std::numeric_limits<float>::max(), highest = -std::numeric_limits<float>::max();
+    for (size_t cz=nz * 2;cz < std::min(nz * 2 + 2, children.nodesZ);cz++)
+    {
+     for (size_t cx=nx * 2;cx < std::min(nx * 2 + 2, children.nodesX);cx++)
+     {
+      const float* child = mTree.first() + (children.first + cx + cz * children.nodesX) * 2;
+      lowest = std::min(lowest, child[0]);
+      highest = std::max(highest, child[1]);
+     }
+    }
+    float* node = mTree.first() + (level.first + nx + nz * level.nodesX) * 2;
+    node[0] = lowest;
+    node[1] = highest;
+   }
+  }
+ }
+ 
 }
 
-void Plane::_render(buffer<Vertex>& vertices, buffer<Index>& indexes)
+Ogre::Matrix4 Displacement::_getGridTransform() const
 {
- mQuad->_render(vertices, indexes);
+ Ogre::Matrix4 centre = Ogre::Matrix4::IDENTITY;
+ centre.setTrans(Ogre::Vector3(-Ogre::Real(mLengthX) * 0.5f, 0, -Ogre::Real(mLengthY) * 0.5f));
+ return mGeometry->_getParentNodeFullTransform() * mTransform * centre;
 }
 
-void Plane::saveToOok(std::ofstream& stream)
+Displacement::RayHit Displacement::raycast(const Ogre::Ray& ray)
 {
- stream << "brush \"plane\" \n";
- writeOok(stream, mQuad->mPosition, "\tposition ");
- writeOok(stream, mQuad->mOrientation, "\torientation ");
- writeOok(stream, mQuad->mSize, "\tsize ");
- writeOok(stream, mQuad->mColours, 4, "\tcolours ");
- writeOok(stream, mQuad->mTextureAngle, "\ttexture_angle ");
- writeOok(stream, mQuad->mTextureFlipX, "\ttexture_flip_x ");
- writeOok(stream, mQuad->mTextureFlipY, "\ttexture_flip_y ");
- writeOok(stream, mQuad->mTextureOffset, "\ttexture_offset ");
- writeOok(stream, mQuad->mTextureZoom, "\ttexture_offset ");
- stream << ";\n\n";
+ 
+ RayHit hit;
+ 
+ if (mDescribing)
+  return hit;
+ 
+ if (mTreeBuilt == false)
+  _buildTree();
+ 
+ if (mTreeBuilt == false)
+  return hit;
+ 
+ // Into grid space; the direction isn't normalised, so distances along both rays are the same.
+ Ogre::Matrix4 toGrid = _getGridTransform().inverseAffine();
+ Ogre::Vector3 origin = toGrid.transformAffine(ray.getOrigin());
+ Ogre::Vector3 direction = toGrid.transformAffine(ray.getOrigin() + ray.getDirection()) - origin;
+ 
+ _raycastNode(mTreeLevels.size() - 1, 0, 0, Ogre::Ray(origin, direction), hit);
+ 
+ if (hit.hit)
+  hit.position = ray.getPoint(hit.distance);
+ 
+ return hit;
 }
 
-
-Displacement::Displacement(const Ogre::Vector3& position, const Ogre::Vector3& scale, const Ogre::Quaternion& orientation, size_t materialIndex, Geometry* geometry)
- : Brush(geometry, materialIndex),
-   mTextureZoom(2,2),
-   mTextureOffset(0,0),
-   mTextureFlipX(false),
-   mTextureFlipY(false),
-   mTextureAngle(Ogre::Degree(45)),
-   mDescribing(false),
-   mPosition(position),
-   mScale(scale),
-   mOrientation(orientation)
+void Displacement::_raycastNode(size_t level, size_t nodeX, size_t nodeZ, const Ogre::Ray& ray, RayHit& hit)
 {
- mAABB.setNull();
+ 
+ const TreeLevel& nodes = mTreeLevels[level];
+ const float* node = mTree.first() + (nodes.first + nodeX + nodeZ * nodes.nodesX) * 2;
+ size_t quads = TREE_LEAF << level;
+ size_t x0 = nodeX * quads, x1 = std::min(x0 + quads, size_t(mLengthX - 1));
+ size_t z0 = nodeZ * quads, z1 = std::min(z0 + quads, size_t(mLengthY - 1));
+ 
+ Ogre::AxisAlignedBox bounds(Ogre::Vector3(Ogre::Real(x0), node[0], Ogre::Real(z0)), Ogre::Vector3(Ogre::Real(x1), node[1], Ogre::Real(z1)));
+ std::pair<bool, Ogre::Real> entry = Ogre::Math::intersects(ray, bounds);
+ if (entry.first == false || (hit.hit && entry.second > hit.distance))
+  return;
+ 
+ if (level == 0)
+ {
+  for (size_t z=z0;z < z1;z++)
+  {
+   for (size_t x=x0;x < x1;x++)
+   {
+    
+    Ogre::Vector3 a(Ogre::Real(x), _getHeight(x + z * mLengthX), Ogre::Real(z));
+    Ogre::Vector3 b(Ogre::Real(x + 1), _getHeight(x + 1 + z * mLengthX), Ogre::Real(z));
+    Ogre::Vector3 c(Ogre::Real(x), _getHeight(x + (z + 1) * mLengthX), Ogre::Real(z + 1));
+    Ogre::Vector3 d(Ogre::Real(x + 1), _getHeight(x + 1 + (z + 1) * mLengthX), Ogre::Real(z + 1));
+    
+    // The diagonals alternate, as in acquireIndexPattern.
+    std::pair<bool, Ogre::Real> first, second;
+    if (((x + z) & 1) == 0)
+    {
+     first = Ogre::Math::intersects(ray, c, b, a);
+     second = Ogre::Math::intersects(ray, c, d, b);
+    }
+    else
+    {
+     first = Ogre::Math::intersects(ray, c, d, a);
+     second = Ogre::Math::intersects(ray, a, d, b);
+    }
+    
+    for (size_t i=0;i < 2;i++)
+    {
+     const std::pair<bool, Ogre::Real>& triangle = i ? second : first;
+     if (triangle.first && triangle.second >= 0 && (hit.hit == false || triangle.second < hit.distance))
+     {
+      Ogre::Vector3 point = ray.getPoint(triangle.second);
+      hit.hit = true;
+      hit.distance = triangle.second;
+      hit.sampleX = std::min(size_t(std::max(point.x + 0.5f, 0.0f)), size_t(mLengthX - 1));
+      hit.sampleY = std::min(size_t(std::max(point.z + 0.5f, 0.0f)), size_t(mLengthY - 1));
+     }
+    }
+   }
+  }
+  return;
+ }
+ 
+ // Children nearest to the start of the ray first, so further ones can be skipped once hit.
+ const TreeLevel& children = mTreeLevels[level - 1];
+ size_t nearX = ray.getDirection().x < 0 ? 1 : 0, nearZ = ray.getDirection().z < 0 ? 1 : 0;
+ const size_t order[4][2] = { {nearX, nearZ}, {1 - nearX, nearZ}, {nearX, 1 - nearZ}, {1 - nearX, 1 - nearZ} };
+ for (size_t i=0;i < 4;i++)
+ {
+  size_t childX = nodeX * 2 + order[i][0], childZ = nodeZ * 2 + order[i][1];
+  if (childX < children.nodesX && childZ < children.nodesZ)
+   _raycastNode(level - 1, childX, childZ, ray, hit);
+ }
+ 
 }
 
-Displacement::~Displacement()
+bool Displacement::getHeightAt(const Ogre::Vector3& position, Ogre::Real& height)
 {
+ 
+ if (mDescribing || mLengthX < 2 || mLengthY < 2 || _hasSamples() == false)
+  return false;
+ 
+ Ogre::Matrix4 toWorld = _getGridTransform();
+ Ogre::Vector3 point = toWorld.inverseAffine().transformAffine(position);
+ Ogre::Real quadsX = Ogre::Real(mLengthX - 1), quadsZ = Ogre::Real(mLengthY - 1);
+ if (point.x < 0 || point.z < 0 || point.x > quadsX || point.z > quadsZ)
+  return false;
+ 
+ size_t x = std::min(size_t(point.x), size_t(mLengthX - 2));
+ size_t z = std::min(size_t(point.z), size_t(mLengthY - 2));
+ Ogre::Real fx = point.x - Ogre::Real(x), fz = point.z - Ogre::Real(z);
+ 
+ Ogre::Real top = _getHeight(x + z * mLengthX) * (1 - fx) + _getHeight(x + 1 + z * mLengthX) * fx;
+ Ogre::Real bottom = _getHeight(x + (z + 1) * mLengthX) * (1 - fx) + _getHeight(x + 1 + (z + 1) * mLengthX) * fx;
+ point.y = top * (1 - fz) + bottom * fz;
+ 
+ height = toWorld.transformAffine(point).y;
+ return true;
 }
 
-void Displacement::saveToOok(std::ofstream& stream)
+void Displacement::_updateVertices(Vertex* vertices, size_t x0, size_t z0, size_t x1, size_t z1, Ogre::AxisAlignedBox& aabb)
 {
- stream << "brush \"displacement\" \n";
- writeOok(stream, mPosition, "\tposition ");
- writeOok(stream, mOrientation, "\torientation ");
- writeOok(stream, mScale, "\tscale ");
- writeOok(stream, mTextureAngle, "\ttexture_angle ");
- writeOok(stream, mTextureFlipX, "\ttexture_flip_x ");
- writeOok(stream, mTextureFlipY, "\ttexture_flip_y ");
- writeOok(stream, mTextureOffset, "\ttexture_offset ");
- writeOok(stream, mTextureZoom, "\ttexture_offset ");
- writeOok(stream, mHeights, "\theights ");
- writeOok(stream, mColours, "\tcolours ");
- stream << ";\n\n";
+ 
+ Ogre::Vector2 uvPerSample((1.0f / Ogre::Real(mLengthX-1)) * mTextureZoom.x, (1.0f / Ogre::Real(mLengthY-1)) * mTextureZoom.y);
+ 
+ if (mTextureFlipX)
+  uvPerSample.x = -uvPerSample.x;
+ 
+ if (mTextureFlipY)
+  uvPerSample.y = -uvPerSample.y;
+ 
+ GridSamples samples;
+ if (mHeightFormat == HeightFormat_Float)
+ {
+  samples.heights = mHeights.first();
+ }
+ else
+ {
+  samples.shortHeights = mShortHeights.first();
+  samples.heightScale = mHeightScale;
+  samples.heightOffset = mHeightOffset;
+ }
+ if (mColours.size())
+  samples.colours = mColours.first();
+ else if (mPackedColours.size())
+  samples.packedColours = mPackedColours.first();
+ 
+ GridKernel kernel(mTransform, mLengthX, mLengthY, uvPerSample, mTextureAngle, getColourType());
+ kernel.run(samples, vertices, x0, z0, x1, z1, aabb);
+ 
 }
 
-void Displacement::_render(buffer<Vertex>& vertices, buffer<Index>& indexes)
+void Displacement::_updateChangedRows(size_t x0, size_t z0, size_t x1, size_t z1)
 {
  
- size_t i=0, b = vertices.size();
+ // Every vertex between the first and last changed one is uploaded, so whole rows are
+ // needed. Rows not uploaded yet are kept, as that range only grows until then.
+ size_t rowsZ0 = z0, rowsZ1 = z0;
+ if (mChangedRows.size())
+ {
+  rowsZ0 = mChangedRowsZ0;
+  rowsZ1 = mChangedRowsZ0 + mChangedRows.size() / mLengthX;
+ }
  
- for (i=0;i < mVertices.size();i++)
-  vertices.push_back(mVertices[i]);
+ size_t newZ0 = std::min(rowsZ0, z0), newZ1 = std::max(rowsZ1, z1);
+ if (newZ0 != rowsZ0 || newZ1 != rowsZ1)
+ {
+  buffer<Vertex> rows;
+  size_t count = (newZ1 - newZ0) * mLengthX;
+  rows.resize(count);
+  for (size_t i=0;i < count;i++)
+   rows.push_back(Vertex());
+  if (mChangedRows.size())
+   memcpy(rows.first() + (rowsZ0 - newZ0) * mLengthX, mChangedRows.first(), mChangedRows.size() * sizeof(Vertex));
+  
+  // The new rows' samples outside of x0, z0 to x1, z1 haven't changed, so are already in mAABB.
+  Ogre::AxisAlignedBox aabb;
+  if (newZ0 < rowsZ0)
+   _updateVertices(rows.first(), 0, newZ0, mLengthX, rowsZ0, aabb);
+  if (rowsZ1 < newZ1)
+   _updateVertices(rows.first() + (rowsZ1 - newZ0) * mLengthX, 0, rowsZ1, mLengthX, newZ1, aabb);
+  
+  mChangedRows.swap(rows);
+  mChangedRowsZ0 = newZ0;
+ }
  
- for (i=0;i < mIndexes.size();i++)
-  indexes.push_back(b + mIndexes[i]);
+ _updateVertices(mChangedRows.first() + (z0 - mChangedRowsZ0) * mLengthX, x0, z0, x1, z1, mAABB);
  
 }
 
 void Displacement::_updateRequired()
 {
 
- if (mDescribing)
+ if (mDescribing || mGeometry->_deferUpdate(this))
+  return;
+ 
+ size_t count = mLengthX * mLengthY;
+ bool kept = mVertices.size() == count;
+ 
+ // Only samples have changed, so only their vertices are; the indexes stay as they are.
+ // The AABB can only grow until the next full update.
+ if (mFullUpdate == false && mDirtyX0 < mDirtyX1 && mVertexCount == count && (kept || mKeepVertices == false))
+ {
+  if (kept)
+   _updateVertices(mVertices.first() + mDirtyZ0 * mLengthX, mDirtyX0, mDirtyZ0, mDirtyX1, mDirtyZ1, mAABB);
+  else
+   _updateChangedRows(mDirtyX0, mDirtyZ0, mDirtyX1, mDirtyZ1);
+  size_t first = mDirtyX0 + mDirtyZ0 * mLengthX;
+  size_t last = (mDirtyX1 - 1) + (mDirtyZ1 - 1) * mLengthX;
+  mDirtyX0 = mDirtyX1 = 0;
+  verticesChanged(first, last - first + 1);
   return;
+ }
  
+ mFullUpdate = false;
+ mDirtyX0 = mDirtyX1 = 0;
+ mChangedRows.destroy();
+ 
+ mTransform.makeTransform(mPosition, mScale, mOrientation);
  mAABB.setNull();
  
- Vertex vertex;
- mVertices.remove_all();
+ if (mVertices.size() != count)
+ {
+  mVertices.remove_all();
+  for (size_t i=0;i < count;i++)
+   mVertices.push_back(Vertex());
+ }
+ 
+ mVertexCount = count;
+ _updateVertices(mVertices.first(), 0, 0, mLengthX, mLengthY, mAABB);
  
- size_t i=0;
- Ogre::Real texIncrementX = (1.0f / Ogre::Real(mLengthX-1)) * mTextureZoom.x,
-            texIncrementY = (1.0f / Ogre::Real(mLengthY-1)) * mTextureZoom.y,
-            texX = 0,
-            texY = 0;
+ // The indexes only depend on the size of the grid and the detail of each patch.
+ _layoutPatches();
+ 
+ mVertices.trim();
+ 
+ redrawNeeded();
+}
 
- if (mTextureFlipX)
-  texIncrementX = -texIncrementX;
+void Displacement::setLod(size_t patchSize, Ogre::Real lodDistance)
+{
+ mGeometry->waitForRedraw();
+ mPatchSize = patchSize;
+ mLodDistance = lodDistance;
+ mFullUpdate = true;
+ _updateRequired();
+}
+
+void Displacement::_layoutPatches()
+{
  
- if (mTextureFlipY)
-  texIncrementY = -texIncrementY;
+ mPatchIndexCount = 0;
+ if (mLengthX < 2 || mLengthY < 2)
+ {
+  _releasePatterns();
+  mPatches.clear();
+  mPatchesX = mPatchesZ = 0;
+  return;
+ }
  
- for (size_t z=0;z < mLengthY;z++)
+ // The last patch of a row or column takes what is left, so none are thinner than mPatchSize.
+ size_t quadsX = mLengthX - 1, quadsZ = mLengthY - 1;
+ size_t patchesX = 1, patchesZ = 1;
+ if (mPatchSize)
  {
-  for (size_t x=0;x < mLengthX;x++)
-  {
-   vertex.position.x = x;
-   vertex.position.y = mHeights[i];
-   vertex.position.z = z;
-   vertex.colour = mColours[i++];
-   vertex.uv.x = texX;
-   vertex.uv.y = texY;
-   mVertices.push_back(vertex);
-
-   texX += texIncrementX;
-  }
-  texX = 0;
-  texY += texIncrementY;
+  patchesX = std::max(quadsX / mPatchSize, size_t(1));
+  patchesZ = std::max(quadsZ / mPatchSize, size_t(1));
  }
  
- if (mTextureAngle.valueAngleUnits() != 0.0f)
+ if (patchesX != mPatchesX || patchesZ != mPatchesZ || mPatches.size() != patchesX * patchesZ)
  {
-  Ogre::Vector3 t(0,0,0);
-  Ogre::Quaternion q;
-  q.FromAngleAxis(mTextureAngle, Ogre::Vector3::UNIT_Y);
-  for (size_t i=0;i < mVertices.size();i++)
+  _releasePatterns();
+  mPatchesX = patchesX;
+  mPatchesZ = patchesZ;
+  mPatches.resize(patchesX * patchesZ);
+  for (size_t i=0;i < mPatches.size();i++)
   {
-   t.x = mVertices[i].uv.x;
-   t.z = mVertices[i].uv.y;
-   t = q * t;
-   mVertices[i].uv.x = t.x;
-   mVertices[i].uv.y = t.z;
+   mPatches[i].lod = 0;
+   mPatches[i].pattern = 0;
   }
  }
  
- // Transform:-
- mTransform.makeTransform(mPosition, mScale, mOrientation);
- Ogre::Vector2 halfSize(mLengthX, mLengthY);
- halfSize *= 0.5f;
- for (size_t i=0;i < mVertices.size();i++)
+ for (size_t pz=0;pz < mPatchesZ;pz++)
  {
-  mVertices[i].position.x -= halfSize.x;
-  mVertices[i].position.z -= halfSize.y;
-  mVertices[i].position = mTransform * mVertices[i].position;
-  mAABB.merge(mVertices[i].position);
+  for (size_t px=0;px < mPatchesX;px++)
+  {
+   Patch& patch = mPatches[px + pz * mPatchesX];
+   patch.x = px * mPatchSize;
+   patch.z = pz * mPatchSize;
+   patch.lengthX = (px == mPatchesX - 1) ? quadsX - patch.x : mPatchSize;
+   patch.lengthZ = (pz == mPatchesZ - 1) ? quadsZ - patch.z : mPatchSize;
+   
+   // Each level of detail needs at least two rows of quads left to stitch against.
+   size_t shortest = std::min(patch.lengthX, patch.lengthZ);
+   patch.maxLod = 0;
+   while (mPatchSize && (size_t(2) << patch.maxLod) * 2 <= shortest)
+    patch.maxLod++;
+   patch.lod = std::min(patch.lod, patch.maxLod);
+   
+   Ogre::AxisAlignedBox aabb;
+   aabb.merge(mVertices[patch.x + patch.z * mLengthX].position);
+   aabb.merge(mVertices[patch.x + patch.lengthX + (patch.z + patch.lengthZ) * mLengthX].position);
+   patch.centre = aabb.getCenter();
+  }
  }
  
- mIndexes.remove_all();
- 
- size_t y = 0;
- bool flip = false;
- bool flipRow = (mLengthX % 2) != 0;
+ _assignPatterns();
+}
 
- for (size_t j=0;j < mLengthY-1;j++)
+void Displacement::_assignPatterns()
+{
+ 
+ mPatchIndexCount = 0;
+ 
+ IndexPatternKey key;
+ memset(&key, 0, sizeof(IndexPatternKey));
+ key.pitch = mLengthX;
+ 
+ for (size_t pz=0;pz < mPatchesZ;pz++)
  {
-  y = j * mLengthX;
-  for (size_t i=0;i < mLengthX-1;i++)
+  for (size_t px=0;px < mPatchesX;px++)
   {
-    
-   if (!flip)
-   {
-    mIndexes.push_back(i + y + mLengthX);
-    mIndexes.push_back(i + 1 + y);
-    mIndexes.push_back(i + y);
-   
-    mIndexes.push_back(i + y + mLengthX);
-    mIndexes.push_back(i + 1 + y + mLengthX);
-    mIndexes.push_back(i + 1 + y);
-   }
-   else
-   {
-    mIndexes.push_back(i + y + mLengthX);
-    mIndexes.push_back(i + 1 + y + mLengthX);
-    mIndexes.push_back(i + y);
+   Patch& patch = mPatches[px + pz * mPatchesX];
+   key.lengthX = patch.lengthX;
+   key.lengthZ = patch.lengthZ;
+   key.lod = patch.lod;
    
-    mIndexes.push_back(i + y);
-    mIndexes.push_back(i + 1 + y + mLengthX);
-    mIndexes.push_back(i + 1 + y);
-    
-   }
+   // A shared edge is drawn with the lesser detail of the two patches.
+   key.edges[0] = px > 0             ? std::max(patch.lod, mPatches[px - 1 + pz * mPatchesX].lod) : patch.lod;
+   key.edges[1] = px < mPatchesX - 1 ? std::max(patch.lod, mPatches[px + 1 + pz * mPatchesX].lod) : patch.lod;
+   key.edges[2] = pz > 0             ? std::max(patch.lod, mPatches[px + (pz - 1) * mPatchesX].lod) : patch.lod;
+   key.edges[3] = pz < mPatchesZ - 1 ? std::max(patch.lod, mPatches[px + (pz + 1) * mPatchesX].lod) : patch.lod;
    
-   flip = !flip;
+   // The new pattern is acquired first, so one that hasn't changed isn't freed and made again.
+   IndexPattern* pattern = acquireIndexPattern(key);
+   if (patch.pattern)
+    releaseIndexPattern(patch.pattern);
+   patch.pattern = pattern;
+   mPatchIndexCount += pattern->indexes.size();
+  }
+ }
+}
+
+void Displacement::_releasePatterns()
+{
+ for (std::vector<Patch>::iterator it = mPatches.begin(); it != mPatches.end();it++)
+ {
+  if ((*it).pattern)
+   releaseIndexPattern((*it).pattern);
+  (*it).pattern = 0;
+ }
+}
+
+void Displacement::_updateLod(const Ogre::Vector3& camera)
+{
+ 
+ if (mPatchSize == 0)
+  return;
+ 
+ bool changed = false;
+ for (std::vector<Patch>::iterator it = mPatches.begin(); it != mPatches.end();it++)
+ {
+  size_t lod = 0;
+  Ogre::Real distance = camera.distance((*it).centre), lodDistance = mLodDistance;
+  while (lod < (*it).maxLod && distance > lodDistance)
+  {
+   lod++;
+   lodDistance *= 2;
+  }
+  if (lod != (*it).lod)
+  {
+   (*it).lod = lod;
+   changed = true;
   }
-  if (flipRow)
-   flip = !flip;
  }
  
+ if (changed == false)
+  return;
+ 
+ _assignPatterns();
+ redrawNeeded();
+}
+
+void Displacement::_trimMemory()
+{
+ mHeights.shrink_to_fit();
+ mShortHeights.shrink_to_fit();
+ mColours.shrink_to_fit();
+ mPackedColours.shrink_to_fit();
+ mVertices.shrink_to_fit();
 }
 
 Block::Block(const Ogre::Vector3& position, const Ogre::Vector3& size, const Ogre::Quaternion& orientation, size_t index, Geometry* geometry)
@@ -882,6 +4382,7 @@ Block::Block(const Ogre::Vector3& position, const Ogre::Vector3& size, const Ogr
  for (size_t i=0; i < 6;i++)
  {
   mHasQuads[i] = true;
+  mQuadHidden[i] = false;
   mQuadMaterial[i] = index;
   mQuadTextureScale[i] = Ogre::Vector2(1,1);
   mQuadTextureOffset[i] = Ogre::Vector2(0,0);
@@ -889,7 +4390,11 @@ Block::Block(const Ogre::Vector3& position, const Ogre::Vector3& size, const Ogr
   mQuadTextureFlipY[i] = false;
   mQuadTextureColour[i] = Ogre::ColourValue(1.0f, 1.0f, 1.0f, 1.0f);
  }
-
+ 
+ mAdded = false;
+ mInstances = 0;
+ mInstanceSlot = 0;
+ 
  _updateRequired();
 }
 
@@ -898,62 +4403,120 @@ Block::~Block()
 
 }
 
-void Block::_render(buffer<Vertex>& vertices, buffer<Index>& indexes, size_t index)
+size_t Block::_getDrawnFaces() const
 {
- size_t j = 0;
- for (size_t i=0; i < 6;i++)
+ size_t faces = 0;
+ for (size_t i=0;i < 6;i++)
+  if (_isQuadDrawn(i))
+   faces |= (1 << i);
+ return faces;
+}
+
+bool Block::_isInstanceable() const
+{
+ 
+ size_t index = 0;
+ bool first = true;
+ 
+ for (size_t i=0;i < 6;i++)
  {
-   std::cout << "Block::_render @ " << i << "\n";
-  if (mHasQuads[i] == false)
-   continue;
   
-  if (mQuadMaterial[i] != index)
+  if (_isQuadDrawn(i) == false)
    continue;
   
-  j = vertices.size();
-  vertices.push_back( mQuadVertexData[i].mVertices[0] );
-  vertices.push_back( mQuadVertexData[i].mVertices[1] );
-  vertices.push_back( mQuadVertexData[i].mVertices[2] );
-  vertices.push_back( mQuadVertexData[i].mVertices[3] );
-
-  indexes.push_back( j + mQuadVertexData[i].mIndexes[0] );
-  indexes.push_back( j + mQuadVertexData[i].mIndexes[1] );
-  indexes.push_back( j + mQuadVertexData[i].mIndexes[2] );  // Remove mIndexes, and just hardcode it.
-  indexes.push_back( j + mQuadVertexData[i].mIndexes[3] );
-  indexes.push_back( j + mQuadVertexData[i].mIndexes[4] );
-  indexes.push_back( j + mQuadVertexData[i].mIndexes[5] );
-  
-  std::cout << "Block::_render == " << i << "\n";
+  if (first)
+   index = mQuadMaterial[i];
+  else if (mQuadMaterial[i] != index)
+   return false;
+  first = false;
   
+  if (mQuadTextureScale[i] != Ogre::Vector2(1,1) || mQuadTextureOffset[i] != Ogre::Vector2(0,0) || mQuadTextureFlipX[i] || mQuadTextureFlipY[i] || mQuadTextureColour[i] != Ogre::ColourValue::White)
+   return false;
  }
-#if 0
- size_t base = vertices.size();
  
- for(size_t i=0;i < mVertices.size();i++)
+ // With every face hidden there is nothing to draw.
+ return first == false;
+}
+
+void Block::_getUnitQuad(size_t part, Vertex* vertices)
+{
+ 
+ // Corners of each face in BLOCK_VERTICES, as Block::_updateRequired.
+ static const size_t corners[6][4] =
  {
-  std::cout << mVertices[i].position << "\n";
-  vertices.push_back(mVertices[i]);
- }
+  {0, 1, 2, 3},  // Top
+  {5, 4, 7, 6},  // Bottom
+  {1, 0, 5, 4},  // Front
+  {2, 3, 6, 7},  // Back
+  {0, 2, 4, 6},  // Left
+  {3, 1, 7, 5}   // Right
+ };
+ 
+ static const Ogre::Real uvs[4][2] = { {0,0}, {-1,0}, {0,1}, {-1,1} };
  
- for(size_t i=0;i < mIndexes.size();i++)
+ Ogre::RGBA colour = packColour(Ogre::ColourValue::White, getColourType());
+ for (size_t i=0;i < 4;i++)
  {
-  indexes.push_back(base + mIndexes[i]);
+  vertices[i].position = BLOCK_VERTICES[corners[part][i]];
+  vertices[i].colour = colour;
+  vertices[i].uv = Ogre::Vector2(uvs[i][0], uvs[i][1]);
  }
-#endif
+ 
+}
+
+size_t Block::_getVertexCount(size_t part) const
+{
+ return _isQuadDrawn(part) ? 4 : 0;
+}
+
+size_t Block::_getIndexCount(size_t part) const
+{
+ return _isQuadDrawn(part) ? 6 : 0;
+}
+
+void Block::_render(VertexWriter& vertices, Index16* indexes, size_t base, size_t part)
+{
+ _renderTo(vertices, indexes, base, part);
+}
+
+void Block::_render(VertexWriter& vertices, Index32* indexes, size_t base, size_t part)
+{
+ _renderTo(vertices, indexes, base, part);
+}
+
+template<typename IndexType> void Block::_renderTo(VertexWriter& vertices, IndexType* indexes, size_t base, size_t part)
+{
+ ORANGUTAN_TRACE("Block::_render @ " << part)
+ 
+ if (_isQuadDrawn(part) == false)
+  return;
+ 
+ vertices.write(mQuadVertexData[part].mVertices, 4);
+ 
+ indexes[0] = base + mQuadVertexData[part].mIndexes[0];
+ indexes[1] = base + mQuadVertexData[part].mIndexes[1];
+ indexes[2] = base + mQuadVertexData[part].mIndexes[2];  // Remove mIndexes, and just hardcode it.
+ indexes[3] = base + mQuadVertexData[part].mIndexes[3];
+ indexes[4] = base + mQuadVertexData[part].mIndexes[4];
+ indexes[5] = base + mQuadVertexData[part].mIndexes[5];
 }
 
 void Block::_updateRequired()
 {
  
+ if (mGeometry->_deferUpdate(this))
+  return;
+ 
  // Transform
  mTransform.makeTransform(mPosition, mSize, mOrientation);
  mAABB.setNull();
+ Ogre::VertexElementType colourType = getColourType();
 
 #define BLOCK_VERTEX(REF_ID, ID, QUAD, U, V)                                \
  mQuadVertexData[QUAD].mVertices[REF_ID].position = BLOCK_VERTICES[ID];     \
  mQuadVertexData[QUAD].mVertices[REF_ID].uv.x = U;                          \
  mQuadVertexData[QUAD].mVertices[REF_ID].uv.y = V;                          \
- mQuadVertexData[QUAD].mVertices[REF_ID].colour = mQuadTextureColour[QUAD];  
+ mQuadVertexData[QUAD].mVertices[REF_ID].colour = packColour(mQuadTextureColour[QUAD], colourType);
 
 #define BLOCK_UV(QUAD)                                                \
   for (size_t j=0; j < 4;j++)                                         \
@@ -1049,12 +4612,18 @@ void Block::_updateRequired()
   BLOCK_TRANGLES(Quad_Back)
  }
  
- std::cout << mAABB << "\n";
+ ORANGUTAN_TRACE("Block::_updateRequired " << mAABB)
 #undef BLOCK_VERTEX
 #undef BLOCK_UV
 #undef BLOCK_TRANGLES
  
- 
+ // New Blocks are done by Geometry::createBlock, once they are in a cell.
+ if (mCell)
+ {
+  mGeometry->_blockMoved(this);
+  mGeometry->_blockChanged(this);
+ }
+
 }
 
 
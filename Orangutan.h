@@ -28,6 +28,68 @@
 #define ORANGUTAN_H
 
 #include "OGRE/Ogre.h"
+#include "OGRE/OgreBitwise.h"
+
+/*! define. ORANGUTAN_HALF_UV
+    desc.
+        If the render system can be given half-float texture coordinates (VET_HALF2),
+        which Ogre has since 1.12. Otherwise VertexFormat_ColourHalfUV uses full floats.
+*/
+#ifndef ORANGUTAN_HALF_UV
+# if OGRE_VERSION >= ((1 << 16) | (12 << 8))
+#  define ORANGUTAN_HALF_UV 1
+# else
+#  define ORANGUTAN_HALF_UV 0
+# endif
+#endif
+
+/*! define. ORANGUTAN_HARDWARE_INSTANCING
+    desc.
+        If Blocks can be drawn with hardware instancing (instance data in a vertex buffer),
+        which Ogre has since 1.8. Otherwise BlockInstancing_Hardware falls back to software.
+*/
+#ifndef ORANGUTAN_HARDWARE_INSTANCING
+# if OGRE_VERSION >= ((1 << 16) | (8 << 8))
+#  define ORANGUTAN_HARDWARE_INSTANCING 1
+# else
+#  define ORANGUTAN_HARDWARE_INSTANCING 0
+# endif
+#endif
+
+/*! define. ORANGUTAN_SIMD
+    desc.
+        Widest SIMD instructions the Displacement vertex kernel is compiled with; 0 for none,
+        1 for SSE2 or 2 for AVX2. Worked out from what the compiler targets (i.e. /arch:AVX2
+        or -mavx2) unless defined, and always 0 with double precision Ogre.
+*/
+#ifndef ORANGUTAN_SIMD
+# if OGRE_DOUBLE_PRECISION
+#  define ORANGUTAN_SIMD 0
+# elif defined(__AVX2__)
+#  define ORANGUTAN_SIMD 2
+# elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define ORANGUTAN_SIMD 1
+# else
+#  define ORANGUTAN_SIMD 0
+# endif
+#endif
+
+/*! define. ORANGUTAN_STATISTICS
+    desc.
+        Count the work done when redrawing, see Geometry::getStats. Set to 0 to compile
+        the counting and timing out.
+*/
+#ifndef ORANGUTAN_STATISTICS
+# define ORANGUTAN_STATISTICS 1
+#endif
+
+/*! define. ORANGUTAN_TRACING
+    desc.
+        Write what Orangutan is doing to std::cout. Only useful when debugging Orangutan.
+*/
+#ifndef ORANGUTAN_TRACING
+# define ORANGUTAN_TRACING 0
+#endif
 
 namespace Orangutan
 {
@@ -35,11 +97,15 @@ namespace Orangutan
  class Librarian;
  //typedef Librarian DrHoraceWorblehat;
  class Geometry;
+ class GeometryCell;
+ class BlockInstances;
  class Brush;
+ class MultiBrush;
  class Quad;
  class Plane;
  class Displacement;
  class Block;
+ struct IndexPattern;
  
  enum GeometryOperation
  {
@@ -119,6 +185,30 @@ namespace Orangutan
     mBuffer = new_buffer;
    }
 
+   /*! function. shrink_to_fit
+       desc.
+           Reduce the capacity to the size, or free everything when empty.
+   */
+   inline void shrink_to_fit()
+   {
+    if (mUsed == 0)
+     destroy();
+    else if (mUsed < mCapacity)
+     resize(mUsed);
+   }
+   
+   /*! function. trim
+       desc.
+           shrink_to_fit, but only when less than a quarter of the capacity is used. As
+           push_back doubles the capacity, a buffer that is refilled to about the same
+           size isn't reallocated each time.
+   */
+   inline void trim()
+   {
+    if (mUsed < mCapacity / 4)
+     shrink_to_fit();
+   }
+
    inline void destroy()
    {
     if (mBuffer && mCapacity)
@@ -128,6 +218,33 @@ namespace Orangutan
     mCapacity = 0;
    }
 
+   /*! function. assign
+       desc.
+           Replace the contents with count items copied from items, reallocating only when
+           the capacity is too small.
+   */
+   inline void assign(const T* items, size_t count)
+   {
+    if (count > mCapacity)
+    {
+     mUsed = 0;
+     resize(count);
+    }
+    std::copy(items, items + count, mBuffer);
+    mUsed = count;
+   }
+   
+   /*! function. swap
+       desc.
+           Exchange the contents with another buffer, without copying any items.
+   */
+   inline void swap(buffer<T>& other)
+   {
+    std::swap(mBuffer, other.mBuffer);
+    std::swap(mUsed, other.mUsed);
+    std::swap(mCapacity, other.mCapacity);
+   }
+
    inline void push_back(const T& value)
    {
     if (mUsed == mCapacity)
@@ -153,30 +270,490 @@ namespace Orangutan
     return mBuffer;
    }
    
+   inline const T* first() const
+   {
+    return mBuffer;
+   }
+   
    inline T* last()
    {
     return mBuffer + mUsed;
    }
    
+   inline const T* last() const
+   {
+    return mBuffer + mUsed;
+   }
+   
   protected:
    
    T*     mBuffer;
    size_t mUsed, mCapacity;
  };
  
+ /*! struct. view<T>
+     desc.
+         Read-only window onto the items of a buffer, without copying them. It is only
+         valid until the buffer is next changed.
+ */
+ template<typename T> struct view
+ {
+  
+  view() : mFirst(0), mSize(0) {}
+  
+  view(const T* first, size_t size) : mFirst(first), mSize(size) {}
+  
+  inline size_t size() const
+  {
+   return mSize;
+  }
+  
+  inline const T& operator[](size_t index) const
+  {
+   return *(mFirst + index);
+  }
+  
+  inline const T* first() const
+  {
+   return mFirst;
+  }
+  
+  inline const T* last() const
+  {
+   return mFirst + mSize;
+  }
+  
+  const T* mFirst;
+  size_t   mSize;
+ };
+ 
+ /*! struct. Handle
+     desc.
+         Reference to a Plane, Displacement or Block of a Geometry. Unlike a pointer it
+         is safe to keep after the object has been destroyed; the Geometry then returns 0
+         for it.
+ */
+ struct Handle
+ {
+  
+  Handle() : mSlot(0xFFFFFFFF), mGeneration(0) {}
+  
+  bool operator==(const Handle& other) const
+  {
+   return mSlot == other.mSlot && mGeneration == other.mGeneration;
+  }
+  
+  Ogre::uint32 mSlot, mGeneration;
+ };
+ 
+ /*! class. slots<T>
+     desc.
+         Internal container that is similar to std::vector, but hands out a Handle for
+         each item. Erasing an item is O(1) (the last item is moved into its place), and
+         a Handle to an erased item is recognised by its generation.
+ */
+ template<typename T> class slots
+ {
+   
+  public:
+   
+   typedef typename std::vector<T*>::iterator iterator;
+   
+   inline Handle insert(T* item)
+   {
+    Handle handle;
+    if (mFree.empty())
+    {
+     handle.mSlot = Ogre::uint32(mSlots.size());
+     mSlots.push_back(Slot());
+     mSlots.back().mGeneration = 0;
+    }
+    else
+    {
+     handle.mSlot = mFree.back();
+     mFree.pop_back();
+    }
+    mSlots[handle.mSlot].mItem = mItems.size();
+    handle.mGeneration = mSlots[handle.mSlot].mGeneration;
+    mItems.push_back(item);
+    mItemSlots.push_back(handle.mSlot);
+    return handle;
+   }
+   
+   inline T* get(const Handle& handle) const
+   {
+    if (handle.mSlot >= mSlots.size() || mSlots[handle.mSlot].mGeneration != handle.mGeneration)
+     return 0;
+    return mItems[mSlots[handle.mSlot].mItem];
+   }
+   
+   inline bool erase(const Handle& handle)
+   {
+    if (get(handle) == 0)
+     return false;
+    
+    Slot& slot = mSlots[handle.mSlot];
+    mItems[slot.mItem] = mItems.back();
+    mItemSlots[slot.mItem] = mItemSlots.back();
+    mSlots[mItemSlots[slot.mItem]].mItem = slot.mItem;
+    mItems.pop_back();
+    mItemSlots.pop_back();
+    
+    slot.mGeneration++;
+    mFree.push_back(handle.mSlot);
+    return true;
+   }
+   
+   inline void clear()
+   {
+    for (size_t i=0;i < mItemSlots.size();i++)
+    {
+     mSlots[mItemSlots[i]].mGeneration++;
+     mFree.push_back(mItemSlots[i]);
+    }
+    mItems.clear();
+    mItemSlots.clear();
+   }
+   
+   inline size_t size() const
+   {
+    return mItems.size();
+   }
+   
+   inline iterator begin()
+   {
+    return mItems.begin();
+   }
+   
+   inline iterator end()
+   {
+    return mItems.end();
+   }
+   
+  protected:
+   
+   struct Slot
+   {
+    size_t        mItem;
+    Ogre::uint32  mGeneration;
+   };
+   
+   std::vector<T*>            mItems;
+   std::vector<Ogre::uint32>  mItemSlots;
+   std::vector<Slot>          mSlots;
+   std::vector<Ogre::uint32>  mFree;
+ };
+ 
+ /*! enum. VertexFormat
+     desc.
+         Layout of the vertices in a Geometry's vertex buffers.
+ */
+ enum VertexFormat
+ {
+  VertexFormat_Colour,       // Position, packed colour and uv. 24 bytes.
+  VertexFormat_ColourHalfUV  // Position, packed colour and half-float uv. 20 bytes.
+ };
+ 
  /*! struct. Vertex
      desc.
-         Structure for a single vertex.
+         Structure for a single vertex. The colour is packed as the render system's
+         VET_COLOUR, see packColour.
  */
  struct Vertex
  {
   Ogre::Vector3     position;
-  Ogre::ColourValue colour;
+  Ogre::RGBA        colour;
   Ogre::Vector2     uv;
  };
  
- typedef Ogre::ushort Index;
+ /*! struct. VertexHalfUV
+     desc.
+         Structure for a single vertex in VertexFormat_ColourHalfUV.
+ */
+ struct VertexHalfUV
+ {
+  Ogre::Vector3     position;
+  Ogre::RGBA        colour;
+  Ogre::uint16      uv[2];
+ };
+ 
+ /*! function. getVertexSize
+     desc.
+         Size of a single vertex in a VertexFormat.
+ */
+ inline size_t getVertexSize(VertexFormat format)
+ {
+  return format == VertexFormat_ColourHalfUV ? sizeof(VertexHalfUV) : sizeof(Vertex);
+ }
+ 
+ /*! function. getColourType
+     desc.
+         The packed colour type the render system uses.
+ */
+ inline Ogre::VertexElementType getColourType()
+ {
+  return Ogre::VertexElement::getBestColourVertexElementType();
+ }
+ 
+ /*! function. packColour
+     desc.
+         Pack a colour into a Vertex colour, colourType is from getColourType.
+ */
+ inline Ogre::RGBA packColour(const Ogre::ColourValue& colour, Ogre::VertexElementType colourType)
+ {
+  return Ogre::VertexElement::convertColourValue(colour, colourType);
+ }
+ 
+ /*! struct. VertexWriter
+     desc.
+         Writes Vertices into locked vertex buffer memory in a VertexFormat.
+ */
+ struct VertexWriter
+ {
+  
+  VertexWriter(void* data, VertexFormat format) : mData((Ogre::uint8*) data), mFormat(format)
+  { // no code.
+  }
+  
+  inline void write(const Vertex* vertices, size_t count)
+  {
+   if (mFormat == VertexFormat_Colour)
+   {
+    memcpy(mData, vertices, count * sizeof(Vertex));
+    mData += count * sizeof(Vertex);
+    return;
+   }
+   
+   VertexHalfUV* out = (VertexHalfUV*) mData;
+   for (size_t i=0;i < count;i++)
+   {
+    out[i].position = vertices[i].position;
+    out[i].colour = vertices[i].colour;
+    out[i].uv[0] = Ogre::Bitwise::floatToHalf(vertices[i].uv.x);
+    out[i].uv[1] = Ogre::Bitwise::floatToHalf(vertices[i].uv.y);
+   }
+   mData += count * sizeof(VertexHalfUV);
+  }
+  
+  Ogre::uint8*  mData;
+  VertexFormat  mFormat;
+ };
+ 
+ /*! typedef. Index
+     desc.
+         An index into the vertices of a Brush. GeometryRenderables write their hardware
+         index buffers as Index16, or as Index32 when they have more than 65535 vertices.
+ */
+ typedef Ogre::uint32 Index;
+ typedef Ogre::uint16 Index16;
+ typedef Ogre::uint32 Index32;
+ 
+ /*! enum. SimdLevel
+     desc.
+         Instructions GridKernel uses, up to ORANGUTAN_SIMD.
+ */
+ enum SimdLevel
+ {
+  SimdLevel_Scalar,
+  SimdLevel_SSE2,
+  SimdLevel_AVX2,
+  SimdLevel_Best = ORANGUTAN_SIMD
+ };
+ 
+ /*! struct. GridSamples
+     desc.
+         Heights and colours of a grid, in whichever form a Displacement keeps them. Either
+         heights or shortHeights is used, and colours, packedColours or neither; without
+         colours every sample is white.
+ */
+ struct GridSamples
+ {
+  
+  GridSamples() : heights(0), shortHeights(0), heightScale(1), heightOffset(0), colours(0), packedColours(0) {}
+  
+  const float*              heights;
+  const Ogre::uint16*       shortHeights;   // Height is shortHeights[i] * heightScale + heightOffset.
+  float                     heightScale, heightOffset;
+  const Ogre::ColourValue*  colours;
+  const Ogre::RGBA*         packedColours;  // As ColourValue::getAsABGR.
+  
+ };
+ 
+ /*! struct. GridKernel
+     desc.
+         Turns a grid of heights (and colours) into Vertices in one pass; the position, the
+         rotated texture coordinates, the transform and the bounds of several vertices at a
+         time with SSE2 or AVX2, see ORANGUTAN_SIMD. Used by Displacement.
+ */
+ struct GridKernel
+ {
+  
+  /*! constructor. GridKernel
+      args.
+          transform -- Affine transform of each vertex, after being centred.
+          lengthX, lengthZ -- Samples across and down the grid.
+          uvPerSample -- Texture coordinates between samples.
+          uvAngle -- Rotation of the texture coordinates.
+          colourType -- From getColourType.
+  */
+  GridKernel(const Ogre::Matrix4& transform, size_t lengthX, size_t lengthZ, const Ogre::Vector2& uvPerSample, const Ogre::Radian& uvAngle, Ogre::VertexElementType colourType);
+  
+  /*! function. run
+      desc.
+          Write the vertices of samples x0, z0 to before x1, z1, and merge them into aabb.
+          samples are of the whole grid, and vertices of whole rows from row z0.
+  */
+  void run(const GridSamples& samples, Vertex* vertices, size_t x0, size_t z0, size_t x1, size_t z1, Ogre::AxisAlignedBox& aabb, SimdLevel level = SimdLevel_Best) const;
+  
+  /*! function. run
+      desc.
+          As above, with float heights and ColourValue colours.
+  */
+  void run(const float* heights, const Ogre::ColourValue* colours, Vertex* vertices, size_t x0, size_t z0, size_t x1, size_t z1, Ogre::AxisAlignedBox& aabb, SimdLevel level = SimdLevel_Best) const
+  {
+   GridSamples samples;
+   samples.heights = heights;
+   samples.colours = colours;
+   run(samples, vertices, x0, z0, x1, z1, aabb, level);
+  }
+  
+  float                    m[3][4];
+  float                    halfX, halfZ;
+  float                    uvPerX, uvPerZ;
+  float                    uvRotation[2][2];
+  size_t                   pitch;
+  Ogre::VertexElementType  colourType;
+  
+ };
 
+ /*! enum. UsageHint
+     desc.
+         How the vertex and index buffers of a Geometry are used.
+ */
+ enum UsageHint
+ {
+  UsageHint_Adaptive,  // Dynamic buffers whilst being edited, static once left alone.
+  UsageHint_Static,    // Always static buffers, for Geometries that are rarely edited.
+  UsageHint_Dynamic    // Always dynamic buffers, for Geometries edited every frame.
+ };
+ 
+ /*! struct. Statistics
+     desc.
+         Work done redrawing a GeometryRenderable, or all of them in a Geometry. Nothing
+         is counted unless ORANGUTAN_STATISTICS is 1.
+ */
+ struct Statistics
+ {
+  
+  Statistics()
+  {
+   reset();
+  }
+  
+  void reset()
+  {
+   redraws = 0;
+   fullRedraws = 0;
+   brushesRendered = 0;
+   verticesWritten = 0;
+   indexesWritten = 0;
+   bytesUploaded = 0;
+   bufferReallocations = 0;
+   redrawMicroseconds = 0;
+   layoutMicroseconds = 0;
+   renderMicroseconds = 0;
+  }
+  
+  Statistics& operator+=(const Statistics& other)
+  {
+   redraws += other.redraws;
+   fullRedraws += other.fullRedraws;
+   brushesRendered += other.brushesRendered;
+   verticesWritten += other.verticesWritten;
+   indexesWritten += other.indexesWritten;
+   bytesUploaded += other.bytesUploaded;
+   bufferReallocations += other.bufferReallocations;
+   redrawMicroseconds += other.redrawMicroseconds;
+   layoutMicroseconds += other.layoutMicroseconds;
+   renderMicroseconds += other.renderMicroseconds;
+   return *this;
+  }
+  
+  size_t         redraws;              // Times redrawn.
+  size_t         fullRedraws;          // Times all Brushes were redrawn and the buffers compacted.
+  size_t         brushesRendered;      // Brushes and MultiBrushes drawn into the buffers.
+  size_t         verticesWritten;      // Vertices drawn into the vertex buffers.
+  size_t         indexesWritten;       // Indexes drawn into the index buffers.
+  size_t         bytesUploaded;        // Bytes of the vertex and index buffers locked and written.
+  size_t         bufferReallocations;  // Vertex and index buffers created.
+  unsigned long  redrawMicroseconds;   // Time spent redrawing.
+  unsigned long  layoutMicroseconds;   // ...of which working out the ranges of each Brush.
+  unsigned long  renderMicroseconds;   // ...of which drawing Brushes into the buffers.
+ };
+ 
+ /*! class. TaskScheduler
+     desc.
+         Runs the independent jobs of a parallel redraw, see Geometry::setTaskScheduler.
+         Override run to hand them to your own job system. By default they are run with
+         OpenMP when Orangutan is compiled with it, otherwise one after another.
+ */
+ class TaskScheduler
+ {
+  public:
+   
+   /*! class. Task
+       desc.
+           A job that may run on any thread.
+   */
+   class Task
+   {
+    public:
+     
+     virtual ~Task() {}
+     
+     virtual void execute() = 0;
+   };
+   
+   virtual ~TaskScheduler() {}
+   
+   /*! function. run
+       desc.
+           Execute every task, and only return once all of them have finished.
+   */
+   virtual void run(Task** tasks, size_t count);
+   
+   /*! function. runInBackground
+       desc.
+           Start executing a task on another thread and return straight away, for
+           Geometry::setAsyncRedraw. The task itself records when it has finished.
+           By default it is executed straight away on the calling thread.
+   */
+   virtual void runInBackground(Task* task);
+ };
+ 
+ /*! class. WorkQueueTaskScheduler
+     desc.
+         TaskScheduler that runs background tasks on Ogre's WorkQueue, so they are
+         threaded when Ogre is built with thread support. Create it after Root.
+ */
+ class WorkQueueTaskScheduler : public TaskScheduler, public Ogre::WorkQueue::RequestHandler
+ {
+  public:
+   
+   WorkQueueTaskScheduler();
+   
+  ~WorkQueueTaskScheduler();
+   
+   void runInBackground(Task* task);
+   
+   Ogre::WorkQueue::Response* handleRequest(const Ogre::WorkQueue::Request* request, const Ogre::WorkQueue* queue);
+   
+  protected:
+   
+   /// mChannel -- WorkQueue channel of the requests.
+   Ogre::uint16  mChannel;
+ };
+ 
  class Librarian : public Ogre::Singleton<Librarian>, public Ogre::MovableObjectFactory
  {
    
@@ -201,87 +778,329 @@ namespace Orangutan
    
  };
  
- class GeometryRenderable : public Ogre::Renderable, public Ogre::GeneralAllocatedObject
+ class GeometryRenderable : public Ogre::Renderable, public TaskScheduler::Task, public Ogre::GeneralAllocatedObject
  {
   public:
    
    friend class Geometry;
    
-   GeometryRenderable(const Ogre::String& materialName, const Ogre::String& materialGroup, Geometry*, size_t index);
+   GeometryRenderable(const Ogre::String& materialName, const Ogre::String& materialGroup, Geometry*, GeometryCell*, size_t index);
    
   ~GeometryRenderable();
    
    void setMaterialName(const Ogre::String& materialName, const Ogre::String& materialGroup); 
    
-   inline void pushBrush(Brush* brush);
-   
-   inline void popBrush(Brush* brush);
-   
-   void _renderVertices(bool force);
+   /*! function. setVertexFormat
+       desc.
+           Recreate the vertex buffer in another VertexFormat.
+   */
+   void setVertexFormat(VertexFormat format);
    
-   /*! function. _create
+   /*! function. setUsageHint
        desc.
-           Create the vertex buffer
+           Set how the buffers are used, they are recreated if that changes.
    */
-   void _create(size_t initialSize = 100);
+   void setUsageHint(UsageHint hint);
    
-   /*! function. _destroy
+   /*! function. _updateUsage
        desc.
-           Destroy the vertex buffer
+           Move the buffers into static memory if they haven't been redrawn for
+           STATIC_AFTER_FRAMES frames. Returns true if they were recreated.
    */
-   void _destroy();
+   bool _updateUsage();
    
-   /*! function. _resizeVertexBuffer
+   /// STATIC_AFTER_FRAMES -- Frames without a redraw before UsageHint_Adaptive uses static buffers.
+   static const unsigned long STATIC_AFTER_FRAMES = 120;
+   
+   /*! function. trimMemory
        desc.
-           Resize the vertex buffer to the greatest nearest power 
-           of 2 of requestedSize.
+           Redraw everything into the smallest buffers that will hold it.
    */
-   void _resizeVertexBuffer(size_t requestedSize);
+   void trimMemory();
    
-   /*! function. _resizeVertexBuffer
+   /// SHRINK_AFTER_REDRAWS -- Full redraws using less than a quarter of the buffers before they are shrunk.
+   static const size_t SHRINK_AFTER_REDRAWS = 8;
+   
+   /*! function. getStats
        desc.
-           Resize the vertex buffer to the greatest nearest power 
-           of 2 of requestedSize.
+           Work done redrawing this GeometryRenderable.
    */
-   void _resizeIndexBuffer(size_t requestedSize);
-
-   const Ogre::MaterialPtr& getMaterial(void) const
-   {
-    if (mMaterial.isNull())
-     mMaterial = Ogre::MaterialManager::getSingletonPtr()->load(mMaterialName, mMaterialGroup);
-    return mMaterial;
-   }
-    
-   void Ogre::Renderable::getRenderOperation(Ogre::RenderOperation& op)
+   const Statistics& getStats() const
    {
-    op = mRenderOp;
+    return mStats;
    }
    
-   inline const bool isEmpty() const
+   void resetStats()
    {
-    return (mRenderOp.vertexData == 0 || mRenderOp.vertexData->vertexCount == 0);
+    mStats.reset();
    }
    
-   void getWorldTransforms(Ogre::Matrix4* transform) const;
+   inline void pushBrush(Brush* brush);
    
-   Ogre::Real getSquaredViewDepth(const Ogre::Camera* cam) const;
+   inline void popBrush(Brush* brush);
    
-   const Ogre::LightList& getLights(void) const;
+   /*! function. pushPart
+       desc.
+           Draw a part of a MultiBrush (a face of a Block) in this GeometryRenderable.
+   */
+   inline void pushPart(MultiBrush* brush, size_t part);
+   
+   inline void popPart(MultiBrush* brush, size_t part);
+   
+   /*! function. _renderVertices
+       desc.
+           Draw any Brushes that have changed directly into their ranges of the
+           vertex and index buffers. If Brushes have been added or removed, or one
+           no longer fits into its range then all of them are redrawn and the
+           buffers are compacted.
+   */
+   void _renderVertices(bool force);
+   
+   /*! function. _beginRenderVertices
+       desc.
+           The first half of _renderVertices, for drawing in parallel. Changed Brushes are
+           drawn as usual, but if all of them need to be then the buffers are laid out and
+           locked and true is returned. execute then draws the Brushes on any thread, and
+           _unlockAllSegments finishes on the render thread.
+   */
+   bool _beginRenderVertices(bool force);
+   
+   /*! function. execute
+       desc.
+           Draw every Brush into the buffers locked by _beginRenderVertices.
+   */
+   void execute();
+   
+   /*! function. _unlockAllSegments
+   */
+   void _unlockAllSegments();
+   
+   /*! function. _beginBackRender
+       desc.
+           Work out the ranges of every Brush into the back buffer for a background redraw,
+           leaving the current buffers to be drawn. Returns false if nothing has changed.
+   */
+   bool _beginBackRender();
+   
+   /*! function. _renderBack
+       desc.
+           Draw every Brush into the back buffer, safe on any thread.
+   */
+   void _renderBack();
+   
+   /*! function. _endBackRender
+       desc.
+           Upload the back buffer into the vertex and index buffers, on the render thread.
+   */
+   void _endBackRender();
+   
+   /*! function. _create
+       desc.
+           Create the vertex buffer
+   */
+   void _create(size_t initialSize = 100);
+   
+   /*! function. _destroy
+       desc.
+           Destroy the vertex buffer
+   */
+   void _destroy();
+   
+   /*! function. _resizeVertexBuffer
+       desc.
+           Resize the vertex buffer to the greatest nearest power 
+           of 2 of requestedSize. It only grows unless shrink is true.
+   */
+   void _resizeVertexBuffer(size_t requestedSize, bool shrink = false);
+   
+   /*! function. _resizeVertexBuffer
+       desc.
+           Resize the vertex buffer to the greatest nearest power 
+           of 2 of requestedSize. It only grows unless shrink is true.
+   */
+   void _resizeIndexBuffer(size_t requestedSize, bool shrink = false);
+   
+   /*! function. _getIndexType
+       desc.
+           Index type needed for a number of vertices.
+   */
+   static Ogre::HardwareIndexBuffer::IndexType _getIndexType(size_t vertexCount)
+   {
+    return vertexCount > 0xFFFF ? Ogre::HardwareIndexBuffer::IT_32BIT : Ogre::HardwareIndexBuffer::IT_16BIT;
+   }
+
+   const Ogre::MaterialPtr& getMaterial(void) const
+   {
+    if (mMaterial.isNull())
+     mMaterial = Ogre::MaterialManager::getSingletonPtr()->load(mMaterialName, mMaterialGroup);
+    return mMaterial;
+   }
+    
+   void Ogre::Renderable::getRenderOperation(Ogre::RenderOperation& op)
+   {
+    op = mRenderOp;
+   }
+   
+   inline const bool isEmpty() const
+   {
+    return (mRenderOp.vertexData == 0 || mRenderOp.vertexData->vertexCount == 0);
+   }
+   
+   void getWorldTransforms(Ogre::Matrix4* transform) const;
+   
+   Ogre::Real getSquaredViewDepth(const Ogre::Camera* cam) const;
+   
+   const Ogre::LightList& getLights(void) const;
    
   protected:
    
-   /// mRedrawNeeded -- If all Brushes need to be copied into the VertexBuffer.
+   /*! struct. Segment
+       desc.
+           A range of the vertex and index buffers owned by a Brush, or by a part of a
+           MultiBrush. The ranges stay where they are between redraws, so a changed Brush
+           only has to rewrite its own range.
+   */
+   struct Segment
+   {
+    Brush*       mBrush;
+    MultiBrush*  mMultiBrush;
+    size_t       mPart;
+    size_t       mRevision;
+    size_t       mVertexStart, mVertexCount;
+    size_t       mIndexStart, mIndexCount;
+    bool         mMerged;
+   };
+   
+   /*! struct. BackBuffer
+       desc.
+           Copy of the vertices and indexes in memory, drawn on another thread by a
+           background redraw while the vertex and index buffers are still being drawn.
+   */
+   struct BackBuffer
+   {
+    std::vector<Segment>                 mSegments;
+    std::vector<Vertex>                  mMergedQuads;
+    buffer<Ogre::uint8>                  mVertices, mIndexes;
+    size_t                               mVertexCount, mIndexCount;
+    Ogre::HardwareIndexBuffer::IndexType mIndexType;
+    Ogre::AxisAlignedBox                 mAABB;
+   };
+   
+   /*! function. _renderAllSegments
+       desc.
+           Ask every Brush how many vertices and indexes it needs, size and lock the
+           buffers once, then have each Brush draw straight into its new range. The
+           buffers are shrunk if trim is true, or if they have been mostly unused for
+           SHRINK_AFTER_REDRAWS full redraws.
+   */
+   void _renderAllSegments(bool trim = false);
+   
+   /*! function. _layoutAllSegments
+       desc.
+           The first half of _renderAllSegments; work out the ranges, size the buffers
+           and lock them. Returns false if there is nothing to draw.
+   */
+   bool _layoutAllSegments(bool trim);
+   
+   /*! function. _layoutSegments
+       desc.
+           Put every Brush and part one after another into segments, followed by the
+           quads merged by _mergeQuads.
+   */
+   void _layoutSegments(std::vector<Segment>& segments, std::vector<Vertex>& mergedQuads, Ogre::AxisAlignedBox& aabb, size_t& vertexCount, size_t& indexCount);
+   
+   /*! function. _mergeQuads
+       desc.
+           Greedily merge the quads of Segments that lie side by side on the same plane, with
+           the same colour and the same mapping of texture coordinates, into larger ones. Merged
+           Segments draw nothing themselves, the merged quads are written into mergedQuads.
+   */
+   void _mergeQuads(std::vector<Segment>& segments, std::vector<Vertex>& mergedQuads);
+   
+   /*! function. _renderChangedSegments
+       desc.
+           Redraw Brushes that have changed into their existing ranges. Returns false
+           if one of them doesn't fit anymore.
+   */
+   bool _renderChangedSegments();
+   
+   /*! function. _setUsage
+       desc.
+           Recreate the buffers with another usage, everything then needs to be redrawn.
+   */
+   void _setUsage(Ogre::HardwareBuffer::Usage usage);
+   
+   /*! function. _renderSegments
+       desc.
+           Draw every Segment and the merged quads after them into locked buffers, or
+           into the back buffer.
+   */
+   template<typename IndexType> void _renderSegments(const std::vector<Segment>& segments, const std::vector<Vertex>& mergedQuads, Ogre::uint8* vertices, IndexType* indexes);
+   
+   /*! function. _renderOptimised
+       desc.
+           Draw a Segment into memory first, weld and reorder it for the vertex cache (see
+           Geometry::setVertexCacheOptimisation) then write it out. Scratch memory is passed in
+           so it can be reused between Segments.
+   */
+   template<typename IndexType> void _renderOptimised(const Segment& segment, VertexWriter& vertices, IndexType* indexes, size_t vertexCount, size_t indexCount, std::vector<Vertex>& vertexScratch, std::vector<Index32>& indexScratch);
+   
+   /// OPTIMISE_MIN_INDEXES -- Segments with fewer indexes than this aren't worth optimising.
+   static const size_t OPTIMISE_MIN_INDEXES = 96;
+   
+   /*! function. _renderSegment
+       desc.
+           Lock the range of a single Segment and draw into it.
+   */
+   template<typename IndexType> void _renderSegment(Segment& segment, size_t vertexCount, size_t indexCount);
+   
+   /*! function. _renderSegmentVertices
+       desc.
+           Lock and draw only some vertices of a Brush's Segment, see Brush::_getChangedVertices.
+   */
+   void _renderSegmentVertices(Segment& segment, size_t first, size_t count);
+   
+   /// mRedrawNeeded -- If any Brushes need to be copied into the VertexBuffer.
    bool                                mRedrawNeeded;
+   /// mLayoutChanged -- If all Brushes need to be copied into the VertexBuffer.
+   bool                                mLayoutChanged;
    // Copy of pointers to Brushes assigned to this GeometryRenderable
    std::vector<Brush*>                 mBrushes;
-   // Temporary Vertex buffer
-   buffer<Vertex>                      mVertices;
-   // Temporary Index buffer
-   buffer<Index>                       mIndexes;
+   // A part of a MultiBrush
+   typedef std::pair<MultiBrush*, size_t> Part;
+   // Parts of MultiBrushes in this material
+   std::vector<Part>                   mParts;
+   // Ranges of the vertex and index buffers used by each Brush and MultiBrush
+   std::vector<Segment>                mSegments;
+   // Quads merged from Segments, drawn after them
+   std::vector<Vertex>                 mMergedQuads;
    // Vertex buffer size
    size_t                              mVertexBufferSize;
    // Index buffer size
    size_t                              mIndexBufferSize;
+   // Index buffer type
+   Ogre::HardwareIndexBuffer::IndexType mIndexType;
+   // Vertex buffer layout
+   VertexFormat                        mVertexFormat;
+   // How the buffers are used
+   UsageHint                           mUsageHint;
+   // Usage the buffers are created with
+   Ogre::HardwareBuffer::Usage         mUsage;
+   // Frame of the last redraw
+   unsigned long                       mLastRedrawFrame;
+   // Full redraws in a row using less than a quarter of the buffers
+   size_t                              mUnderusedRedraws;
+   // Work done redrawing
+   Statistics                          mStats;
+   // Background redraw
+   BackBuffer                          mBack;
+   // Buffers locked by _layoutAllSegments
+   Ogre::uint8*                        mLockedVertices;
+   void*                               mLockedIndexes;
+#if ORANGUTAN_STATISTICS
+   // Time the buffers were locked
+   unsigned long                       mLockedTime;
+#endif
    // Render Operation
    Ogre::RenderOperation               mRenderOp;
    // Master vertex buffer
@@ -294,55 +1113,630 @@ namespace Orangutan
    Ogre::String                        mMaterialName, mMaterialGroup;
    // Parent geometry
    Geometry*                           mParent;
+   // Cell of the Geometry this draws
+   GeometryCell*                       mCell;
    // AABB
    Ogre::AxisAlignedBox                mAABB;
    // Index
    size_t                              mIndex;
  };
  
+ /*! enum. BlockInstancing
+     desc.
+         How Blocks are drawn, see Geometry::setBlockInstancing.
+ */
+ enum BlockInstancing
+ {
+  BlockInstancing_None,      // Each Block is drawn into the GeometryRenderables of its materials.
+  BlockInstancing_Software,  // Blocks are drawn from a unit cube and a list of instances, copied on the CPU.
+  BlockInstancing_Hardware   // As software, but the GPU copies the unit cube for each instance.
+ };
+ 
+ /*! class. BlockInstances
+     desc.
+         Blocks in a cell with the same material and the same faces drawn, drawn as copies of
+         a unit cube. Each Block is an Instance, so moving one only rewrites its Instance.
+         
+         With hardware instancing the unit cube is in vertex buffer 0, and the Instances are
+         in vertex buffer 1 as TEXCOORD1 (position), TEXCOORD2 (orientation as w, x, y, z) and
+         TEXCOORD3 (size). The material's vertex shader has to scale, rotate and move each
+         vertex by them. In software the unit cube is copied and transformed for each Instance.
+ */
+ class BlockInstances : public Ogre::Renderable, public Ogre::GeneralAllocatedObject
+ {
+  public:
+   
+   /*! struct. Instance
+       desc.
+           Layout of an instance in the instance buffer.
+   */
+   struct Instance
+   {
+    Ogre::Vector3     position;
+    Ogre::Quaternion  orientation;
+    Ogre::Vector3     size;
+   };
+   
+   BlockInstances(const Ogre::String& materialName, const Ogre::String& materialGroup, Geometry*, GeometryCell*, size_t index, size_t faces, bool hardware);
+   
+  ~BlockInstances();
+   
+   /*! function. addInstance
+   */
+   void addInstance(Block*);
+   
+   /*! function. removeInstance
+   */
+   void removeInstance(Block*);
+   
+   /*! function. updateInstance
+       desc.
+           Rewrite the Instance of a Block that has moved.
+   */
+   void updateInstance(Block*);
+   
+   /*! function. _update
+       desc.
+           Upload Instances that have changed.
+   */
+   void _update();
+   
+   /*! function. getIndex
+       desc.
+           Material index.
+   */
+   size_t getIndex() const
+   {
+    return mIndex;
+   }
+   
+   /*! function. getFaces
+       desc.
+           Faces drawn, as bits of 1 << Block::QuadID.
+   */
+   size_t getFaces() const
+   {
+    return mFaces;
+   }
+   
+   /*! function. setMaterialName
+   */
+   void setMaterialName(const Ogre::String& materialName, const Ogre::String& materialGroup);
+   
+   /*! function. isHardware
+   */
+   bool isHardware() const
+   {
+    return mHardware;
+   }
+   
+   inline bool isEmpty() const
+   {
+    return mBlocks.empty();
+   }
+   
+   const Ogre::AxisAlignedBox& getAABB() const
+   {
+    return mAABB;
+   }
+   
+   const Ogre::MaterialPtr& getMaterial(void) const
+   {
+    if (mMaterial.isNull())
+     mMaterial = Ogre::MaterialManager::getSingletonPtr()->load(mMaterialName, mMaterialGroup);
+    return mMaterial;
+   }
+   
+   void Ogre::Renderable::getRenderOperation(Ogre::RenderOperation& op)
+   {
+    op = mRenderOp;
+   }
+   
+   void getWorldTransforms(Ogre::Matrix4* transform) const;
+   
+   Ogre::Real getSquaredViewDepth(const Ogre::Camera* cam) const;
+   
+   const Ogre::LightList& getLights(void) const;
+   
+  protected:
+   
+   /*! function. _resize
+       desc.
+           Recreate the buffers to hold at least count Instances.
+   */
+   void _resize(size_t count);
+   
+   /*! function. _changed
+       desc.
+           Mark an Instance to be uploaded.
+   */
+   void _changed(size_t slot);
+   
+   // Parent geometry
+   Geometry*                           mParent;
+   // Cell of the Geometry this draws
+   GeometryCell*                       mCell;
+   // Material index
+   size_t                              mIndex;
+   // Faces drawn
+   size_t                              mFaces;
+   // If drawn with hardware instancing
+   bool                                mHardware;
+   // Blocks drawn, in the order of mInstances
+   std::vector<Block*>                 mBlocks;
+   // Instances of the Blocks
+   std::vector<Instance>               mInstances;
+   // Unit cube
+   std::vector<Vertex>                 mUnitVertices;
+   std::vector<Index32>                mUnitIndexes;
+   // Instances to upload, from mChangedStart to before mChangedEnd
+   size_t                              mChangedStart, mChangedEnd;
+   // Instances the buffers hold
+   size_t                              mCapacity;
+   // Render Operation
+   Ogre::RenderOperation               mRenderOp;
+   // Unit cube, or every copy of it in software
+   Ogre::HardwareVertexBufferSharedPtr mVertexBuffer;
+   Ogre::HardwareIndexBufferSharedPtr  mIndexBuffer;
+   // Instances, with hardware instancing
+   Ogre::HardwareVertexBufferSharedPtr mInstanceBuffer;
+   // Material
+   mutable Ogre::MaterialPtr           mMaterial;
+   // Material name and group
+   Ogre::String                        mMaterialName, mMaterialGroup;
+   // AABB of every Block, and if it needs to be worked out again
+   Ogre::AxisAlignedBox                mAABB;
+   bool                                mAABBChanged;
+ };
+ 
+ /*! class. GeometryCell
+     desc.
+         A cube of space in a Geometry, with a GeometryRenderable for each material used
+         by the Brushes and Blocks inside of it. See Geometry::setCellSize.
+ */
+ class GeometryCell : public Ogre::GeneralAllocatedObject
+ {
+  public:
+   
+   /*! struct. Key
+       desc.
+           Position of a cell in the grid, in cells.
+   */
+   struct Key
+   {
+    int x, y, z;
+    
+    bool operator<(const Key& other) const
+    {
+     if (x != other.x)
+      return x < other.x;
+     if (y != other.y)
+      return y < other.y;
+     return z < other.z;
+    }
+   };
+   
+   typedef std::vector<GeometryRenderable*> Renderables;
+   
+   GeometryCell(const Key& key) : mKey(key) {}
+   
+   /// mKey -- Position in the grid.
+   Key                   mKey;
+   /// mRenderables -- GeometryRenderables indexed by material index (0 if unused), owned by the Geometry.
+   Renderables           mRenderables;
+   /// mInstances -- Instanced Blocks by material and faces, owned by the Geometry.
+   std::vector<BlockInstances*> mInstances;
+ };
+ 
  class Geometry : public Ogre::MovableObject
  {
    
   public:
    
-   friend class GeometryRenderable;
+   friend class GeometryRenderable;
+   
+   friend class BlockInstances;
+   
+   static const Ogre::String DEFAULT_MATERIAL_NAME;
+   
+   typedef std::vector<GeometryRenderable*> GeometryRenderables;
+   
+   typedef std::pair<Ogre::String, Ogre::String> MaterialName;
+   
+   typedef std::map<size_t, MaterialName> MaterialNames;
+   
+   friend class Librarian;
+   
+   inline const Ogre::String& getMovableType(void) const
+   {
+    return Librarian::MOVABLE_OBJECT_NAME;
+   }
+   
+   void setMaterialName(size_t index, const Ogre::String& materialName = DEFAULT_MATERIAL_NAME, const Ogre::String& group = Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME);
+   
+   /*! function. setVertexFormat
+       desc.
+           Set the layout of the vertices, VertexFormat_ColourHalfUV is smaller but loses
+           precision on large texture coordinates.
+   */
+   void setVertexFormat(VertexFormat format);
+   
+   /*! function. getVertexFormat
+   */
+   VertexFormat getVertexFormat() const
+   {
+    return mVertexFormat;
+   }
+   
+   /*! function. setUsageHint
+       desc.
+           Set how the vertex and index buffers are used. UsageHint_Adaptive (the default)
+           moves each material's buffers into static memory once it stops being edited,
+           and back to dynamic memory when editing resumes.
+   */
+   void setUsageHint(UsageHint hint);
+   
+   /*! function. getUsageHint
+   */
+   UsageHint getUsageHint() const
+   {
+    return mUsageHint;
+   }
+   
+   /*! function. setLodCamera
+       desc.
+           Choose the detail of Displacement patches from camera, whichever camera is
+           rendering. With 0 (the default) the first camera to render the Geometry in a
+           frame is used, so other viewports in that frame don't change it.
+   */
+   void setLodCamera(Ogre::Camera* camera)
+   {
+    mLodCamera = camera;
+   }
+   
+   /*! function. getLodCamera
+   */
+   Ogre::Camera* getLodCamera() const
+   {
+    return mLodCamera;
+   }
+   
+   /*! function. setCellSize
+       desc.
+           Split the Geometry into a grid of cubes of size, each with its own GeometryRenderables
+           for each material. An edit only redraws the cells it touches, and cells outside of the
+           camera are not drawn. Brushes and Blocks are put into the cell of the centre of their
+           AABB. A size of 0 (the default) uses one cell for everything.
+   */
+   void setCellSize(Ogre::Real size);
+   
+   /*! function. getCellSize
+   */
+   Ogre::Real getCellSize() const
+   {
+    return mCellSize;
+   }
+   
+   /*! function. trimMemory
+       desc.
+           Release unused memory held by the GeometryRenderables' buffers and by the
+           Brushes. Everything is redrawn straight away.
+   */
+   void trimMemory();
+   
+   /*! function. setTaskScheduler
+       desc.
+           Redraw GeometryRenderables that need all of their Brushes drawn in parallel with
+           scheduler, which is not owned by the Geometry. The buffers are still locked and
+           unlocked on the render thread. 0 (the default) redraws them one after another.
+   */
+   void setTaskScheduler(TaskScheduler* scheduler)
+   {
+    mTaskScheduler = scheduler;
+   }
+   
+   /*! function. getTaskScheduler
+   */
+   TaskScheduler* getTaskScheduler() const
+   {
+    return mTaskScheduler;
+   }
+   
+   /*! class. Listener
+       desc.
+           Told when a redraw has been uploaded, see setListener.
+   */
+   class Listener
+   {
+    public:
+     
+     virtual ~Listener() {}
+     
+     /*! function. redrawVisible
+         desc.
+             Every edit up to version (see getEditVersion) will be seen from the next frame.
+     */
+     virtual void redrawVisible(Geometry*, unsigned long version) = 0;
+   };
+   
+   /*! function. setAsyncRedraw
+       desc.
+           Redraw in the background with TaskScheduler::runInBackground. Brushes are drawn
+           into a copy in memory while the current buffers keep being rendered, and the copy
+           is uploaded at the start of a later frame. Edits made while a background redraw
+           is running wait for it to finish first, and are drawn by the next one.
+   */
+   void setAsyncRedraw(bool async);
+   
+   /*! function. getAsyncRedraw
+   */
+   bool getAsyncRedraw() const
+   {
+    return mAsync;
+   }
+   
+   /*! function. waitForRedraw
+       desc.
+           Wait for a background redraw to finish, and upload it.
+   */
+   void waitForRedraw();
+   
+   /*! function. getEditVersion
+       desc.
+           Number of edits made so far, an edit is visible once getVisibleVersion has reached it.
+   */
+   unsigned long getEditVersion() const
+   {
+    return mEditVersion;
+   }
+   
+   /*! function. getVisibleVersion
+       desc.
+           Edit version of the last redraw that was uploaded.
+   */
+   unsigned long getVisibleVersion() const
+   {
+    return mVisibleVersion;
+   }
+   
+   /*! function. setListener
+       desc.
+           Listener to tell when redraws are uploaded, not owned by the Geometry. 0 for none.
+   */
+   void setListener(Listener* listener)
+   {
+    mListener = listener;
+   }
+   
+   /*! function. getListener
+   */
+   Listener* getListener() const
+   {
+    return mListener;
+   }
+   
+   /*! function. getStats
+       desc.
+           Work done redrawing all of the GeometryRenderables. redraws and redrawMicroseconds
+           are of the Geometry as a whole, see GeometryRenderable::getStats for each material.
+   */
+   Statistics getStats() const;
+   
+   /*! function. resetStats
+   */
+   void resetStats();
+   
+   /*! function. getOrCreateCell
+       desc.
+           Get the cell that a Brush with an AABB belongs to.
+   */
+   GeometryCell* getOrCreateCell(const Ogre::AxisAlignedBox& aabb);
+   
+   /*! function. getOrCreateRenderable
+       desc.
+           Get the GeometryRenderable of a material index in a cell.
+   */
+   GeometryRenderable* getOrCreateRenderable(GeometryCell* cell, size_t index);
+   
+   Plane*  createPlane(const Ogre::Vector3& position, const Ogre::Vector2& size, const Ogre::Quaternion& orientation = Ogre::Quaternion::IDENTITY, size_t materialIndex = 0);
+   
+   void   destroyPlane(Plane*);
+   
+   /*! function. createPlanes
+       desc.
+           Create count Planes at once. orientations may be 0 for no rotation, and the
+           new Planes are written to planes if it isn't 0.
+   */
+   void   createPlanes(size_t count, const Ogre::Vector3* positions, const Ogre::Vector2* sizes, const Ogre::Quaternion* orientations = 0, size_t materialIndex = 0, Plane** planes = 0);
+   
+   /*! function. destroyPlanes
+       desc.
+           Destroy the Planes of count Handles at once. Handles of Planes that have
+           already been destroyed are skipped.
+   */
+   void   destroyPlanes(const Handle* handles, size_t count);
+   
+   /*! function. getPlane
+       desc.
+           Plane of a Handle, or 0 if it has been destroyed.
+   */
+   Plane*  getPlane(const Handle& handle) const
+   {
+    return mPlanes.get(handle);
+   }
+
+   Ogre::VectorIterator< std::vector<Plane*> >  getPlanes()
+   {
+    return Ogre::VectorIterator< std::vector<Plane*> >(mPlanes.begin(), mPlanes.end());
+   }
+   
+   Displacement*  createDisplacement(const Ogre::Vector3& position, const Ogre::Vector3& scale, const Ogre::Quaternion& orientation = Ogre::Quaternion::IDENTITY, size_t materialIndex = 0);
+   
+   void   destroyDisplacement(Displacement*);
+   
+   /*! function. createDisplacements
+       desc.
+           Create count Displacements at once. orientations may be 0 for no rotation, and
+           the new Displacements are written to displacements if it isn't 0.
+   */
+   void   createDisplacements(size_t count, const Ogre::Vector3* positions, const Ogre::Vector3* scales, const Ogre::Quaternion* orientations = 0, size_t materialIndex = 0, Displacement** displacements = 0);
+   
+   /*! function. destroyDisplacements
+       desc.
+           Destroy the Displacements of count Handles at once. Handles of Displacements
+           that have already been destroyed are skipped.
+   */
+   void   destroyDisplacements(const Handle* handles, size_t count);
+   
+   /*! function. getDisplacement
+       desc.
+           Displacement of a Handle, or 0 if it has been destroyed.
+   */
+   Displacement*  getDisplacement(const Handle& handle) const
+   {
+    return mDisplacements.get(handle);
+   }
+   
+   Ogre::VectorIterator< std::vector<Displacement*> >  getDisplacements()
+   {
+    return Ogre::VectorIterator< std::vector<Displacement*> >(mDisplacements.begin(), mDisplacements.end());
+   }
+   
+   Block*  createBlock(const Ogre::Vector3& position, const Ogre::Vector3& size, const Ogre::Quaternion& orientation = Ogre::Quaternion::IDENTITY, size_t materialIndex = 0);
    
-   static const Ogre::String DEFAULT_MATERIAL_NAME;
+   void   destroyBlock(Block*);
    
-   typedef std::map<size_t, GeometryRenderable*> GeometryRenderables;
+   /*! function. createBlocks
+       desc.
+           Create count Blocks at once. orientations may be 0 for no rotation, and the
+           new Blocks are written to blocks if it isn't 0.
+   */
+   void   createBlocks(size_t count, const Ogre::Vector3* positions, const Ogre::Vector3* sizes, const Ogre::Quaternion* orientations = 0, size_t materialIndex = 0, Block** blocks = 0);
    
-   friend class Librarian;
+   /*! function. destroyBlocks
+       desc.
+           Destroy the Blocks of count Handles at once. Handles of Blocks that have
+           already been destroyed are skipped, and the faces of Blocks around them are
+           only looked at once.
+   */
+   void   destroyBlocks(const Handle* handles, size_t count);
    
-   inline const Ogre::String& getMovableType(void) const
+   /*! function. getBlock
+       desc.
+           Block of a Handle, or 0 if it has been destroyed.
+   */
+   Block*  getBlock(const Handle& handle) const
    {
-    return Librarian::MOVABLE_OBJECT_NAME;
+    return mBlocks.get(handle);
    }
    
-   void setMaterialName(size_t index, const Ogre::String& materialName = DEFAULT_MATERIAL_NAME, const Ogre::String& group = Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME);
+   /*! function. destroyAll
+       desc.
+           Destroy every Plane, Displacement and Block.
+   */
+   void   destroyAll();
    
-   GeometryRenderable* getOrCreateRenderable(size_t index, const Ogre::String& materialName = DEFAULT_MATERIAL_NAME, const Ogre::String& group = Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME);
+   /*! function. setHiddenFaceRemoval
+       desc.
+           Don't draw faces of Blocks that are fully covered by a face of another Block on
+           the same plane facing the other way, i.e. where two Blocks touch. This is kept up
+           to date as Blocks are created, changed and destroyed. Faces are looked up in a
+           grid of faceGridSize, which should be about the size of a Block.
+   */
+   void   setHiddenFaceRemoval(bool remove, Ogre::Real faceGridSize = 1);
    
-   Plane*  createPlane(const Ogre::Vector3& position, const Ogre::Vector2& size, const Ogre::Quaternion& orientation = Ogre::Quaternion::IDENTITY, size_t materialIndex = 0);
+   /*! function. setQuadMerging
+       desc.
+           Merge Planes and faces of Blocks lying side by side on the same plane into larger
+           quads when they are drawn, if they have the same material, colour and a continuous
+           mapping of texture coordinates. Editing a merged quad redraws its whole material.
+   */
+   void   setQuadMerging(bool merge);
    
-   void   destroyPlane(Plane*);
-
-   Ogre::VectorIterator< std::vector<Plane*> >  getPlanes()
+   /*! function. setBlockInstancing
+       desc.
+           Draw Blocks as instances of a unit cube, so moving one only rewrites its instance
+           instead of redrawing its materials. Only Blocks with one material for every face and
+           the default texture settings are instanced. BlockInstancing_Hardware needs a material
+           set with setInstancedMaterialName and render system support, otherwise it falls
+           back to BlockInstancing_Software. See BlockInstances.
+   */
+   void   setBlockInstancing(BlockInstancing instancing);
+   
+   /*! function. getBlockInstancing
+   */
+   BlockInstancing getBlockInstancing() const
    {
-    return Ogre::VectorIterator< std::vector<Plane*> >(mPlanes.begin(), mPlanes.end());
+    return mBlockInstancing;
    }
    
-   Displacement*  createDisplacement(const Ogre::Vector3& position, const Ogre::Vector3& scale, const Ogre::Quaternion& orientation = Ogre::Quaternion::IDENTITY, size_t materialIndex = 0);
+   /*! function. setInstancedMaterialName
+       desc.
+           Material used instead of a material index's for hardware instanced Blocks, with a
+           vertex shader that reads the instances.
+   */
+   void   setInstancedMaterialName(size_t index, const Ogre::String& materialName, const Ogre::String& group = Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME);
    
-   void   destroyDisplacement(Displacement*);
+   /*! function. _addBlock
+       desc.
+           Put a Block into its cell, and each of its faces into the GeometryRenderable
+           of its material, or into BlockInstances.
+   */
+   void _addBlock(Block*);
    
-   Ogre::VectorIterator< std::vector<Displacement*> >  getDisplacements()
+   /*! function. _removeBlock
+       desc.
+           Take a Block out of the GeometryRenderables or BlockInstances it is drawn by.
+   */
+   void _removeBlock(Block*);
+   
+   /*! function. _blockMoved
+       desc.
+           Move a Block into another cell if it needs to be, otherwise update its instance
+           or redraw it.
+   */
+   void   _blockMoved(Block*);
+   
+   /*! function. _instancesChanged
+       desc.
+           Instances of Blocks need to be uploaded.
+   */
+   void   _instancesChanged();
+   
+   /*! function. setVertexCacheOptimisation
+       desc.
+           Weld identical vertices of each Brush and reorder its triangles for the GPU's vertex
+           cache, and its vertices in the order they are used, when it is drawn. Worth it for
+           large Displacements, but makes their redraws slower.
+   */
+   void   setVertexCacheOptimisation(bool optimise);
+   
+   /*! function. getVertexCacheOptimisation
+   */
+   bool   getVertexCacheOptimisation() const
    {
-    return Ogre::VectorIterator< std::vector<Displacement*> >(mDisplacements.begin(), mDisplacements.end());
+    return mVertexCacheOptimisation;
    }
    
-   Block*  createBlock(const Ogre::Vector3& position, const Ogre::Vector3& size, const Ogre::Quaternion& orientation = Ogre::Quaternion::IDENTITY, size_t materialIndex = 0);
+   /*! function. getQuadMerging
+   */
+   bool   getQuadMerging() const
+   {
+    return mQuadMerging;
+   }
    
-   void   destroyBlock(Block*);
+   /*! function. getHiddenFaceRemoval
+   */
+   bool   getHiddenFaceRemoval() const
+   {
+    return mHiddenFaceRemoval;
+   }
+   
+   /*! function. _blockChanged
+       desc.
+           Find the faces of a Block, and the faces of the Blocks next to it, that are hidden.
+   */
+   void   _blockChanged(Block*);
    
    Ogre::VectorIterator< std::vector<Block*> >  getBlock()
    {
@@ -368,9 +1762,17 @@ namespace Orangutan
    */
    Ogre::Real getBoundingRadius() const
    {
-    return 0; // TODO
+    if (mAABB.isNull())
+     return 0;
+    return std::max(mAABB.getMinimum().length(), mAABB.getMaximum().length());
    }
    
+   /*! function. _notifyCurrentCamera
+       desc.
+           Remember the camera, for culling the cells in _updateRenderQueue.
+   */
+   void _notifyCurrentCamera(Ogre::Camera* camera);
+   
    /*! function. _updateRenderQueue
    */
    void _updateRenderQueue(Ogre::RenderQueue* queue);
@@ -379,14 +1781,75 @@ namespace Orangutan
    */
    void visitRenderables(Ogre::Renderable::Visitor *,bool);
    
-   void redrawNeeded(size_t index)
+   /*! function. redrawNeeded
+       desc.
+           Mark a GeometryRenderable to be redrawn. If relayout is true then Brushes
+           have been added or removed from it.
+   */
+   void redrawNeeded(GeometryRenderable* renderable, bool relayout = false)
    {
+    mEditVersion++;
+    renderable->mRedrawNeeded = true;
+    if (relayout)
+     renderable->mLayoutChanged = true;
+    if (mRedrawNeeded)
+     return; // Already marked, i.e. in a bulk create.
     mRedrawNeeded = true;
-    mGeometries[index]->mRedrawNeeded = true;
     if (mParentNode)
      mParentNode->needUpdate();
    }
    
+   /*! function. beginUpdate
+       desc.
+           Start a batch of edits. Until the matching endUpdate, each changed Brush or Block
+           is only regenerated and redrawn once, however many times it is changed. Calls may
+           be nested.
+   */
+   void beginUpdate();
+   
+   /*! function. endUpdate
+       desc.
+           Finish a batch of edits, and regenerate everything that was changed in it.
+   */
+   void endUpdate();
+   
+   /*! function. isUpdating
+   */
+   bool isUpdating() const
+   {
+    return mUpdateDepth != 0;
+   }
+   
+   /*! function. _deferUpdate
+       desc.
+           If inside of beginUpdate/endUpdate, remember that the Brush needs to be
+           regenerated and return true.
+   */
+   bool _deferUpdate(Brush*);
+   
+   bool _deferUpdate(MultiBrush*);
+   
+   /*! function. _addPart
+       desc.
+           Draw a part of a MultiBrush in the GeometryRenderable of its material. Only
+           that GeometryRenderable is redrawn.
+   */
+   void _addPart(MultiBrush*, size_t part);
+   
+   /*! function. _removePart
+       desc.
+           Stop drawing a part of a MultiBrush, call before the part is hidden or its
+           material is changed.
+   */
+   void _removePart(MultiBrush*, size_t part);
+   
+   /*! function. _brushChanged
+       desc.
+           Mark the Brush's GeometryRenderable to be redrawn, moving the Brush into
+           another one if it has changed cell or material.
+   */
+   void _brushChanged(Brush*);
+   
    void loadFromOokFile(const Ogre::String& filename, const Ogre::String& resourceGroup = Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME);
    
    void saveAsOokFile(const Ogre::String& filename);
@@ -399,21 +1862,241 @@ namespace Orangutan
    
   ~Geometry();
    
-   /// mSubRenderables -- All SubRenderables organised by material index.
+   typedef std::map<GeometryCell::Key, GeometryCell*> GeometryCells;
+   
+   /*! function. _refreshBlock
+       desc.
+           Redraw a Block whose faces have been hidden or shown.
+   */
+   void _refreshBlock(Block*);
+   
+   /*! function. _regroupBlocks
+       desc.
+           Throw away every BlockInstances and add each Block again.
+   */
+   void _regroupBlocks();
+   
+   /*! function. _getOrCreateInstances
+       desc.
+           BlockInstances of a material and faces in a cell.
+   */
+   BlockInstances* _getOrCreateInstances(GeometryCell*, size_t index, size_t faces);
+   
+   /*! function. _addToRenderQueue
+   */
+   void _addToRenderQueue(Ogre::RenderQueue* queue, Ogre::Renderable* renderable, const Ogre::AxisAlignedBox& bounds, bool cull);
+   
+   /*! function. _getMaterialName
+       desc.
+           Material name and group of a material index, the default material if it hasn't been set.
+   */
+   const MaterialName& _getMaterialName(size_t index);
+   
+   /*! function. _destroyCells
+   */
+   void _destroyCells();
+   
+   /// BlockFace -- A face of a Block.
+   typedef std::pair<Block*, size_t> BlockFace;
+   
+   typedef std::map<GeometryCell::Key, std::vector<BlockFace> > FaceCells;
+   
+   /*! function. _getFaceCell
+       desc.
+           Cell of the face grid a point is in.
+   */
+   GeometryCell::Key _getFaceCell(const Ogre::Vector3& point) const;
+   
+   /*! function. _registerFaces
+       desc.
+           Put the faces of a Block into every cell of the face grid they touch.
+   */
+   void _registerFaces(Block*);
+   
+   /*! function. _unregisterFaces
+       desc.
+           Take the faces of a Block out of the face grid, adding the Blocks that
+           shared a cell with them to neighbours.
+   */
+   void _unregisterFaces(Block*, std::vector<Block*>& neighbours);
+   
+   /*! function. _findHiddenFaces
+       desc.
+           Work out which faces of a Block are covered. Returns true if any have changed.
+   */
+   bool _findHiddenFaces(Block*);
+   
+   /*! function. _updateDrawnGeometries
+       desc.
+           Merge the AABBs of the GeometryRenderables and list the ones that aren't empty.
+           Changed BlockInstances are uploaded.
+   */
+   void _updateDrawnGeometries();
+   
+   /*! function. _verticesUploaded
+       desc.
+           Let Displacements that don't keep their vertices free them, now that they have
+           been uploaded; called on the main thread after every redraw.
+   */
+   void _verticesUploaded();
+   
+   /*! function. _updateLod
+       desc.
+           Choose the detail of each Displacement patch, once a frame. Nothing changes while
+           a background redraw is running; it is tried again on the next call.
+   */
+   void _updateLod();
+   
+   /*! function. _startAsyncRedraw
+       desc.
+           Lay out the changed GeometryRenderables and start drawing them in the background.
+   */
+   void _startAsyncRedraw();
+   
+   /*! function. _finishAsyncRedraw
+       desc.
+           Upload a finished background redraw.
+   */
+   void _finishAsyncRedraw();
+   
+   /*! function. _isAsyncFinished
+   */
+   bool _isAsyncFinished() const;
+   
+   /*! function. _redrawVisible
+       desc.
+           Record that the edits up to version can be seen, and tell the Listener.
+   */
+   void _redrawVisible(unsigned long version);
+   
+   /*! class. BackgroundRedraw
+       desc.
+           Task drawing the GeometryRenderables of a background redraw into their back buffers.
+   */
+   class BackgroundRedraw : public TaskScheduler::Task
+   {
+    public:
+     
+     BackgroundRedraw() : mGeometry(0) {}
+     
+     void execute();
+     
+     Geometry*  mGeometry;
+   };
+   
+   /// mGeometries -- All GeometryRenderables of every cell.
    GeometryRenderables  mGeometries;
    
+   /// mDrawnGeometries -- GeometryRenderables that aren't empty, updated by _renderVertices.
+   GeometryRenderables  mDrawnGeometries;
+   
+   /// mCells -- Cells by position in the grid.
+   GeometryCells  mCells;
+   
+   /// mCellSize -- Size of each cell, or 0 for a single cell.
+   Ogre::Real  mCellSize;
+   
+   /// mMaterials -- Material name and group of each material index.
+   MaterialNames  mMaterials;
+   
+   /// mCamera -- Camera currently being rendered to.
+   Ogre::Camera*  mCamera;
+   
+   /// mLodCamera -- Camera the Displacement patch detail is chosen from, or 0 for the first each frame.
+   Ogre::Camera*  mLodCamera;
+   
+   /// mLodFrame -- Frame number the patch detail was last chosen in.
+   unsigned long  mLodFrame;
+   
+   /// mTaskScheduler -- Runs parallel redraws, or 0.
+   TaskScheduler*  mTaskScheduler;
+   
+   /// mTasks -- GeometryRenderables being redrawn in parallel.
+   std::vector<TaskScheduler::Task*>  mTasks;
+   
+   /// mAsync -- If redraws are done in the background.
+   bool  mAsync;
+   
+   /// mAsyncRunning -- If a background redraw has been started and not uploaded yet.
+   bool  mAsyncRunning;
+   
+   /// mAsyncFinished -- If the background redraw has finished drawing, guarded by mAsyncMutex.
+   bool  mAsyncFinished;
+   
+   OGRE_MUTEX(mAsyncMutex)
+   
+   /// mBackgroundRedraw -- Task of the background redraw.
+   BackgroundRedraw  mBackgroundRedraw;
+   
+   /// mAsyncGeometries -- GeometryRenderables being redrawn in the background.
+   GeometryRenderables  mAsyncGeometries;
+   
+   /// mEditVersion -- Edits made so far.
+   unsigned long  mEditVersion;
+   
+   /// mAsyncVersion -- Edit version being redrawn in the background.
+   unsigned long  mAsyncVersion;
+   
+   /// mVisibleVersion -- Edit version of the last redraw uploaded.
+   unsigned long  mVisibleVersion;
+   
+   /// mListener -- Told when redraws are uploaded, or 0.
+   Listener*  mListener;
+   
+   /// mBlockInstancing -- How Blocks are drawn.
+   BlockInstancing  mBlockInstancing;
+   
+   /// mInstancedMaterials -- Material name and group of each material index for hardware instancing.
+   MaterialNames  mInstancedMaterials;
+   
+   /// mBlockInstances -- All BlockInstances of every cell.
+   std::vector<BlockInstances*>  mBlockInstances;
+   
+   /// mVertexCacheOptimisation -- If Brushes are welded and reordered for the vertex cache.
+   bool  mVertexCacheOptimisation;
+   
+   /// mQuadMerging -- If quads side by side are merged into larger ones.
+   bool  mQuadMerging;
+   
+   /// mHiddenFaceRemoval -- If covered faces of Blocks are left out.
+   bool  mHiddenFaceRemoval;
+   
+   /// mFaceGridSize -- Size of each cell of mFaceCells.
+   Ogre::Real  mFaceGridSize;
+   
+   /// mFaceCells -- Faces of Blocks by the cells of the face grid they touch.
+   FaceCells  mFaceCells;
+   
+   /// mUpdateDepth -- Number of beginUpdate calls without an endUpdate.
+   size_t  mUpdateDepth;
+   
+   /// mPendingBrushes -- Brushes changed since beginUpdate.
+   std::vector<Brush*>  mPendingBrushes;
+   
+   /// mPendingMultiBrushes -- MultiBrushes changed since beginUpdate.
+   std::vector<MultiBrush*>  mPendingMultiBrushes;
+   
    /// mPlanes -- Master copy of all Planes.
-   std::vector<Plane*>  mPlanes;
+   slots<Plane>  mPlanes;
    
    /// mPlanes -- Master copy of all Displacements.
-   std::vector<Displacement*>  mDisplacements;
+   slots<Displacement>  mDisplacements;
    
    /// mBlocks -- Master copy of all Blocks.
-   std::vector<Block*>  mBlocks;
+   slots<Block>  mBlocks;
 
    /// mRedrawNeeded -- One of the Geometry renderables need a redraw
    bool mRedrawNeeded;
    
+   /// mVertexFormat -- Layout of the vertices in all renderables.
+   VertexFormat mVertexFormat;
+   
+   /// mUsageHint -- How the vertex and index buffers are used.
+   UsageHint mUsageHint;
+   
+   /// mStats -- Redraws of the Geometry as a whole.
+   Statistics mStats;
+   
    Ogre::AxisAlignedBox mAABB;
  };
  
@@ -422,15 +2105,111 @@ namespace Orangutan
    
   public:
    
-   Brush(Geometry* geom, size_t index) : mGeometry(geom), mIndex(index) {}
+   friend class Geometry;
+   
+   friend class GeometryRenderable;
+   
+   Brush(Geometry* geom, size_t index) : mGeometry(geom), mIndex(index), mRevision(0), mDrawnRevision(0), mChangedRevision(0), mChangedFirst(0), mChangedEnd(0), mRenderable(0), mRenderableSlot(0), mUpdatePending(false) {}
    
    virtual ~Brush() {}
 
    size_t getIndex() const { return mIndex; }
+   
+   /*! function. getHandle
+   */
+   const Handle& getHandle() const { return mHandle; }
 
-   virtual void _render(buffer<Vertex>&, buffer<Index>&) {}
+   /*! function. getRevision
+       desc.
+           Number of times this Brush has changed.
+   */
+   size_t getRevision() const { return mRevision; }
+
+   /*! function. _getVertexCount
+       desc.
+           Number of vertices _render will write.
+   */
+   virtual size_t _getVertexCount() const { return 0; }
+   
+   /*! function. _getIndexCount
+       desc.
+           Number of indexes _render will write.
+   */
+   virtual size_t _getIndexCount() const { return 0; }
+   
+   /*! function. _render
+       desc.
+           Write the vertices and indexes into (locked) memory. Indexes are offset
+           by base, which is the position of the first vertex in the vertex buffer.
+           There is one for each width of index buffer.
+   */
+   virtual void _render(VertexWriter& vertices, Index16* indexes, size_t base) {}
+   
+   virtual void _render(VertexWriter& vertices, Index32* indexes, size_t base) {}
+   
+   /*! function. _renderVertices
+       desc.
+           Write only vertices first to first + count - 1, see _getChangedVertices.
+   */
+   virtual void _renderVertices(VertexWriter& vertices, size_t first, size_t count) {}
+   
+   /*! function. _getChangedVertices
+       desc.
+           If only vertices first to first + count - 1 have changed since revision, and none
+           of the indexes, so only they need to be uploaded.
+   */
+   bool _getChangedVertices(size_t revision, size_t& first, size_t& count) const
+   {
+    if (mChangedFirst >= mChangedEnd || revision < mChangedRevision)
+     return false;
+    first = mChangedFirst;
+    count = mChangedEnd - mChangedFirst;
+    return true;
+   }
+   
+   /*! function. _getQuad
+       desc.
+           If the Brush is drawn as a single quad (laid out as Quad::mVertices) then its four
+           vertices, so it may be merged with others, otherwise 0.
+   */
+   virtual const Vertex* _getQuad() const { return 0; }
+   
+   /*! function. _trimMemory
+       desc.
+           Release any spare memory held by the Brush.
+   */
+   virtual void _trimMemory() {}
+   
+   /*! function. _updateRequired
+       desc.
+           Regenerate the vertices and indexes after a change, and redraw. Between
+           Geometry::beginUpdate and endUpdate this is deferred until endUpdate.
+   */
+   virtual void _updateRequired() {}
    
-   void redrawNeeded() { mGeometry->redrawNeeded(mIndex); }
+   void redrawNeeded() { mRevision++; mChangedFirst = mChangedEnd = 0; mGeometry->_brushChanged(this); }
+   
+   /*! function. verticesChanged
+       desc.
+           Redraw, when only vertices first to first + count - 1 have changed. The range
+           grows until the Brush has been drawn again.
+   */
+   void verticesChanged(size_t first, size_t count)
+   {
+    if (mDrawnRevision == mRevision)
+    {
+     mChangedRevision = mRevision;
+     mChangedFirst = first;
+     mChangedEnd = first + count;
+    }
+    else if (mChangedFirst < mChangedEnd && mChangedRevision <= mDrawnRevision)
+    {
+     mChangedFirst = std::min(mChangedFirst, first);
+     mChangedEnd = std::max(mChangedEnd, first + count);
+    }
+    mRevision++;
+    mGeometry->_brushChanged(this);
+   }
    
    inline const Ogre::AxisAlignedBox& getAABB() const { return mAABB; }
    
@@ -440,29 +2219,105 @@ namespace Orangutan
    
    Geometry*            mGeometry;
    size_t               mIndex;
+   size_t               mRevision;
+   // Revision in the GeometryRenderable, and the vertices changed since mChangedRevision.
+   size_t               mDrawnRevision;
+   size_t               mChangedRevision, mChangedFirst, mChangedEnd;
+   GeometryRenderable*  mRenderable;
+   size_t               mRenderableSlot;
+   Handle               mHandle;
+   bool                 mUpdatePending;
    Ogre::Matrix4        mTransform;
    Ogre::AxisAlignedBox mAABB;
    
- };
- 
- class MultiBrush
- {
+ };
+ 
+ class MultiBrush
+ {
+   
+  public:
+   
+   friend class Geometry;
+   
+   friend class GeometryRenderable;
+   
+   MultiBrush(Geometry* geom) : mGeometry(geom), mRevision(0), mCell(0), mUpdatePending(false) {}
+   
+   virtual ~MultiBrush() {}
+
+   /*! function. getRevision
+       desc.
+           Number of times this MultiBrush has changed.
+   */
+   size_t getRevision() const { return mRevision; }
+
+   /*! function. getHandle
+   */
+   const Handle& getHandle() const { return mHandle; }
+
+   /*! function. _getPartCount
+       desc.
+           Number of parts, each of which may have its own material. The faces of a Block.
+   */
+   virtual size_t _getPartCount() const { return 0; }
+   
+   /*! function. _hasPart
+       desc.
+           If a part is drawn at all.
+   */
+   virtual bool _hasPart(size_t part) const { return false; }
+   
+   /*! function. _getPartIndex
+       desc.
+           Material index of a part.
+   */
+   virtual size_t _getPartIndex(size_t part) const { return 0; }
+   
+   virtual size_t _getVertexCount(size_t part) const { return 0; }
+   
+   virtual size_t _getIndexCount(size_t part) const { return 0; }
    
-  public:
+   virtual void _render(VertexWriter& vertices, Index16* indexes, size_t base, size_t part) {}
    
-   MultiBrush(Geometry* geom) : mGeometry(geom) {}
+   virtual void _render(VertexWriter& vertices, Index32* indexes, size_t base, size_t part) {}
    
-   virtual ~MultiBrush() {}
-
-   virtual void _render(buffer<Vertex>&, buffer<Index>&, size_t materialIndex) {}
+   /*! function. _getQuad
+       desc.
+           Four vertices of a part drawn as a single quad, as Brush::_getQuad.
+   */
+   virtual const Vertex* _getQuad(size_t part) const { return 0; }
+   
+   /*! function. _updateRequired
+       desc.
+           Regenerate the vertices and indexes after a change, and redraw. Between
+           Geometry::beginUpdate and endUpdate this is deferred until endUpdate.
+   */
+   virtual void _updateRequired() {}
    
-   void redrawNeeded(size_t index) { mGeometry->redrawNeeded(index); }
+   /*! function. redrawNeeded
+       desc.
+           Redraw the GeometryRenderables of each material used by the parts.
+   */
+   void redrawNeeded()
+   {
+    mRevision++;
+    if (mCell == 0)
+     return;
+    for (size_t i=0;i < _getPartCount();i++)
+     if (_hasPart(i))
+      mGeometry->redrawNeeded(mGeometry->getOrCreateRenderable(mCell, _getPartIndex(i)));
+   }
    
    inline const Ogre::AxisAlignedBox& getAABB() const { return mAABB; }
    
   protected:
    
    Geometry*            mGeometry;
+   size_t               mRevision;
+   GeometryCell*        mCell;
+   std::vector<size_t>  mPartSlots;
+   Handle               mHandle;
+   bool                 mUpdatePending;
    Ogre::Matrix4        mTransform;
    Ogre::AxisAlignedBox mAABB;
    
@@ -477,7 +2332,7 @@ namespace Orangutan
     
    ~Quad() {}
     
-    void _render(buffer<Vertex>&, buffer<Index>&);
+    template<typename IndexType> void _render(VertexWriter& vertices, IndexType* indexes, size_t base);
     
     void _update();
     
@@ -527,10 +2382,20 @@ namespace Orangutan
     
   ~Plane() {delete mQuad;}
    
-   void _render(buffer<Vertex>&, buffer<Index>&);
+   size_t _getVertexCount() const { return 4; }
+   
+   size_t _getIndexCount() const { return 6; }
+   
+   void _render(VertexWriter& vertices, Index16* indexes, size_t base);
+   
+   void _render(VertexWriter& vertices, Index32* indexes, size_t base);
+   
+   const Vertex* _getQuad() const { return mQuad->mVertices; }
    
    void _updateRequired()
    {
+    if (mGeometry->_deferUpdate(this))
+     return;
     mAABB.setNull();
     mQuad->_update();
     redrawNeeded();
@@ -550,6 +2415,27 @@ namespace Orangutan
     
  };
  
+ /*! enum. HeightFormat
+     desc.
+         How a Displacement keeps its heights, see Displacement::setStorage.
+ */
+ enum HeightFormat
+ {
+  HeightFormat_Float,  // 4 bytes a sample.
+  HeightFormat_Short   // 2 bytes a sample, in 65536 steps between the lowest and highest height.
+ };
+ 
+ /*! enum. ColourFormat
+     desc.
+         How a Displacement keeps its colours, see Displacement::setStorage. Either way
+         nothing is kept when every colour is white.
+ */
+ enum ColourFormat
+ {
+  ColourFormat_Float,  // Ogre::ColourValue, 16 bytes a sample.
+  ColourFormat_RGBA8   // 4 bytes a sample.
+ };
+ 
  /* class. Displacement
     desc.
         A heightfield made up of "samples" which are various points on the heightfield
@@ -566,57 +2452,164 @@ namespace Orangutan
    
    void saveToOok(std::ofstream& stream);
    
-   void _render(buffer<Vertex>&, buffer<Index>&);
+   size_t _getVertexCount() const { return mVertexCount; }
    
+   size_t _getIndexCount() const { return mPatchIndexCount; }
+   
+   void _render(VertexWriter& vertices, Index16* indexes, size_t base);
+   
+   void _render(VertexWriter& vertices, Index32* indexes, size_t base);
+   
+   void _renderVertices(VertexWriter& vertices, size_t first, size_t count);
+   
+   /*! function. _updateRequired
+       desc.
+           Regenerate the vertices and indexes, or if only some samples have changed since
+           then just their vertices.
+   */
    void _updateRequired();
    
+   void _trimMemory();
+   
+   /*! function. _verticesUploaded
+       desc.
+           Free the vertices once they have been uploaded if they aren't kept, see setStorage.
+           The redraw reads them on other threads, so this is only done from the Geometry.
+   */
+   void _verticesUploaded();
+   
+   /*! function. setLod
+       desc.
+           Split the displacement into patches of patchSize x patchSize quads, each drawn
+           with fewer triangles the further it is from the camera. A patch closer than
+           lodDistance is drawn in full, then every doubling of the distance halves the
+           detail. Edges next to a patch with less detail are stitched to it, so there are
+           no cracks. A patchSize of 0 turns it off.
+       note.
+           Every vertex is still drawn, only the number of triangles changes.
+   */
+   void setLod(size_t patchSize, Ogre::Real lodDistance);
+   
+   /*! function. getLodPatchSize
+   */
+   size_t getLodPatchSize() const { return mPatchSize; }
+   
+   /*! function. getLodDistance
+   */
+   Ogre::Real getLodDistance() const { return mLodDistance; }
+   
+   /*! function. _updateLod
+       desc.
+           Choose the detail of each patch from where the camera is, in Geometry space. The
+           Displacement is redrawn if any have changed. It mustn't be called while a
+           background redraw is running, as that reads the patterns.
+   */
+   void _updateLod(const Ogre::Vector3& camera);
+   
+   /*! function. setStorage
+       desc.
+            How the samples are kept; see HeightFormat and ColourFormat. Without
+            keepVertices the vertices are thrown away once they have been drawn, and are
+            worked out again from the samples when they are next needed.
+       note.
+            Short heights are quantised between the lowest and highest heights; setting a
+            height outside of them quantises every height again. A Displacement without
+            kept vertices is fully updated on each edit, so it suits terrain that is
+            rarely changed.
+   */
+   void setStorage(HeightFormat heightFormat, ColourFormat colourFormat, bool keepVertices = true);
+   
+   /*! function. getHeightFormat
+   */
+   HeightFormat getHeightFormat() const { return mHeightFormat; }
+   
+   /*! function. getColourFormat
+   */
+   ColourFormat getColourFormat() const { return mColourFormat; }
+   
+   /*! function. getKeepVertices
+   */
+   bool getKeepVertices() const { return mKeepVertices; }
+   
+   /*! function. hasColours
+       desc.
+            If any colours are kept, i.e. not every sample is white.
+   */
+   bool hasColours() const { return mColours.size() != 0 || mPackedColours.size() != 0; }
+   
+   /*! function. getMemoryUsage
+       desc.
+            Bytes allocated for the samples and vertices.
+   */
+   size_t getMemoryUsage() const;
+   
+   /*! struct. RayHit
+       desc.
+            Where a ray hit a Displacement, see raycast. sampleX and sampleY are of the
+            nearest sample, position is in world space and distance is along the ray.
+   */
+   struct RayHit
+   {
+    RayHit() : hit(false), sampleX(0), sampleY(0), distance(0) {}
+    bool           hit;
+    size_t         sampleX, sampleY;
+    Ogre::Vector3  position;
+    Ogre::Real     distance;
+   };
+   
+   /*! function. raycast
+       desc.
+            Find the closest point a world space ray hits the displacement, going through
+            a min/max quadtree of the heights so only the triangles near the ray are tested.
+       note.
+            The full detail grid is tested, whatever LOD it is drawn with.
+   */
+   RayHit raycast(const Ogre::Ray& ray);
+   
+   /*! function. getHeightAt
+       desc.
+            Height of the displacement at a world space position, interpolated between the
+            four samples around it. Returns false if the position is outside of the grid.
+       note.
+            The height is in world space, directly above or below position along the
+            displacement's own up axis.
+   */
+   bool getHeightAt(const Ogre::Vector3& position, Ogre::Real& height);
+   
    /*! function. setHeight
        desc.
             Set a height directly.
        note.
-            If your setting heights in bulk, use the begin/sample/end functions as each call of
-            this will redraw the displacement. begin/sample/end will only redraw at the end
-            of defining the terrain.
+            If your setting heights in bulk, use setHeights/setColours or the begin/sample/end
+            functions as each call of this will redraw the displacement. They only redraw
+            once, after all of the samples have been set.
    */
    void setHeight(size_t x, size_t y, float height)
    {
-    if (x > mLengthX || y > mLengthY)
-     return;
-    mHeights[x + (y * mLengthX)] = height;
-    _updateRequired();
+    setHeights(&height, 1, x, y, x + 1, y + 1);
    }
    
    /*! function. setHeight
        desc.
             Set a height directly.
        note.
-            If your setting heights in bulk, use the begin/sample/end functions as each call of
-            this will redraw the displacement. begin/sample/end will only redraw at the end
-            of defining the terrain.
+            If your setting heights in bulk, use setHeights/setColours or the begin/sample/end
+            functions as each call of this will redraw the displacement. They only redraw
+            once, after all of the samples have been set.
    */
-   void setHeight(size_t x, size_t y, float height, const Ogre::ColourValue& colour)
-   {
-    if (x > mLengthX || y > mLengthY)
-     return;
-    mHeights[x + (y * mLengthX)] = height;
-    mColours[x + (y * mLengthX)] = colour;
-    _updateRequired();
-   }
+   void setHeight(size_t x, size_t y, float height, const Ogre::ColourValue& colour);
    
    /*! function. setColour
        desc.
             Set a colour directly.
        note.
-            If your setting heights in bulk, use the begin/sample/end functions as each call of
-            this will redraw the displacement. begin/sample/end will only redraw at the end
-            of defining the terrain.
+            If your setting heights in bulk, use setHeights/setColours or the begin/sample/end
+            functions as each call of this will redraw the displacement. They only redraw
+            once, after all of the samples have been set.
    */
    void setColour(size_t x, size_t y, const Ogre::ColourValue& colour)
    {
-    if (x > mLengthX || y > mLengthY)
-     return;
-    mColours[x + (y * mLengthX)] = colour;
-    _updateRequired();
+    setColours(&colour, 1, x, y, x + 1, y + 1);
    }
    
    /*! function. getHeight
@@ -625,9 +2618,9 @@ namespace Orangutan
    */
    float getHeight(size_t x, size_t y) const
    {
-    if (x > mLengthX || y > mLengthY)
+    if (x >= mLengthX || y >= mLengthY || _hasSamples() == false)
      return 0.0f;
-    return mHeights[x + (y * mLengthX)];
+    return _getHeight(x + (y * mLengthX));
    }
    
    /*! function. getColour
@@ -636,36 +2629,97 @@ namespace Orangutan
    */
    Ogre::ColourValue getColour(size_t x, size_t y) const
    {
-    if (x > mLengthX || y > mLengthY)
+    if (x >= mLengthX || y >= mLengthY)
      return Ogre::ColourValue::White;
-    return mColours[x + (y * mLengthX)];
+    return _getColour(x + (y * mLengthX));
    }
    
    /*! function. getHeights
        desc.
             Get all heights.
    */
-   void getHeights(buffer<float>& copy_to)
-   {
-    copy_to.remove_all();
-    for (size_t i=0;i < mHeights.size();i++)
-    {
-     copy_to.push_back(mHeights[i]);
-    }
-   }
+   void getHeights(buffer<float>& copy_to) const;
    
    /*! desc. getColours
             Get all colours.
    */
-   void getColours(buffer<Ogre::ColourValue>& copy_to)
+   void getColours(buffer<Ogre::ColourValue>& copy_to) const;
+   
+   /*! function. getHeightsView
+       desc.
+            All heights, row by row, without copying them. The view is only valid until
+            the heights are next changed, and is empty unless they are HeightFormat_Float.
+   */
+   view<float> getHeightsView() const
    {
-    copy_to.remove_all();
-    for (size_t i=0;i < mColours.size();i++)
-    {
-     copy_to.push_back(mColours[i]);
-    }
+    return view<float>(mHeights.first(), mHeights.size());
    }
-
+   
+   /*! function. getColoursView
+       desc.
+            All colours, row by row, without copying them. The view is only valid until
+            the colours are next changed, and is empty unless they are ColourFormat_Float
+            and not all white.
+   */
+   view<Ogre::ColourValue> getColoursView() const
+   {
+    return view<Ogre::ColourValue>(mColours.first(), mColours.size());
+   }
+   
+   /*! function. setHeights
+       desc.
+            Copy a rectangle of heights, from x0,y0 up to (but not including) x1,y1, then
+            redraw once.
+       args.
+            heights -- Height of x0,y0; the rest of the rectangle follows row by row.
+            stride -- Number of floats from the start of one row of heights to the next.
+   */
+   void setHeights(const float* heights, size_t stride, size_t x0, size_t y0, size_t x1, size_t y1);
+   
+   /*! function. setHeights
+       desc.
+            Copy every height, row by row, then redraw once.
+   */
+   void setHeights(const float* heights)
+   {
+    setHeights(heights, mLengthX, 0, 0, mLengthX, mLengthY);
+   }
+   
+   /*! function. setColours
+       desc.
+            Copy a rectangle of colours, from x0,y0 up to (but not including) x1,y1, then
+            redraw once.
+       args.
+            colours -- Colour of x0,y0; the rest of the rectangle follows row by row.
+            stride -- Number of colours from the start of one row of colours to the next.
+   */
+   void setColours(const Ogre::ColourValue* colours, size_t stride, size_t x0, size_t y0, size_t x1, size_t y1);
+   
+   /*! function. setColours
+       desc.
+            Copy every colour, row by row, then redraw once.
+   */
+   void setColours(const Ogre::ColourValue* colours)
+   {
+    setColours(colours, mLengthX, 0, 0, mLengthX, mLengthY);
+   }
+   
+   /*! function. swapHeights
+       desc.
+            Take the heights from a buffer without copying them, and give the current ones
+            back in it; then redraw once. The buffer must hold exactly lengthX * lengthY
+            heights, otherwise nothing happens.
+       note.
+            With HeightFormat_Short the heights are converted, so they are copied after all.
+   */
+   void swapHeights(buffer<float>& heights);
+   
+   /*! function. swapColours
+       desc.
+            As swapHeights, but for the colours; they are only swapped without a copy when
+            ColourFormat_Float.
+   */
+   void swapColours(buffer<Ogre::ColourValue>& colours);
 
    /*! desc. begin
              Start (or restart) describing the displacement.
@@ -675,31 +2729,53 @@ namespace Orangutan
    */
    void begin(size_t lengthX, size_t lengthY)
    {
+    // The samples and size are about to change, so they can't still be being drawn.
+    mGeometry->waitForRedraw();
+    mTreeBuilt = false;
     mHeights.remove_all();
+    mShortHeights.destroy();
+    mColours.remove_all();
+    mPackedColours.destroy();
     mLengthX = lengthX;
     mLengthY = lengthY;
     mDescribing = true;
    }
 
+   /*! desc. sample
+            Add the next height. Samples are kept as floats until end, then converted to
+            the HeightFormat and ColourFormat.
+   */
    void sample(float height)
    {
     if (!mDescribing)
      return;
+    mGeometry->waitForRedraw();
     mHeights.push_back(height);
-    mColours.push_back(Ogre::ColourValue::White);
+    if (mColours.size())
+     mColours.push_back(Ogre::ColourValue::White);
    }
    
    void sample(float height, const Ogre::ColourValue& colour)
    {
     if (!mDescribing)
      return;
+    mGeometry->waitForRedraw();
+    
+    // Until a sample isn't white, there is no need for any colours.
+    if (mColours.size() == 0 && colour != Ogre::ColourValue::White)
+     for (size_t i=0;i < mHeights.size();i++)
+      mColours.push_back(Ogre::ColourValue::White);
+    
     mHeights.push_back(height);
-    mColours.push_back(colour);
+    if (mColours.size())
+     mColours.push_back(colour);
    }
 
    void end()
    {
     
+    mGeometry->waitForRedraw();
+    
     if (mHeights.size() < (mLengthX * mLengthY))
     {
      size_t diff = (mLengthX * mLengthY) - mHeights.size();
@@ -707,14 +2783,27 @@ namespace Orangutan
       mHeights.push_back(0.0f);
     }
     
+    if (mColours.size())
+     while (mColours.size() < mHeights.size())
+      mColours.push_back(Ogre::ColourValue::White);
+    
     mDescribing = false;
+    _convertStorage();
+    mFullUpdate = true;
     _updateRequired();
    }
    
   protected:
    
    buffer<float>               mHeights;
+   buffer<Ogre::uint16>       mShortHeights;
+   float                      mHeightScale, mHeightOffset;
    buffer<Ogre::ColourValue>  mColours;
+   buffer<Ogre::RGBA>         mPackedColours;
+   HeightFormat               mHeightFormat;
+   ColourFormat               mColourFormat;
+   bool                       mKeepVertices;
+   size_t                     mVertexCount;
    Ogre::uint                 mLengthX, mLengthY;
    Ogre::Vector3              mPosition;
    Ogre::Vector3              mScale;
@@ -724,8 +2813,179 @@ namespace Orangutan
    Ogre::Radian               mTextureAngle;
    bool                       mTextureFlipX, mTextureFlipY;
    buffer<Vertex>             mVertices;
-   buffer<Index>              mIndexes;
+   // Without kept vertices, the rows of changed vertices from mChangedRowsZ0 not yet uploaded.
+   buffer<Vertex>             mChangedRows;
+   size_t                     mChangedRowsZ0;
    bool                       mDescribing;
+   
+   /*! struct. Patch
+       desc.
+           Part of the grid drawn with its own detail; x, z and the lengths are in quads.
+           Without LOD the whole grid is one Patch. Its indexes are a pattern shared by
+           every Displacement, see acquireIndexPattern; pattern is 0 until one is picked.
+   */
+   struct Patch
+   {
+    size_t                    x, z, lengthX, lengthZ;
+    size_t                    lod, maxLod;
+    Ogre::Vector3             centre;
+    IndexPattern*             pattern;
+   };
+   
+   // Samples changed since the last update, from mDirtyX0, mDirtyZ0 to before mDirtyX1, mDirtyZ1.
+   size_t                     mDirtyX0, mDirtyZ0, mDirtyX1, mDirtyZ1;
+   // If everything has to be regenerated on the next update.
+   bool                       mFullUpdate;
+   
+   std::vector<Patch>         mPatches;
+   size_t                     mPatchesX, mPatchesZ;
+   size_t                     mPatchSize;
+   size_t                     mPatchIndexCount;
+   Ogre::Real                 mLodDistance;
+   
+   /*! struct. TreeLevel
+       desc.
+           Nodes of one level of the quadtree, starting at mTree[first * 2]. A leaf covers
+           TREE_LEAF x TREE_LEAF quads, and each level up covers twice as many each way.
+   */
+   struct TreeLevel
+   {
+    size_t                    first, nodesX, nodesZ;
+   };
+   
+   static const size_t        TREE_LEAF = 4;
+   
+   // Lowest then highest height of each node, from the leaves up to the root.
+   buffer<float>              mTree;
+   std::vector<TreeLevel>     mTreeLevels;
+   bool                       mTreeBuilt;
+   
+   template<typename IndexType> void _renderTo(VertexWriter& vertices, IndexType* indexes, size_t base);
+   
+   /*! function. _samplesChanged
+       desc.
+           Add samples x0, z0 to before x1, z1 to the dirty rectangle and update.
+   */
+   void _samplesChanged(size_t x0, size_t z0, size_t x1, size_t z1);
+   
+   /*! function. _updateVertices
+       desc.
+           Work out the vertices of samples x0, z0 to before x1, z1 and merge them into aabb.
+           vertices are whole rows, starting at row z0.
+   */
+   void _updateVertices(Vertex* vertices, size_t x0, size_t z0, size_t x1, size_t z1, Ogre::AxisAlignedBox& aabb);
+   
+   /*! function. _updateChangedRows
+       desc.
+           Without kept vertices, work out the vertices of samples x0, z0 to before x1, z1
+           into mChangedRows, with the rest of their rows, ready to be uploaded.
+   */
+   void _updateChangedRows(size_t x0, size_t z0, size_t x1, size_t z1);
+   
+   /*! function. _getVertices
+       desc.
+           The vertices, or if they haven't been kept work them out again into scratch.
+   */
+   const Vertex* _getVertices(buffer<Vertex>& scratch);
+   
+   /*! function. _hasSamples
+       desc.
+           If there is a height for every sample of the grid.
+   */
+   bool _hasSamples() const
+   {
+    size_t count = mHeightFormat == HeightFormat_Float ? mHeights.size() : mShortHeights.size();
+    return count == mLengthX * mLengthY;
+   }
+   
+   /*! function. _getHeight
+       desc.
+           Height of sample i, in whichever form it is kept.
+   */
+   float _getHeight(size_t i) const
+   {
+    if (mHeightFormat == HeightFormat_Float)
+     return mHeights[i];
+    return float(mShortHeights[i]) * mHeightScale + mHeightOffset;
+   }
+   
+   /*! function. _getColour
+       desc.
+           Colour of sample i, in whichever form it is kept.
+   */
+   Ogre::ColourValue _getColour(size_t i) const;
+   
+   /*! function. _storeHeights
+       desc.
+           Copy a rectangle of heights into the HeightFormat, quantising every height again
+           if any are out of range (or all of them if the rectangle is the whole grid).
+   */
+   void _storeHeights(const float* heights, size_t stride, size_t x0, size_t z0, size_t x1, size_t z1);
+   
+   /*! function. _storeColours
+       desc.
+           Copy a rectangle of colours into the ColourFormat, adding the colours if there
+           weren't any and a colour isn't white.
+   */
+   void _storeColours(const Ogre::ColourValue* colours, size_t stride, size_t x0, size_t z0, size_t x1, size_t z1);
+   
+   /*! function. _quantise
+       desc.
+           Quantise the heights between lowest and highest, converting any Short heights
+           already kept; they all move a little, so the next update is a full one.
+   */
+   void _quantise(float lowest, float highest);
+   
+   /*! function. _buildTree
+       desc.
+           Lay out the quadtree for the size of the grid and work out every node.
+   */
+   void _buildTree();
+   
+   /*! function. _updateTree
+       desc.
+           Work out the nodes over samples x0, z0 to before x1, z1 again, from the leaves up.
+   */
+   void _updateTree(size_t x0, size_t z0, size_t x1, size_t z1);
+   
+   /*! function. _raycastNode
+       desc.
+           Test a ray, in grid space, against a node and then its children nearest first;
+           or the triangles of a leaf. hit is kept if it is closer.
+   */
+   void _raycastNode(size_t level, size_t nodeX, size_t nodeZ, const Ogre::Ray& ray, RayHit& hit);
+   
+   /*! function. _getGridTransform
+       desc.
+           From grid space, where sample x, z is at (x, height, z), to world space.
+   */
+   Ogre::Matrix4 _getGridTransform() const;
+   
+   /*! function. _convertStorage
+       desc.
+           Convert the samples to the HeightFormat and ColourFormat, and throw away the
+           colours if they are all white.
+   */
+   void _convertStorage();
+   
+   /*! function. _layoutPatches
+       desc.
+           Split the grid into patches, keeping their detail if the grid is the same size,
+           or make it one patch if LOD is off.
+   */
+   void _layoutPatches();
+   
+   /*! function. _assignPatterns
+       desc.
+           Pick the index pattern of each patch from its detail and its neighbours'.
+   */
+   void _assignPatterns();
+   
+   /*! function. _releasePatterns
+       desc.
+           Let go of the index pattern of each patch, before the patches are changed.
+   */
+   void _releasePatterns();
  };
  
 class Block : public MultiBrush, public Ogre::GeneralAllocatedObject
@@ -733,6 +2993,10 @@ class Block : public MultiBrush, public Ogre::GeneralAllocatedObject
   
  public:
    
+   friend class Geometry;
+   
+   friend class BlockInstances;
+   
    enum QuadID
    {
     Quad_Top,
@@ -747,37 +3011,128 @@ class Block : public MultiBrush, public Ogre::GeneralAllocatedObject
    
   ~Block();
    
-   void _render(buffer<Vertex>&, buffer<Index>&, size_t index);
+   size_t _getPartCount() const { return 6; }
+   
+   bool _hasPart(size_t part) const { return mHasQuads[part]; }
+   
+   size_t _getPartIndex(size_t part) const { return mQuadMaterial[part]; }
+   
+   size_t _getVertexCount(size_t part) const;
+   
+   size_t _getIndexCount(size_t part) const;
+   
+   void _render(VertexWriter& vertices, Index16* indexes, size_t base, size_t part);
+   
+   void _render(VertexWriter& vertices, Index32* indexes, size_t base, size_t part);
+   
+   const Vertex* _getQuad(size_t part) const { return _isQuadDrawn(part) ? mQuadVertexData[part].mVertices : 0; }
    
    void _updateRequired();
    
+   /*! function. _isQuadDrawn
+       desc.
+           If a face is shown and not hidden by another Block.
+   */
+   bool _isQuadDrawn(size_t part) const { return mHasQuads[part] && mQuadHidden[part] == false; }
+   
+   /*! function. _getDrawnFaces
+       desc.
+           Faces that are drawn, as bits of 1 << QuadID.
+   */
+   size_t _getDrawnFaces() const;
+   
+   /*! function. _isInstanceable
+       desc.
+           If the Block can be drawn by BlockInstances; every face drawn has the same material
+           and the default texture settings.
+   */
+   bool _isInstanceable() const;
+   
+   /*! function. _getUnitQuad
+       desc.
+           Vertices of a face of a 1x1x1 Block at the origin, with the default texture settings.
+   */
+   static void _getUnitQuad(size_t part, Vertex* vertices);
+   
+   /*! function. setPosition
+   */
+   void setPosition(const Ogre::Vector3& position)
+   {
+    mGeometry->waitForRedraw();
+    mPosition = position;
+    _updateRequired();
+   }
+   
+   const Ogre::Vector3& getPosition() const { return mPosition; }
+   
+   /*! function. setSize
+   */
+   void setSize(const Ogre::Vector3& size)
+   {
+    mGeometry->waitForRedraw();
+    mSize = size;
+    _updateRequired();
+   }
+   
+   const Ogre::Vector3& getSize() const { return mSize; }
+   
+   /*! function. setOrientation
+   */
+   void setOrientation(const Ogre::Quaternion& orientation)
+   {
+    mGeometry->waitForRedraw();
+    mOrientation = orientation;
+    _updateRequired();
+   }
+   
+   const Ogre::Quaternion& getOrientation() const { return mOrientation; }
+   
+   /*! function. isQuadHidden
+       desc.
+           If a face is covered by another Block, see Geometry::setHiddenFaceRemoval.
+   */
+   bool isQuadHidden(QuadID id) const { return mQuadHidden[id]; }
+   
    void quad_show(QuadID id)
    {
+    mGeometry->waitForRedraw(); // mHasQuads is read by a background redraw.
+    if (mHasQuads[id])
+     return;
+    mGeometry->_removeBlock(this);
     mHasQuads[id] = true;
     _updateRequired();
-    redrawNeeded(mQuadMaterial[id]);
+    mGeometry->_addBlock(this);
    }
    
    void quad_hide(QuadID id)
    {
+    mGeometry->waitForRedraw();
+    if (mHasQuads[id] == false)
+     return;
+    mGeometry->_removeBlock(this);
     mHasQuads[id] = false;
     _updateRequired();
-    redrawNeeded(mQuadMaterial[id]);
-   }
-
+    mGeometry->_addBlock(this);
+   }
+
    void quad_index(QuadID id, size_t index)
    {
+    mGeometry->waitForRedraw();
+    mGeometry->_removeBlock(this);
     mHasQuads[id] = true;
-   size_t old_index = mQuadMaterial[id];
     mQuadMaterial[id] = index;
     _updateRequired();
-    redrawNeeded(index);
-    //redrawNeeded(old_index);
+    mGeometry->_addBlock(this);
    }
 
  protected:
    
    bool                          mHasQuads[6];
+   bool                          mQuadHidden[6];
+   std::vector<GeometryCell::Key> mFaceKeys;
+   bool                          mAdded;
+   BlockInstances*               mInstances;
+   size_t                        mInstanceSlot;
    Ogre::Vector3                 mPosition, mSize;
    Ogre::Quaternion              mOrientation;
    struct QuadVertexData
@@ -795,6 +3150,8 @@ class Block : public MultiBrush, public Ogre::GeneralAllocatedObject
    
    static const Ogre::Vector3    BLOCK_VERTICES[8];
    
+   template<typename IndexType> void _renderTo(VertexWriter& vertices, IndexType* indexes, size_t base, size_t part);
+   
 };
 
 } // namespace Orangutan
@@ -0,0 +1,101 @@
+#include <OGRE/Ogre.h>
+
+#include "Orangutan.h"
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+// Times turning a grid of heights into Vertices; the three passes Displacement used to make
+// (grid and uv, uv rotation, then transform and AABB) against GridKernel at each SimdLevel.
+// Needs OgreMain, but not a render system or a window.
+
+static const size_t RUNS = 20;
+
+static void threePasses(const std::vector<float>& heights, const std::vector<Ogre::ColourValue>& colours, size_t length, const Ogre::Matrix4& transform, const Ogre::Vector2& uvPerSample, const Ogre::Radian& uvAngle, std::vector<Orangutan::Vertex>& vertices, Ogre::AxisAlignedBox& aabb)
+{
+
+ Ogre::VertexElementType colourType = Ogre::VET_COLOUR_ABGR;
+ size_t i = 0;
+ Ogre::Real texX = 0, texY = 0;
+ for (size_t z=0;z < length;z++)
+ {
+  for (size_t x=0;x < length;x++)
+  {
+   Orangutan::Vertex& vertex = vertices[i];
+   vertex.position = Ogre::Vector3(Ogre::Real(x), heights[i], Ogre::Real(z));
+   vertex.colour = Orangutan::packColour(colours[i], colourType);
+   vertex.uv = Ogre::Vector2(texX, texY);
+   texX += uvPerSample.x;
+   i++;
+  }
+  texX = 0;
+  texY += uvPerSample.y;
+ }
+
+ Ogre::Quaternion q;
+ q.FromAngleAxis(uvAngle, Ogre::Vector3::UNIT_Y);
+ for (i=0;i < vertices.size();i++)
+ {
+  Ogre::Vector3 t = q * Ogre::Vector3(vertices[i].uv.x, 0, vertices[i].uv.y);
+  vertices[i].uv = Ogre::Vector2(t.x, t.z);
+ }
+
+ aabb.setNull();
+ Ogre::Real half = Ogre::Real(length) * 0.5f;
+ for (i=0;i < vertices.size();i++)
+ {
+  vertices[i].position.x -= half;
+  vertices[i].position.z -= half;
+  vertices[i].position = transform * vertices[i].position;
+  aabb.merge(vertices[i].position);
+ }
+
+}
+
+static void benchmark(size_t length)
+{
+
+ std::vector<float> heights(length * length);
+ std::vector<Ogre::ColourValue> colours(length * length, Ogre::ColourValue::White);
+ std::vector<Orangutan::Vertex> vertices(length * length);
+ for (size_t i=0;i < heights.size();i++)
+  heights[i] = Ogre::Math::UnitRandom() * 10.0f;
+
+ Ogre::Matrix4 transform;
+ transform.makeTransform(Ogre::Vector3(10, 0, -5), Ogre::Vector3(0.25f, 1, 0.25f), Ogre::Quaternion(Ogre::Degree(30), Ogre::Vector3::UNIT_Y));
+ Ogre::Vector2 uvPerSample(2.0f / Ogre::Real(length - 1), 2.0f / Ogre::Real(length - 1));
+ Ogre::Radian uvAngle = Ogre::Degree(45);
+ Ogre::AxisAlignedBox aabb;
+ Ogre::Timer timer;
+
+ timer.reset();
+ for (size_t run=0;run < RUNS;run++)
+  threePasses(heights, colours, length, transform, uvPerSample, uvAngle, vertices, aabb);
+ double baseline = double(timer.getMicroseconds()) / RUNS;
+
+ std::cout << length << "x" << length << "\n";
+ std::cout << "  three passes  " << std::setw(10) << std::fixed << std::setprecision(1) << baseline << " us\n";
+
+ Orangutan::GridKernel kernel(transform, length, length, uvPerSample, uvAngle, Ogre::VET_COLOUR_ABGR);
+ const char* names[] = {"scalar", "SSE2", "AVX2"};
+ for (size_t level=Orangutan::SimdLevel_Scalar;level <= Orangutan::SimdLevel_Best;level++)
+ {
+  timer.reset();
+  for (size_t run=0;run < RUNS;run++)
+  {
+   aabb.setNull();
+   kernel.run(&heights[0], &colours[0], &vertices[0], 0, 0, length, length, aabb, Orangutan::SimdLevel(level));
+  }
+  double time = double(timer.getMicroseconds()) / RUNS;
+  std::cout << "  kernel " << std::setw(6) << names[level] << " " << std::setw(10) << time << " us  x" << std::setprecision(2) << (baseline / time) << std::setprecision(1) << "\n";
+ }
+
+}
+
+int main()
+{
+ benchmark(256);
+ benchmark(1024);
+ return 0;
+}